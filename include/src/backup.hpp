@@ -0,0 +1,191 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "database.hpp"
+#include "logging.hpp"
+#include "result_code_container.hpp"
+
+namespace sqlite {
+
+  struct backup_config {
+    // Number of pages copied by a single sqlite3_backup_step() call
+    int pages_per_step = 64;
+    // Throttling budget, 0 means unlimited
+    double pages_per_second = 0;
+    // Pause before retrying a step that found the source locked by a writer
+    std::chrono::milliseconds busy_backoff = std::chrono::milliseconds(10);
+    // How long the source may stay locked before the copy gives up with the last
+    // SQLITE_BUSY or SQLITE_LOCKED. Steps only return those after the busy handler of the
+    // source connection, if it has one, has given up, so this comes on top of its deadline.
+    std::chrono::milliseconds busy_timeout = std::chrono::milliseconds(30000);
+    // Called from the copying thread after each step with (remaining, page_count)
+    std::function<void(int, int)> on_progress;
+  };
+
+  // Online backup on top of sqlite3_backup_init/step/finish. The source database stays
+  // available to writers: pages are copied in small steps, optionally from a background
+  // thread with a pages-per-second budget, backing off whenever a step finds the source locked.
+  // The destination connection must not be used until the backup has finished.
+  class backup : public result_code_container {
+  public:
+    typedef backup type;
+    typedef std::shared_ptr<type> type_ptr;
+    typedef backup_config config;
+
+    backup(const database::type_ptr& destination, const database::type_ptr& source,
+           const std::string& destination_name = "main",
+           const std::string& source_name = "main") :
+      result_code_container(),
+      destination_(destination),
+      source_(source),
+      backup_(nullptr),
+      remaining_(0),
+      page_count_(0),
+      done_(false),
+      cancelled_(false),
+      thread_result_code_(SQLITE_OK) {
+      if ((destination_->db() == nullptr) || (source_->db() == nullptr)) {
+        result_code_ = SQLITE_ERROR;
+        return;
+      }
+      backup_ = sqlite3_backup_init(destination_->db().get(), destination_name.c_str(),
+                                    source_->db().get(), source_name.c_str());
+      if (backup_ == nullptr) {
+        result_code_ = sqlite3_errcode(destination_->db().get());
+        SQLITE_HPP_LOG("backup::backup sqlite3_backup_init failed");
+      }
+    }
+
+    backup(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    ~backup() {
+      cancel();
+      wait();
+      finish();
+    }
+
+    // Copies up to n_pages pages (all remaining ones if negative) on the calling thread
+    const int step(const int n_pages) {
+      if (backup_ == nullptr) return result_code_;
+      result_code_ = step_(n_pages);
+      return result_code_;
+    }
+
+    // Starts copying from a background thread. result_code() is updated once wait() returns.
+    void start(const config& cfg = config()) {
+      if ((backup_ == nullptr) || thread_.joinable()) return;
+      cancelled_ = false;
+      thread_ = std::thread([this, cfg] () { run_(cfg); });
+    }
+
+    // Blocks until the background copy finishes or is cancelled
+    const int wait() {
+      if (thread_.joinable()) {
+        thread_.join();
+        result_code_ = thread_result_code_;
+      }
+      return result_code_;
+    }
+
+    // Stops the background copy after the current step
+    void cancel() {
+      cancelled_ = true;
+    }
+
+    const int finish() {
+      if (backup_ != nullptr) {
+        wait();
+        const int rc = sqlite3_backup_finish(backup_);
+        backup_ = nullptr;
+        if ((result_code_ == SQLITE_OK) || (result_code_ == SQLITE_DONE)) result_code_ = rc;
+      }
+      return result_code_;
+    }
+
+    bool done() const {
+      return done_;
+    }
+
+    // Page counts are only known after the first step
+    const int remaining() const {
+      return remaining_;
+    }
+
+    const int page_count() const {
+      return page_count_;
+    }
+
+    double progress() const {
+      if (done_) return 1.0;
+      const int total = page_count_;
+      if (total == 0) return 0.0;
+      return double(total - remaining_) / double(total);
+    }
+
+  private:
+    int step_(const int n_pages) {
+      const int rc = sqlite3_backup_step(backup_, n_pages);
+      remaining_ = sqlite3_backup_remaining(backup_);
+      page_count_ = sqlite3_backup_pagecount(backup_);
+      if (rc == SQLITE_DONE) done_ = true;
+      return rc;
+    }
+
+    void run_(const config cfg) {
+      typedef std::chrono::steady_clock clock;
+      const clock::time_point started = clock::now();
+      int64_t pages_copied = 0;
+      int rc = SQLITE_OK;
+      clock::time_point locked_since = clock::time_point::max();
+      while (!cancelled_) {
+        const int before = page_count_ == 0 ? -1 : remaining_.load();
+        rc = step_(cfg.pages_per_step);
+        if (cfg.on_progress) cfg.on_progress(remaining_, page_count_);
+        if (rc == SQLITE_DONE) break;
+        if ((rc == SQLITE_BUSY) || (rc == SQLITE_LOCKED)) {
+          const clock::time_point now = clock::now();
+          if (locked_since == clock::time_point::max()) locked_since = now;
+          if (now - locked_since >= cfg.busy_timeout) {
+            SQLITE_HPP_LOG("backup::run_ Source stayed locked past busy_timeout, giving up");
+            break;
+          }
+          SQLITE_HPP_LOG("backup::run_ Source is locked, backing off");
+          std::this_thread::sleep_for(cfg.busy_backoff);
+          continue;
+        }
+        if (rc != SQLITE_OK) break;
+        locked_since = clock::time_point::max();
+        pages_copied += before < 0 ? page_count_ - remaining_ : std::max(0, before - remaining_);
+        if (cfg.pages_per_second > 0) {
+          const clock::time_point due = started +
+            std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(pages_copied / cfg.pages_per_second));
+          std::this_thread::sleep_until(due);
+        } else {
+          // Let writers in between steps even without a budget
+          std::this_thread::yield();
+        }
+      }
+      thread_result_code_ = rc;
+    }
+
+    database::type_ptr destination_;
+    database::type_ptr source_;
+    ::sqlite3_backup* backup_;
+    std::atomic<int> remaining_;
+    std::atomic<int> page_count_;
+    std::atomic<bool> done_;
+    std::atomic<bool> cancelled_;
+    int thread_result_code_;
+    std::thread thread_;
+  };
+}
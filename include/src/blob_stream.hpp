@@ -0,0 +1,375 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "database.hpp"
+#include "logging.hpp"
+#include "result_code_container.hpp"
+
+namespace sqlite {
+
+  // Incremental I/O on a single blob value through sqlite3_blob_open/read/write. The handle is
+  // tied to one column and can be moved between rows with reopen(), which is much cheaper than
+  // opening a new one. The size of a blob cannot change through the handle: preallocate it by
+  // inserting a zeroblob and fill it in place. Changing the row by other means aborts the
+  // handle, after which reads and writes fail with SQLITE_ABORT until reopen().
+  class blob_handle : public result_code_container {
+  public:
+    typedef blob_handle type;
+    typedef std::shared_ptr<type> type_ptr;
+
+    blob_handle(const database::type_ptr& db, const std::string& table_name, const std::string& column,
+                const int64_t rowid, const bool writable = false, const std::string& schema = "main") :
+      result_code_container(),
+      db_(db),
+      blob_(nullptr),
+      rowid_(rowid),
+      size_(0) {
+      result_code_ = sqlite3_blob_open(db_->db().get(), schema.c_str(), table_name.c_str(), column.c_str(),
+                                       sqlite3_int64(rowid), writable ? 1 : 0, &blob_);
+      if (result_code_ == SQLITE_OK) {
+        size_ = size_t(sqlite3_blob_bytes(blob_));
+      } else {
+        SQLITE_HPP_LOG("blob_handle::blob_handle Failed to open " + table_name + "." + column);
+        // A handle may be returned even on failure
+        sqlite3_blob_close(blob_);
+        blob_ = nullptr;
+      }
+    }
+
+    blob_handle(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    ~blob_handle() {
+      if (blob_ != nullptr) sqlite3_blob_close(blob_);
+    }
+
+    bool is_open() const {
+      return blob_ != nullptr;
+    }
+
+    int64_t rowid() const {
+      return rowid_;
+    }
+
+    // Size of the blob in bytes
+    size_t size() const {
+      return size_;
+    }
+
+    // Points the handle at the same column of another row
+    const int reopen(const int64_t rowid) {
+      if (blob_ == nullptr) {
+        result_code_ = SQLITE_MISUSE;
+        return result_code_;
+      }
+      result_code_ = sqlite3_blob_reopen(blob_, sqlite3_int64(rowid));
+      rowid_ = rowid;
+      size_ = result_code_ == SQLITE_OK ? size_t(sqlite3_blob_bytes(blob_)) : 0;
+      return result_code_;
+    }
+
+    // Reads n bytes from offset, which has to lie within the blob with them
+    const int read(void* out, const size_t n, const size_t offset) {
+      if (blob_ == nullptr) {
+        result_code_ = SQLITE_MISUSE;
+        return result_code_;
+      }
+      result_code_ = sqlite3_blob_read(blob_, out, int(n), int(offset));
+      return result_code_;
+    }
+
+    const int write(const void* in, const size_t n, const size_t offset) {
+      if (blob_ == nullptr) {
+        result_code_ = SQLITE_MISUSE;
+        return result_code_;
+      }
+      result_code_ = sqlite3_blob_write(blob_, in, int(n), int(offset));
+      return result_code_;
+    }
+
+  private:
+    database::type_ptr db_;
+    ::sqlite3_blob* blob_;
+    int64_t rowid_;
+    size_t size_;
+  };
+
+  // std::streambuf reading a blob_handle in chunks of `chunk_size` bytes. Reads larger than a
+  // chunk go straight to the caller's buffer. Seekable within the blob.
+  class blob_istreambuf : public std::streambuf {
+  public:
+    typedef blob_istreambuf type;
+
+    static const size_t default_chunk_size = 64 * 1024;
+
+    explicit blob_istreambuf(blob_handle& blob, const size_t chunk_size = default_chunk_size) :
+      blob_(blob),
+      buf_(std::max(chunk_size, size_t(1))),
+      offset_(0) {
+      setg(buf_.data(), buf_.data(), buf_.data());
+    }
+
+    // Starts over at the beginning, e.g. after blob_handle::reopen()
+    void rewind() {
+      offset_ = 0;
+      setg(buf_.data(), buf_.data(), buf_.data());
+    }
+
+  protected:
+    int_type underflow() override {
+      if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+      offset_ += size_t(egptr() - eback());
+      const size_t n = std::min(buf_.size(), remaining());
+      setg(buf_.data(), buf_.data(), buf_.data());
+      if ((n == 0) || (blob_.read(buf_.data(), n, offset_) != SQLITE_OK)) return traits_type::eof();
+      setg(buf_.data(), buf_.data(), buf_.data() + n);
+      return traits_type::to_int_type(*gptr());
+    }
+
+    std::streamsize xsgetn(char* s, std::streamsize count) override {
+      std::streamsize done = 0;
+      while (done < count) {
+        const std::streamsize buffered = egptr() - gptr();
+        if (buffered > 0) {
+          const std::streamsize n = std::min(buffered, count - done);
+          std::memcpy(s + done, gptr(), size_t(n));
+          gbump(int(n));
+          done += n;
+          continue;
+        }
+        // Large reads bypass the chunk buffer
+        if (size_t(count - done) >= buf_.size()) {
+          offset_ += size_t(egptr() - eback());
+          setg(buf_.data(), buf_.data(), buf_.data());
+          const size_t n = std::min(size_t(count - done), remaining());
+          if ((n == 0) || (blob_.read(s + done, n, offset_) != SQLITE_OK)) break;
+          offset_ += n;
+          done += std::streamsize(n);
+          continue;
+        }
+        if (underflow() == traits_type::eof()) break;
+      }
+      return done;
+    }
+
+    std::streamsize showmanyc() override {
+      const size_t left = remaining() - size_t(gptr() - eback());
+      return left > 0 ? std::streamsize(left) : -1;
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+      if (!(which & std::ios_base::in)) return pos_type(off_type(-1));
+      const off_type current = off_type(offset_) + off_type(gptr() - eback());
+      off_type target = off;
+      if (dir == std::ios_base::cur) target += current;
+      if (dir == std::ios_base::end) target += off_type(blob_.size());
+      return seekpos(pos_type(target), which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+      if (!(which & std::ios_base::in) || (off_type(pos) < 0) || (size_t(off_type(pos)) > blob_.size())) {
+        return pos_type(off_type(-1));
+      }
+      offset_ = size_t(off_type(pos));
+      setg(buf_.data(), buf_.data(), buf_.data());
+      return pos;
+    }
+
+  private:
+    blob_handle& blob_;
+    std::vector<char> buf_;
+    // Blob offset of the start of the get area
+    size_t offset_;
+
+    // Bytes of the blob after the start of the get area
+    size_t remaining() const {
+      return offset_ < blob_.size() ? blob_.size() - offset_ : 0;
+    }
+  };
+
+  // std::streambuf writing a blob_handle in chunks of `chunk_size` bytes. Writes larger than a
+  // chunk go straight to the blob. Writing past the end of the blob fails, since its size is
+  // fixed. Seekable within the blob.
+  class blob_ostreambuf : public std::streambuf {
+  public:
+    typedef blob_ostreambuf type;
+
+    static const size_t default_chunk_size = 64 * 1024;
+
+    explicit blob_ostreambuf(blob_handle& blob, const size_t chunk_size = default_chunk_size) :
+      blob_(blob),
+      buf_(std::max(chunk_size, size_t(1))),
+      offset_(0) {
+      setp(buf_.data(), buf_.data() + buf_.size());
+    }
+
+    ~blob_ostreambuf() {
+      sync();
+    }
+
+    // Writes out the buffered bytes and starts over at the beginning, e.g. before
+    // blob_handle::reopen()
+    int rewind() {
+      const int rc = sync();
+      offset_ = 0;
+      return rc;
+    }
+
+  protected:
+    int_type overflow(int_type c) override {
+      if (sync() != 0) return traits_type::eof();
+      if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+      return c;
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize count) override {
+      std::streamsize done = 0;
+      while (done < count) {
+        const std::streamsize room = epptr() - pptr();
+        if ((pptr() == pbase()) && (size_t(count - done) >= buf_.size())) {
+          // Large writes bypass the chunk buffer
+          const size_t n = size_t(count - done);
+          const size_t written = write_out(s + done, n);
+          done += std::streamsize(written);
+          if (written < n) break;
+        } else if (room > 0) {
+          const std::streamsize n = std::min(room, count - done);
+          std::memcpy(pptr(), s + done, size_t(n));
+          pbump(int(n));
+          done += n;
+        } else if (sync() != 0) {
+          break;
+        }
+      }
+      return done;
+    }
+
+    // Bytes that do not fit in the blob are dropped
+    int sync() override {
+      const size_t n = size_t(pptr() - pbase());
+      if (n == 0) return 0;
+      const size_t written = write_out(pbase(), n);
+      setp(buf_.data(), buf_.data() + buf_.size());
+      return written == n ? 0 : -1;
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+      if (!(which & std::ios_base::out)) return pos_type(off_type(-1));
+      const off_type current = off_type(offset_) + off_type(pptr() - pbase());
+      off_type target = off;
+      if (dir == std::ios_base::cur) target += current;
+      if (dir == std::ios_base::end) target += off_type(blob_.size());
+      return seekpos(pos_type(target), which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+      if (!(which & std::ios_base::out) || (off_type(pos) < 0) || (size_t(off_type(pos)) > blob_.size())) {
+        return pos_type(off_type(-1));
+      }
+      if (sync() != 0) return pos_type(off_type(-1));
+      offset_ = size_t(off_type(pos));
+      return pos;
+    }
+
+  private:
+    blob_handle& blob_;
+    std::vector<char> buf_;
+    // Blob offset of the start of the put area
+    size_t offset_;
+
+    // Writes as much of the n bytes as fits in the blob, returns the number written
+    size_t write_out(const char* p, const size_t n) {
+      const size_t fits = offset_ < blob_.size() ? std::min(n, blob_.size() - offset_) : 0;
+      if ((fits > 0) && (blob_.write(p, fits, offset_) != SQLITE_OK)) {
+        SQLITE_HPP_LOG("blob_ostreambuf::write_out Failed to write the blob");
+        return 0;
+      }
+      offset_ += fits;
+      if (fits < n) {
+        SQLITE_HPP_LOG("blob_ostreambuf::write_out Write beyond the end of the blob");
+      }
+      return fits;
+    }
+  };
+
+  // std::istream over a blob, holding its handle and buffer: memory use is one chunk whatever
+  // the size of the blob
+  class blob_istream : public std::istream {
+  public:
+    typedef blob_istream type;
+
+    blob_istream(const database::type_ptr& db, const std::string& table_name, const std::string& column,
+                 const int64_t rowid, const size_t chunk_size = blob_istreambuf::default_chunk_size,
+                 const std::string& schema = "main") :
+      std::istream(nullptr),
+      blob_(db, table_name, column, rowid, false, schema),
+      buf_(blob_, chunk_size) {
+      rdbuf(&buf_);
+      if (!blob_.is_open()) setstate(std::ios_base::failbit);
+    }
+
+    // Moves on to the same column of another row and reads it from the beginning
+    const int reopen(const int64_t rowid) {
+      clear();
+      buf_.rewind();
+      if (blob_.reopen(rowid) != SQLITE_OK) setstate(std::ios_base::failbit);
+      return blob_.result_code();
+    }
+
+    blob_handle& blob() {
+      return blob_;
+    }
+
+  private:
+    blob_handle blob_;
+    blob_istreambuf buf_;
+  };
+
+  // std::ostream over a blob preallocated with zeroblob, see blob_istream
+  class blob_ostream : public std::ostream {
+  public:
+    typedef blob_ostream type;
+
+    blob_ostream(const database::type_ptr& db, const std::string& table_name, const std::string& column,
+                 const int64_t rowid, const size_t chunk_size = blob_ostreambuf::default_chunk_size,
+                 const std::string& schema = "main") :
+      std::ostream(nullptr),
+      blob_(db, table_name, column, rowid, true, schema),
+      buf_(blob_, chunk_size) {
+      rdbuf(&buf_);
+      if (!blob_.is_open()) setstate(std::ios_base::failbit);
+    }
+
+    // Writes out the current row and moves on to the same column of another row
+    const int reopen(const int64_t rowid) {
+      if (buf_.rewind() != 0) {
+        setstate(std::ios_base::badbit);
+        return blob_.result_code() != SQLITE_OK ? blob_.result_code() : SQLITE_FULL;
+      }
+      clear();
+      if (blob_.reopen(rowid) != SQLITE_OK) setstate(std::ios_base::failbit);
+      return blob_.result_code();
+    }
+
+    blob_handle& blob() {
+      return blob_;
+    }
+
+  private:
+    blob_handle blob_;
+    blob_ostreambuf buf_;
+  };
+}
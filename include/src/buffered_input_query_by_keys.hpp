@@ -7,6 +7,7 @@
 #include <tuple>
 
 #include "logging.hpp"
+#include "memory.hpp"
 #include "query.hpp"
 
 namespace sqlite {
@@ -99,14 +100,14 @@ namespace sqlite {
         pull();
         step();
         if (this->result_code_ == SQLITE_ROW) {
-          return iterator(type_ptr(this, [] (type *) {}), false);
+          return iterator(this, false);
         } else {
-          return iterator(type_ptr(this, [] (type *) {}), true);
+          return iterator(this, true);
         }
       }
 
       iterator end() {
-        return iterator(type_ptr(this, [] (type *) {}), true);
+        return iterator(this, true);
       }
                               
       void add_key(const key_tuple_type& key) {
@@ -180,7 +181,7 @@ namespace sqlite {
       int max_compound_select_;
       int max_sql_length_;
       int max_variable_number_;
-      std::set<key_tuple_type> keys_buf_;
+      std::set<key_tuple_type, std::less<key_tuple_type>, tracking_allocator<key_tuple_type>> keys_buf_;
       
     };
 
@@ -198,14 +199,14 @@ namespace sqlite {
       typedef record_tuple_t record_tuple_type;
       typedef record_tuple_t value_type;
 
-      input_query_iterator(const typename query_type::type_ptr& q) :
+      input_query_iterator(query_type* q) :
         result_code_container(), 
         q_(q),
         end_(false),
         pos_(0) {
       }
 
-      input_query_iterator(const typename query_type::type_ptr& q, bool end) :
+      input_query_iterator(query_type* q, bool end) :
         result_code_container(),
         q_(q),
         end_(end),
@@ -227,7 +228,7 @@ namespace sqlite {
       }
 
       void swap(input_query_iterator &other) {
-        typename query_type::type_ptr tmp_q(other.q_);
+        query_type* tmp_q(other.q_);
       }
     
       type operator=(const input_query_iterator &other) {
@@ -256,11 +257,11 @@ namespace sqlite {
 
       record_tuple_type operator*() {
         record_tuple_type* dummy_ptr(nullptr);
-        return q_->get_tuple(dummy_ptr);
+        return q_->get_record(dummy_ptr);
       }
 
     private:
-      typename query_type::type_ptr q_;
+      query_type* q_;
       bool end_;
       size_t pos_;
           
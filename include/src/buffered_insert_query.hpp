@@ -3,6 +3,7 @@
 #include <tuple>
 
 #include "logging.hpp"
+#include "memory.hpp"
 #include "query.hpp"
 #include "input_query.hpp"
 #include "value_access_policy.hpp"
@@ -45,7 +46,7 @@ namespace sqlite {
           fields_str += "`" + f + "`";
         }
 
-        const size_t record_sz = std::tuple_size<value_type>::value;
+        const size_t record_sz = record_size<value_type>::value;
         for (size_t i = 0; i < record_sz; ++i) {
           if (values_placeholders_str_.length() > 0) values_placeholders_str_ += ", ";
           values_placeholders_str_ += "?";
@@ -102,7 +103,7 @@ namespace sqlite {
       }
 
       void push_back(const record_tuple_type& r) {
-        const size_t record_sz = std::tuple_size<value_type>::value;
+        const size_t record_sz = record_size<value_type>::value;
         if ((this->result_code_ == SQLITE_OK) || (this->result_code_ == SQLITE_DONE)) {
           SQLITE_HPP_LOG(std::string("insert_query::push_back Estimated query size + delta: buf_.size() = ") + std::to_string(buf_.size()) +
                          " (max = " + std::to_string(max_compound_select_) +
@@ -149,10 +150,11 @@ namespace sqlite {
           if (this->result_code_ != SQLITE_OK) return;
           SQLITE_HPP_LOG("insert_query::flush Prepare result ok.");
         
-          const size_t record_sz = std::tuple_size<value_type>::value;
+          const size_t record_sz = record_size<value_type>::value;
           int idx = 1;
+          // buf_ is only cleared after the step, so the records don't have to be copied by SQLite
           for (value_type &r : buf_) {
-            ::sqlite::query_base<value_access_policy_t>::bind_tuple(idx, r);
+            ::sqlite::query_base<value_access_policy_t>::bind_record_static(idx, r);
             if (this->result_code_ != SQLITE_OK) return;
             idx += record_sz;
           };
@@ -175,14 +177,15 @@ namespace sqlite {
       std::string query_prefix_str_;
       std::string values_placeholders_str_;
       const std::string record_separator_str_ = "\nUNION ALL ";
-      std::vector<value_type> buf_;
+      std::vector<value_type, tracking_allocator<value_type>> buf_;
 
     };
 
+    // insert_query<my_struct> binds the members of my_struct directly if it has a record_mapping
     template <typename... Rs>
-    class insert_query : public insert_query_base<std::tuple<Rs...>, default_value_access_policy> {
+    class insert_query : public insert_query_base<typename record_type<Rs...>::type, default_value_access_policy> {
     public:
-      using insert_query_base<std::tuple<Rs...>, default_value_access_policy>::insert_query_base;
+      using insert_query_base<typename record_type<Rs...>::type, default_value_access_policy>::insert_query_base;
     };
   }
 }
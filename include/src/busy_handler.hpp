@@ -0,0 +1,146 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <thread>
+
+#include "logging.hpp"
+
+namespace sqlite {
+
+  // Busy handler with jittered exponential backoff. Installed through sqlite3_busy_handler() with
+  // a binding per connection, so an instance may be shared by several connections: each keeps
+  // its own busy episodes, and the counters add up. Instead of retrying on a fixed period each
+  // retry sleeps for a random time in [0, min(max_delay, initial_delay * multiplier^n)], so that
+  // contending connections spread out instead of waking up together. Gives up (and lets
+  // SQLITE_BUSY through to result_code()) once the deadline for the connection's current busy
+  // episode has passed.
+  class busy_handler {
+  public:
+    typedef busy_handler type;
+    typedef std::shared_ptr<type> type_ptr;
+
+    struct config {
+      std::chrono::microseconds initial_delay = std::chrono::microseconds(500);
+      std::chrono::microseconds max_delay = std::chrono::microseconds(100000);
+      std::chrono::microseconds deadline = std::chrono::microseconds(5000000);
+      double multiplier = 2.0;
+      bool jitter = true;
+    };
+
+    // Snapshot of the contention counters
+    struct stats {
+      // Number of times a statement hit a lock (each busy episode counts once)
+      uint64_t busy_events;
+      // Number of sleeps performed while waiting for locks
+      uint64_t retries;
+      // Total time spent sleeping in the handler, microseconds
+      uint64_t wait_us;
+      // Number of episodes that ended with SQLITE_BUSY because of the deadline
+      uint64_t give_ups;
+    };
+
+    busy_handler() : busy_handler(config()) {
+    }
+
+    busy_handler(const config& cfg) :
+      config_(cfg),
+      busy_events_(0),
+      retries_(0),
+      wait_us_(0),
+      give_ups_(0) {
+    }
+
+    busy_handler(const busy_handler&) = delete;
+    busy_handler& operator=(const busy_handler&) = delete;
+
+    const config& get_config() const {
+      return config_;
+    }
+
+    stats get_stats() const {
+      stats s;
+      s.busy_events = busy_events_.load(std::memory_order_relaxed);
+      s.retries = retries_.load(std::memory_order_relaxed);
+      s.wait_us = wait_us_.load(std::memory_order_relaxed);
+      s.give_ups = give_ups_.load(std::memory_order_relaxed);
+      return s;
+    }
+
+    void reset_stats() {
+      busy_events_.store(0, std::memory_order_relaxed);
+      retries_.store(0, std::memory_order_relaxed);
+      wait_us_.store(0, std::memory_order_relaxed);
+      give_ups_.store(0, std::memory_order_relaxed);
+    }
+
+    // What sqlite3_busy_handler() gets for one connection: the handler and the start of the
+    // connection's current busy episode
+    struct binding {
+      type_ptr handler;
+      std::chrono::steady_clock::time_point episode_start;
+    };
+
+    // Returns non-zero if the operation should be retried
+    int on_busy(const int count, std::chrono::steady_clock::time_point& episode_start) {
+      typedef std::chrono::steady_clock clock;
+      const clock::time_point now = clock::now();
+      if (count == 0) {
+        busy_events_.fetch_add(1, std::memory_order_relaxed);
+        episode_start = now;
+      }
+      const std::chrono::microseconds elapsed =
+        std::chrono::duration_cast<std::chrono::microseconds>(now - episode_start);
+      if (elapsed >= config_.deadline) {
+        SQLITE_HPP_LOG("busy_handler::on_busy Deadline reached, giving up");
+        give_ups_.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+      }
+      const std::chrono::microseconds delay = next_delay(count, config_.deadline - elapsed);
+      std::this_thread::sleep_for(delay);
+      retries_.fetch_add(1, std::memory_order_relaxed);
+      wait_us_.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - now).count(),
+                         std::memory_order_relaxed);
+      return 1;
+    }
+
+    // p is a binding
+    static int callback(void* p, int count) {
+      binding* b = static_cast<binding*>(p);
+      return b->handler->on_busy(count, b->episode_start);
+    }
+
+  private:
+    std::chrono::microseconds next_delay(const int count, const std::chrono::microseconds remaining) {
+      double ceiling = double(config_.initial_delay.count());
+      const double max_delay = double(config_.max_delay.count());
+      for (int i = 0; (i < count) && (ceiling < max_delay); ++i) {
+        ceiling *= config_.multiplier;
+      }
+      ceiling = std::min(ceiling, max_delay);
+      int64_t delay_us = int64_t(ceiling);
+      if (config_.jitter && (delay_us > 0)) {
+        std::uniform_int_distribution<int64_t> uniform(0, delay_us);
+        delay_us = uniform(random());
+      }
+      return std::chrono::microseconds(std::min<int64_t>(delay_us, remaining.count()));
+    }
+
+    static std::minstd_rand& random() {
+      static thread_local std::minstd_rand engine(std::random_device{}());
+      return engine;
+    }
+
+    config config_;
+    std::atomic<uint64_t> busy_events_;
+    std::atomic<uint64_t> retries_;
+    std::atomic<uint64_t> wait_us_;
+    std::atomic<uint64_t> give_ups_;
+  };
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "logging.hpp"
+
+namespace sqlite {
+
+  // Cancels the queries it is attached to (query_base::set_cancellation()) from any thread.
+  // cancel() interrupts the connections stepping such a query with sqlite3_interrupt(); a
+  // query that is not running finds the token cancelled on its next step(). Either way the
+  // query's result_code() becomes SQLITE_INTERRUPT. A token stays cancelled.
+  class cancellation_token {
+  public:
+    typedef cancellation_token type;
+    typedef std::shared_ptr<type> type_ptr;
+
+    cancellation_token() :
+      cancelled_(false) {
+    }
+
+    cancellation_token(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    void cancel() {
+      SQLITE_HPP_LOG("cancellation_token::cancel");
+      cancelled_.store(true, std::memory_order_release);
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (::sqlite3* db : running_) sqlite3_interrupt(db);
+    }
+
+    bool cancelled() const {
+      return cancelled_.load(std::memory_order_acquire);
+    }
+
+    // Called around sqlite3_step() by the queries the token is attached to
+    void enter(::sqlite3* db) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_.push_back(db);
+    }
+
+    void leave(::sqlite3* db) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto found = std::find(running_.begin(), running_.end(), db);
+      if (found != running_.end()) running_.erase(found);
+    }
+
+  private:
+    std::atomic<bool> cancelled_;
+    std::mutex mutex_;
+    std::vector<::sqlite3*> running_;
+  };
+
+  // Deadline and cancellation token of a query, see query_base::set_deadline()
+  struct execution_limits {
+    typedef std::chrono::steady_clock clock;
+
+    clock::time_point deadline = clock::time_point::max();
+    cancellation_token::type_ptr token;
+
+    bool active() const {
+      return (deadline != clock::time_point::max()) || token;
+    }
+
+    bool exceeded() const {
+      if (token && token->cancelled()) return true;
+      return (deadline != clock::time_point::max()) && (clock::now() >= deadline);
+    }
+  };
+
+  // Checks the execution_limits of the running query every `interval` virtual machine
+  // instructions through the connection's progress handler and makes SQLite abandon the
+  // statement with SQLITE_INTERRUPT once they are exceeded. Obtained through
+  // database::progress(); queries with limits set themselves as current around each step.
+  class progress_monitor {
+  public:
+    typedef progress_monitor type;
+    typedef std::shared_ptr<type> type_ptr;
+
+    // A few microseconds of work at most between two checks of the clock
+    static const int default_interval = 1000;
+
+    progress_monitor() :
+      interval_(default_interval),
+      current_(nullptr) {
+    }
+
+    progress_monitor(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    int interval() const {
+      return interval_;
+    }
+
+    // Takes effect on the next install()
+    void set_interval(const int interval) {
+      interval_ = interval;
+    }
+
+    void install(::sqlite3* db) {
+      SQLITE_HPP_LOG("progress_monitor::install");
+      sqlite3_progress_handler(db, interval_, &callback, this);
+    }
+
+    static void uninstall(::sqlite3* db) {
+      sqlite3_progress_handler(db, 0, nullptr, nullptr);
+    }
+
+    // Makes limits current for the lifetime of the scope. Scopes nest, and only the
+    // connection's thread creates them.
+    class scope {
+    public:
+      scope(type& monitor, const execution_limits& limits) :
+        monitor_(monitor),
+        previous_(monitor.current_) {
+        monitor_.current_ = &limits;
+      }
+
+      scope(const scope&) = delete;
+      scope& operator=(const scope&) = delete;
+
+      ~scope() {
+        monitor_.current_ = previous_;
+      }
+
+    private:
+      type& monitor_;
+      const execution_limits* previous_;
+    };
+
+  private:
+    int interval_;
+    const execution_limits* current_;
+
+    // Non-zero interrupts the statement
+    static int callback(void* p) {
+      const execution_limits* limits = static_cast<type*>(p)->current_;
+      return ((limits != nullptr) && limits->exceeded()) ? 1 : 0;
+    }
+  };
+}
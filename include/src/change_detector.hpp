@@ -0,0 +1,57 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <atomic>
+#include <cstdint>
+
+#include "database.hpp"
+#include "query.hpp"
+
+namespace sqlite {
+
+  // Tells listeners of database::hooks() whether the database changed in ways the update hook
+  // did not report: commits of other connections (PRAGMA data_version of the main schema) and
+  // changes of this connection the hook skips, such as WITHOUT ROWID tables and DELETE without
+  // WHERE (sqlite3_total_changes() ahead of the calls to observed()).
+  // unobserved_changes() steps a statement: use it from the thread that uses the connection and
+  // without holding locks the hooks take.
+  class change_detector {
+  public:
+    typedef change_detector type;
+
+    change_detector(const database::type_ptr& db) :
+      db_(db),
+      data_version_query_(db, "PRAGMA data_version"),
+      total_changes_(0),
+      data_version_(0) {
+      unobserved_changes();
+    }
+
+    // To be called for every change reported by the update hook
+    void observed() {
+      total_changes_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // True if there were unreported changes since the last call
+    bool unobserved_changes() {
+      if (db_->db() == nullptr) return false;
+      const int64_t total_changes = sqlite3_total_changes(db_->db().get());
+      int64_t data_version = 0;
+      data_version_query_.step();
+      if (data_version_query_.result_code() == SQLITE_ROW) data_version = data_version_query_.get<int64_t>(0);
+      sqlite3_reset(data_version_query_.statement().get());
+      const bool changed = (total_changes != total_changes_.exchange(total_changes, std::memory_order_relaxed)) ||
+        (data_version != data_version_);
+      data_version_ = data_version;
+      return changed;
+    }
+
+  private:
+    database::type_ptr db_;
+    query data_version_query_;
+    // Changes made through the connection as counted by the update hook
+    std::atomic<int64_t> total_changes_;
+    int64_t data_version_;
+  };
+}
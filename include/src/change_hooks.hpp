@@ -0,0 +1,134 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "logging.hpp"
+
+// The preupdate hook is only compiled into SQLite, and declared by sqlite3.h, with
+// SQLITE_ENABLE_PREUPDATE_HOOK (3.13.0 and later)
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK) && (SQLITE_VERSION_NUMBER >= 3013000)
+#define SQLITE_HPP_HAS_PREUPDATE_HOOK 1
+#endif
+
+namespace sqlite {
+
+  // Receives the changes made through one connection, see change_hooks
+  class change_listener {
+  public:
+    virtual ~change_listener() {
+    }
+
+    // op is SQLITE_INSERT, SQLITE_UPDATE or SQLITE_DELETE. Not called for WITHOUT ROWID tables,
+    // for internal tables, for rows deleted by the truncate optimization (DELETE without WHERE)
+    // and for rows replaced by REPLACE conflict resolution.
+    virtual void on_update(const int /* op */, const char* /* db_name */, const char* /* table */,
+                           const int64_t /* rowid */) {
+    }
+
+#if defined(SQLITE_HPP_HAS_PREUPDATE_HOOK)
+    // Called before each change, with the values of the row available through sqlite3_preupdate_old()
+    // and sqlite3_preupdate_new() on db. Unlike on_update() also called for WITHOUT ROWID tables.
+    virtual void on_preupdate(::sqlite3* /* db */, const int /* op */, const char* /* db_name */,
+                              const char* /* table */, const int64_t /* old_rowid */,
+                              const int64_t /* new_rowid */) {
+    }
+#endif
+
+    // A transaction is about to commit
+    virtual void on_commit() {
+    }
+
+    // A transaction was rolled back; not called for ROLLBACK TO a savepoint
+    virtual void on_rollback() {
+    }
+  };
+
+  // SQLite keeps one update, commit, rollback and (see SQLITE_HPP_HAS_PREUPDATE_HOOK) preupdate
+  // hook per connection. change_hooks takes all of them and passes the calls on to any number of
+  // listeners, so that caches and indexes can follow the changes side by side. Obtained through
+  // database::hooks(). The hooks run on the thread that steps the statement, inside SQLite:
+  // listeners must not use the connection and must not add or remove listeners from the callbacks.
+  class change_hooks {
+  public:
+    typedef change_hooks type;
+    typedef std::shared_ptr<type> type_ptr;
+
+    change_hooks() {
+    }
+
+    change_hooks(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    // The listener has to be removed before it is destroyed
+    void add(change_listener* listener) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      listeners_.push_back(listener);
+    }
+
+    void remove(change_listener* listener) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      listeners_.erase(std::remove(listeners_.begin(), listeners_.end(), listener), listeners_.end());
+    }
+
+    // Registers the hooks on the connection, replacing any hooks installed directly
+    void install(::sqlite3* db) {
+      SQLITE_HPP_LOG("change_hooks::install");
+      sqlite3_update_hook(db, &update_callback, this);
+      sqlite3_commit_hook(db, &commit_callback, this);
+      sqlite3_rollback_hook(db, &rollback_callback, this);
+#if defined(SQLITE_HPP_HAS_PREUPDATE_HOOK)
+      sqlite3_preupdate_hook(db, &preupdate_callback, this);
+#endif
+    }
+
+    static void uninstall(::sqlite3* db) {
+      sqlite3_update_hook(db, nullptr, nullptr);
+      sqlite3_commit_hook(db, nullptr, nullptr);
+      sqlite3_rollback_hook(db, nullptr, nullptr);
+#if defined(SQLITE_HPP_HAS_PREUPDATE_HOOK)
+      sqlite3_preupdate_hook(db, nullptr, nullptr);
+#endif
+    }
+
+  private:
+    std::mutex mutex_;
+    std::vector<change_listener*> listeners_;
+
+    static void update_callback(void* p, int op, const char* db_name, const char* table, sqlite3_int64 rowid) {
+      type* self = static_cast<type*>(p);
+      std::lock_guard<std::mutex> lock(self->mutex_);
+      for (change_listener* l : self->listeners_) l->on_update(op, db_name, table, int64_t(rowid));
+    }
+
+#if defined(SQLITE_HPP_HAS_PREUPDATE_HOOK)
+    static void preupdate_callback(void* p, ::sqlite3* db, int op, const char* db_name, const char* table,
+                                   sqlite3_int64 old_rowid, sqlite3_int64 new_rowid) {
+      type* self = static_cast<type*>(p);
+      std::lock_guard<std::mutex> lock(self->mutex_);
+      for (change_listener* l : self->listeners_) {
+        l->on_preupdate(db, op, db_name, table, int64_t(old_rowid), int64_t(new_rowid));
+      }
+    }
+#endif
+
+    // Returning non-zero would turn the commit into a rollback; listeners only observe
+    static int commit_callback(void* p) {
+      type* self = static_cast<type*>(p);
+      std::lock_guard<std::mutex> lock(self->mutex_);
+      for (change_listener* l : self->listeners_) l->on_commit();
+      return 0;
+    }
+
+    static void rollback_callback(void* p) {
+      type* self = static_cast<type*>(p);
+      std::lock_guard<std::mutex> lock(self->mutex_);
+      for (change_listener* l : self->listeners_) l->on_rollback();
+    }
+  };
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <vector>
+
+#include "ct_integer_list.hpp"
+#include "record_mapping.hpp"
+
+namespace sqlite {
+
+  // Rows of a result set stored column by column: one contiguous std::vector per column, and a
+  // validity bitmap per column with a set bit for every non-NULL value (bit r % 64 of word r / 64).
+  // NULL values are stored as the null_value() of the column type, so the vectors can be scanned
+  // without looking at the bitmaps when NULLs are known to be absent or harmless.
+  template <typename... Ts>
+  class column_batch {
+  public:
+    typedef column_batch<Ts...> type;
+    typedef std::tuple<std::vector<Ts>...> columns_type;
+
+    template <size_t column>
+    using value_type = typename std::tuple_element<column, std::tuple<Ts...>>::type;
+
+    static const size_t column_count = sizeof...(Ts);
+
+    column_batch() :
+      size_(0),
+      validity_(sizeof...(Ts)) {
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    bool empty() const {
+      return size_ == 0;
+    }
+
+    template <size_t column>
+    const std::vector<value_type<column>>& get() const {
+      return std::get<column>(columns_);
+    }
+
+    template <size_t column>
+    std::vector<value_type<column>>& get() {
+      return std::get<column>(columns_);
+    }
+
+    const std::vector<uint64_t>& validity(const size_t column) const {
+      return validity_[column];
+    }
+
+    bool is_valid(const size_t column, const size_t row) const {
+      return (validity_[column][row / 64] >> (row % 64)) & 1;
+    }
+
+    size_t null_count(const size_t column) const {
+      size_t valid = 0;
+      for (uint64_t word : validity_[column]) {
+        valid += std::bitset<64>(word).count();
+      }
+      return size_ - valid;
+    }
+
+    // Drops the rows but keeps the capacity of the columns
+    void clear() {
+      clear_(typename ct_iota_0<sizeof...(Ts)>::type());
+      for (auto& v : validity_) v.clear();
+      size_ = 0;
+    }
+
+    void reserve(const size_t n) {
+      reserve_(n, typename ct_iota_0<sizeof...(Ts)>::type());
+      for (auto& v : validity_) v.reserve((n + 63) / 64);
+    }
+
+    // Appends the current row of a stepped query
+    template <typename query_t>
+    void append_row(query_t& q) {
+      if (size_ % 64 == 0) {
+        for (auto& v : validity_) v.push_back(0);
+      }
+      append_(q, typename ct_iota_0<sizeof...(Ts)>::type());
+      ++size_;
+    }
+
+  private:
+    size_t size_;
+    columns_type columns_;
+    std::vector<std::vector<uint64_t>> validity_;
+
+    template <size_t... indices>
+    void clear_(ct_integer_list<indices...>) {
+      const int expand[] = {0, (std::get<indices>(columns_).clear(), 0)...};
+      (void)expand;
+    }
+
+    template <size_t... indices>
+    void reserve_(const size_t n, ct_integer_list<indices...>) {
+      const int expand[] = {0, (std::get<indices>(columns_).reserve(n), 0)...};
+      (void)expand;
+    }
+
+    template <typename query_t, size_t... indices>
+    void append_(query_t& q, ct_integer_list<indices...>) {
+      const int expand[] = {0, (append_column_<indices>(q), 0)...};
+      (void)expand;
+    }
+
+    template <size_t column, typename query_t>
+    void append_column_(query_t& q) {
+      std::vector<value_type<column>>& values = std::get<column>(columns_);
+      values.emplace_back();
+      // The type has to be read before decoding, which may convert the value
+      if (::sqlite3_column_type(q.statement().get(), int(column)) != SQLITE_NULL) {
+        q.get_into(int(column), values.back());
+        validity_[column].back() |= uint64_t(1) << (size_ % 64);
+      }
+    }
+  };
+
+  // column_batch matching a record: the tuple elements, or the mapped members of a struct
+  template <typename fields_tuple_t>
+  struct column_batch_of_fields;
+
+  template <typename... fields_t>
+  struct column_batch_of_fields<std::tuple<fields_t...>> {
+    typedef column_batch<typename fields_t::value_type...> type;
+  };
+
+  template <typename record_t>
+  struct column_batch_of {
+    typedef typename column_batch_of_fields<typename record_mapping<record_t>::fields_type>::type type;
+  };
+
+  template <typename... Tp>
+  struct column_batch_of<std::tuple<Tp...>> {
+    typedef column_batch<Tp...> type;
+  };
+}
@@ -0,0 +1,441 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__AVX2__) && !defined(SQLITE_HPP_NO_SIMD)
+#define SQLITE_HPP_HAS_AVX2 1
+#include <immintrin.h>
+#endif
+
+// Aggregation and filter kernels over the columns of a column_batch (see column_batch.hpp):
+// sum, min/max, count-where and histogram of int64_t and double columns. Rows whose validity
+// bit is clear (NULLs) are skipped; a null validity pointer means every row is valid.
+// Runs of 64 valid rows are processed with AVX2 when the code is compiled with it enabled
+// (e.g. -mavx2 or -march=native), and with plain loops otherwise or when SQLITE_HPP_NO_SIMD
+// is defined.
+//
+// int64_t sums wrap around on overflow instead of failing like SQLite's SUM(). Double sums
+// are accumulated in a different order with AVX2 and may differ in the last bits. SQLite
+// stores no NaNs, so min/max do not handle them.
+
+namespace sqlite {
+  namespace kernels {
+
+    enum class compare_op {
+      less,
+      less_equal,
+      equal,
+      not_equal,
+      greater_equal,
+      greater
+    };
+
+    template <typename T>
+    struct min_max_result {
+      T min;
+      T max;
+      // Number of valid rows; min and max are meaningless when it is 0
+      size_t count;
+    };
+
+    namespace detail {
+      // Calls dense(begin, end) for ranges of rows that are all valid and sparse(row) for valid
+      // rows of the 64-row blocks that contain NULLs
+      template <typename dense_fn, typename sparse_fn>
+      void for_each_valid(const size_t n, const uint64_t* validity, dense_fn dense, sparse_fn sparse) {
+        if (validity == nullptr) {
+          if (n > 0) dense(size_t(0), n);
+          return;
+        }
+        size_t dense_begin = 0;
+        size_t dense_end = 0;
+        for (size_t begin = 0; begin < n; begin += 64) {
+          const size_t end = std::min(n, begin + 64);
+          const uint64_t all = (end - begin == 64) ? ~uint64_t(0) : ((uint64_t(1) << (end - begin)) - 1);
+          const uint64_t word = validity[begin / 64] & all;
+          if (word == all) {
+            // Adjacent full blocks are handed to dense() together
+            if (dense_end != begin) {
+              if (dense_end > dense_begin) dense(dense_begin, dense_end);
+              dense_begin = begin;
+            }
+            dense_end = end;
+          } else if (word != 0) {
+            for (size_t i = 0; i < end - begin; ++i) {
+              if ((word >> i) & 1) sparse(begin + i);
+            }
+          }
+        }
+        if (dense_end > dense_begin) dense(dense_begin, dense_end);
+      }
+
+      inline bool compare(const compare_op op, const int64_t a, const int64_t b) {
+        switch (op) {
+        case compare_op::less: return a < b;
+        case compare_op::less_equal: return a <= b;
+        case compare_op::equal: return a == b;
+        case compare_op::not_equal: return a != b;
+        case compare_op::greater_equal: return a >= b;
+        case compare_op::greater: return a > b;
+        }
+        return false;
+      }
+
+      inline bool compare(const compare_op op, const double a, const double b) {
+        switch (op) {
+        case compare_op::less: return a < b;
+        case compare_op::less_equal: return a <= b;
+        case compare_op::equal: return a == b;
+        case compare_op::not_equal: return a != b;
+        case compare_op::greater_equal: return a >= b;
+        case compare_op::greater: return a > b;
+        }
+        return false;
+      }
+
+      // Dense kernels: scalar loops, and AVX2 versions that finish the last < 4 rows with them
+
+      inline uint64_t sum_scalar(const int64_t* v, const size_t begin, const size_t end) {
+        uint64_t s = 0;
+        for (size_t i = begin; i < end; ++i) s += uint64_t(v[i]);
+        return s;
+      }
+
+      inline double sum_scalar(const double* v, const size_t begin, const size_t end) {
+        double s = 0;
+        for (size_t i = begin; i < end; ++i) s += v[i];
+        return s;
+      }
+
+      template <typename T>
+      void min_max_scalar(const T* v, const size_t begin, const size_t end, T& mn, T& mx) {
+        for (size_t i = begin; i < end; ++i) {
+          if (v[i] < mn) mn = v[i];
+          if (v[i] > mx) mx = v[i];
+        }
+      }
+
+      template <typename T>
+      size_t count_where_scalar(const T* v, const size_t begin, const size_t end, const compare_op op, const T operand) {
+        size_t c = 0;
+        for (size_t i = begin; i < end; ++i) c += compare(op, v[i], operand) ? 1 : 0;
+        return c;
+      }
+
+#if defined(SQLITE_HPP_HAS_AVX2)
+      inline int64_t horizontal_sum(const __m256i v) {
+        alignas(32) int64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), v);
+        return int64_t(uint64_t(lanes[0]) + uint64_t(lanes[1]) + uint64_t(lanes[2]) + uint64_t(lanes[3]));
+      }
+
+      inline uint64_t sum_dense(const int64_t* v, const size_t begin, const size_t end) {
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = _mm256_setzero_si256();
+        size_t i = begin;
+        for (; i + 8 <= end; i += 8) {
+          acc0 = _mm256_add_epi64(acc0, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + i)));
+          acc1 = _mm256_add_epi64(acc1, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + i + 4)));
+        }
+        return uint64_t(horizontal_sum(_mm256_add_epi64(acc0, acc1))) + sum_scalar(v, i, end);
+      }
+
+      inline double sum_dense(const double* v, const size_t begin, const size_t end) {
+        __m256d acc0 = _mm256_setzero_pd();
+        __m256d acc1 = _mm256_setzero_pd();
+        size_t i = begin;
+        for (; i + 8 <= end; i += 8) {
+          acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(v + i));
+          acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(v + i + 4));
+        }
+        alignas(32) double lanes[4];
+        _mm256_store_pd(lanes, _mm256_add_pd(acc0, acc1));
+        return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + sum_scalar(v, i, end);
+      }
+
+      inline void min_max_dense(const int64_t* v, const size_t begin, const size_t end, int64_t& mn, int64_t& mx) {
+        size_t i = begin;
+        if (end - begin >= 4) {
+          __m256i vmin = _mm256_set1_epi64x(mn);
+          __m256i vmax = _mm256_set1_epi64x(mx);
+          for (; i + 4 <= end; i += 4) {
+            const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + i));
+            vmin = _mm256_blendv_epi8(vmin, x, _mm256_cmpgt_epi64(vmin, x));
+            vmax = _mm256_blendv_epi8(vmax, x, _mm256_cmpgt_epi64(x, vmax));
+          }
+          alignas(32) int64_t lanes_min[4];
+          alignas(32) int64_t lanes_max[4];
+          _mm256_store_si256(reinterpret_cast<__m256i*>(lanes_min), vmin);
+          _mm256_store_si256(reinterpret_cast<__m256i*>(lanes_max), vmax);
+          min_max_scalar(lanes_min, 0, 4, mn, mx);
+          min_max_scalar(lanes_max, 0, 4, mn, mx);
+        }
+        min_max_scalar(v, i, end, mn, mx);
+      }
+
+      inline void min_max_dense(const double* v, const size_t begin, const size_t end, double& mn, double& mx) {
+        size_t i = begin;
+        if (end - begin >= 4) {
+          __m256d vmin = _mm256_set1_pd(mn);
+          __m256d vmax = _mm256_set1_pd(mx);
+          for (; i + 4 <= end; i += 4) {
+            const __m256d x = _mm256_loadu_pd(v + i);
+            vmin = _mm256_min_pd(vmin, x);
+            vmax = _mm256_max_pd(vmax, x);
+          }
+          alignas(32) double lanes_min[4];
+          alignas(32) double lanes_max[4];
+          _mm256_store_pd(lanes_min, vmin);
+          _mm256_store_pd(lanes_max, vmax);
+          min_max_scalar(lanes_min, 0, 4, mn, mx);
+          min_max_scalar(lanes_max, 0, 4, mn, mx);
+        }
+        min_max_scalar(v, i, end, mn, mx);
+      }
+
+      // Lanes of the comparison results are all ones (-1) where true, so subtracting them counts
+      inline size_t count_where_dense(const int64_t* v, const size_t begin, const size_t end,
+                                      const compare_op op, const int64_t operand) {
+        const __m256i y = _mm256_set1_epi64x(operand);
+        const __m256i ones = _mm256_set1_epi64x(-1);
+        __m256i acc = _mm256_setzero_si256();
+        size_t i = begin;
+        for (; i + 4 <= end; i += 4) {
+          const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + i));
+          __m256i m;
+          switch (op) {
+          case compare_op::less: m = _mm256_cmpgt_epi64(y, x); break;
+          case compare_op::less_equal: m = _mm256_xor_si256(_mm256_cmpgt_epi64(x, y), ones); break;
+          case compare_op::equal: m = _mm256_cmpeq_epi64(x, y); break;
+          case compare_op::not_equal: m = _mm256_xor_si256(_mm256_cmpeq_epi64(x, y), ones); break;
+          case compare_op::greater_equal: m = _mm256_xor_si256(_mm256_cmpgt_epi64(y, x), ones); break;
+          default: m = _mm256_cmpgt_epi64(x, y); break;
+          }
+          acc = _mm256_sub_epi64(acc, m);
+        }
+        return size_t(horizontal_sum(acc)) + count_where_scalar(v, i, end, op, operand);
+      }
+
+      template <int predicate>
+      size_t count_where_dense_pd(const double* v, const size_t begin, const size_t end, const double operand) {
+        const __m256d y = _mm256_set1_pd(operand);
+        __m256i acc = _mm256_setzero_si256();
+        size_t i = begin;
+        for (; i + 4 <= end; i += 4) {
+          const __m256d m = _mm256_cmp_pd(_mm256_loadu_pd(v + i), y, predicate);
+          acc = _mm256_sub_epi64(acc, _mm256_castpd_si256(m));
+        }
+        return size_t(horizontal_sum(acc));
+      }
+
+      inline size_t count_where_dense(const double* v, const size_t begin, const size_t end,
+                                      const compare_op op, const double operand) {
+        const size_t simd_end = begin + (end - begin) / 4 * 4;
+        size_t c = 0;
+        switch (op) {
+        case compare_op::less: c = count_where_dense_pd<_CMP_LT_OQ>(v, begin, simd_end, operand); break;
+        case compare_op::less_equal: c = count_where_dense_pd<_CMP_LE_OQ>(v, begin, simd_end, operand); break;
+        case compare_op::equal: c = count_where_dense_pd<_CMP_EQ_OQ>(v, begin, simd_end, operand); break;
+        case compare_op::not_equal: c = count_where_dense_pd<_CMP_NEQ_UQ>(v, begin, simd_end, operand); break;
+        case compare_op::greater_equal: c = count_where_dense_pd<_CMP_GE_OQ>(v, begin, simd_end, operand); break;
+        case compare_op::greater: c = count_where_dense_pd<_CMP_GT_OQ>(v, begin, simd_end, operand); break;
+        }
+        return c + count_where_scalar(v, simd_end, end, op, operand);
+      }
+#else
+      template <typename T>
+      auto sum_dense(const T* v, const size_t begin, const size_t end) -> decltype(sum_scalar(v, begin, end)) {
+        return sum_scalar(v, begin, end);
+      }
+
+      template <typename T>
+      void min_max_dense(const T* v, const size_t begin, const size_t end, T& mn, T& mx) {
+        min_max_scalar(v, begin, end, mn, mx);
+      }
+
+      template <typename T>
+      size_t count_where_dense(const T* v, const size_t begin, const size_t end, const compare_op op, const T operand) {
+        return count_where_scalar(v, begin, end, op, operand);
+      }
+#endif
+
+      // Histogram bin of a value, or bins when it is out of [lo, hi)
+      struct int64_binning {
+        int64_binning(const int64_t lo, const int64_t hi, const size_t bins) :
+          lo(lo),
+          hi(hi),
+          bins(bins),
+          // Bins are ceil((hi - lo) / bins) wide, the last one may be narrower
+          width((uint64_t(hi) - uint64_t(lo) + bins - 1) / bins) {
+        }
+
+        size_t operator()(const int64_t x) const {
+          if ((x < lo) || (x >= hi)) return bins;
+          return size_t((uint64_t(x) - uint64_t(lo)) / width);
+        }
+
+        int64_t lo;
+        int64_t hi;
+        size_t bins;
+        uint64_t width;
+      };
+
+      struct double_binning {
+        double_binning(const double lo, const double hi, const size_t bins) :
+          lo(lo),
+          hi(hi),
+          bins(bins),
+          scale(double(bins) / (hi - lo)) {
+        }
+
+        size_t operator()(const double x) const {
+          if (!((x >= lo) && (x < hi))) return bins;
+          // Rounding may push values just below hi into a nonexistent bin
+          return std::min(size_t((x - lo) * scale), bins - 1);
+        }
+
+        double lo;
+        double hi;
+        size_t bins;
+        double scale;
+      };
+
+      inline void histogram_dense(const int64_t* v, const size_t begin, const size_t end,
+                                  const int64_binning& binning, uint64_t* counts) {
+        // The bin divisions and the scattered increments leave little for SIMD here
+        for (size_t i = begin; i < end; ++i) ++counts[binning(v[i])];
+      }
+
+      inline void histogram_dense(const double* v, const size_t begin, const size_t end,
+                                  const double_binning& binning, uint64_t* counts) {
+        size_t i = begin;
+#if defined(SQLITE_HPP_HAS_AVX2)
+        const __m256d lo = _mm256_set1_pd(binning.lo);
+        const __m256d hi = _mm256_set1_pd(binning.hi);
+        const __m256d scale = _mm256_set1_pd(binning.scale);
+        const __m128i last = _mm_set1_epi32(int(binning.bins - 1));
+        const size_t out_of_range = binning.bins;
+        alignas(16) int32_t idx[4];
+        for (; i + 4 <= end; i += 4) {
+          const __m256d x = _mm256_loadu_pd(v + i);
+          const __m256d in_range = _mm256_and_pd(_mm256_cmp_pd(x, lo, _CMP_GE_OQ), _mm256_cmp_pd(x, hi, _CMP_LT_OQ));
+          // Out of range lanes are zeroed before the conversion and sent to the extra bin after it
+          const __m256d scaled = _mm256_and_pd(_mm256_mul_pd(_mm256_sub_pd(x, lo), scale), in_range);
+          _mm_store_si128(reinterpret_cast<__m128i*>(idx), _mm_min_epi32(_mm256_cvttpd_epi32(scaled), last));
+          const int mask = _mm256_movemask_pd(in_range);
+          ++counts[(mask & 1) ? size_t(idx[0]) : out_of_range];
+          ++counts[(mask & 2) ? size_t(idx[1]) : out_of_range];
+          ++counts[(mask & 4) ? size_t(idx[2]) : out_of_range];
+          ++counts[(mask & 8) ? size_t(idx[3]) : out_of_range];
+        }
+#endif
+        for (; i < end; ++i) ++counts[binning(v[i])];
+      }
+
+      template <typename T>
+      struct binning_of;
+
+      template <>
+      struct binning_of<int64_t> {
+        typedef int64_binning type;
+      };
+
+      template <>
+      struct binning_of<double> {
+        typedef double_binning type;
+      };
+    }
+
+    inline int64_t sum(const int64_t* values, const size_t n, const uint64_t* validity = nullptr) {
+      uint64_t s = 0;
+      detail::for_each_valid(n, validity,
+                             [&] (const size_t begin, const size_t end) { s += detail::sum_dense(values, begin, end); },
+                             [&] (const size_t i) { s += uint64_t(values[i]); });
+      return int64_t(s);
+    }
+
+    inline double sum(const double* values, const size_t n, const uint64_t* validity = nullptr) {
+      double s = 0;
+      detail::for_each_valid(n, validity,
+                             [&] (const size_t begin, const size_t end) { s += detail::sum_dense(values, begin, end); },
+                             [&] (const size_t i) { s += values[i]; });
+      return s;
+    }
+
+    template <typename T>
+    min_max_result<T> min_max(const T* values, const size_t n, const uint64_t* validity = nullptr) {
+      min_max_result<T> r{std::numeric_limits<T>::max(), std::numeric_limits<T>::lowest(), 0};
+      detail::for_each_valid(n, validity,
+                             [&] (const size_t begin, const size_t end) {
+                               detail::min_max_dense(values, begin, end, r.min, r.max);
+                               r.count += end - begin;
+                             },
+                             [&] (const size_t i) {
+                               detail::min_max_scalar(values, i, i + 1, r.min, r.max);
+                               ++r.count;
+                             });
+      return r;
+    }
+
+    // Number of valid rows for which "value op operand" holds
+    template <typename T>
+    size_t count_where(const T* values, const size_t n, const compare_op op, const T operand,
+                       const uint64_t* validity = nullptr) {
+      size_t c = 0;
+      detail::for_each_valid(n, validity,
+                             [&] (const size_t begin, const size_t end) {
+                               c += detail::count_where_dense(values, begin, end, op, operand);
+                             },
+                             [&] (const size_t i) { c += detail::compare(op, values[i], operand) ? 1 : 0; });
+      return c;
+    }
+
+    // Counts of valid rows in bins equal-width bins over [lo, hi); values outside are not counted.
+    // Counts are added to the ones already in counts, which is resized to bins if needed.
+    template <typename T>
+    void histogram(const T* values, const size_t n, const T lo, const T hi, const size_t bins,
+                   std::vector<uint64_t>& counts, const uint64_t* validity = nullptr) {
+      if ((bins == 0) || !(lo < hi)) return;
+      if (counts.size() < bins) counts.resize(bins, 0);
+      // One extra slot collects the out of range values without a branch
+      std::vector<uint64_t> c(bins + 1, 0);
+      const typename detail::binning_of<T>::type binning(lo, hi, bins);
+      detail::for_each_valid(n, validity,
+                             [&] (const size_t begin, const size_t end) {
+                               detail::histogram_dense(values, begin, end, binning, c.data());
+                             },
+                             [&] (const size_t i) { ++c[binning(values[i])]; });
+      for (size_t i = 0; i < bins; ++i) counts[i] += c[i];
+    }
+
+    // Same kernels over a column of a column_batch: sqlite::kernels::sum<1>(batch)
+    template <size_t column, typename batch_t>
+    auto sum(const batch_t& batch) -> decltype(sum(batch.template get<column>().data(), batch.size())) {
+      return sum(batch.template get<column>().data(), batch.size(), batch.validity(column).data());
+    }
+
+    template <size_t column, typename batch_t>
+    min_max_result<typename batch_t::template value_type<column>> min_max(const batch_t& batch) {
+      return min_max(batch.template get<column>().data(), batch.size(), batch.validity(column).data());
+    }
+
+    template <size_t column, typename batch_t>
+    size_t count_where(const batch_t& batch, const compare_op op,
+                       const typename batch_t::template value_type<column> operand) {
+      return count_where(batch.template get<column>().data(), batch.size(), op, operand,
+                         batch.validity(column).data());
+    }
+
+    template <size_t column, typename batch_t>
+    void histogram(const batch_t& batch, const typename batch_t::template value_type<column> lo,
+                   const typename batch_t::template value_type<column> hi, const size_t bins,
+                   std::vector<uint64_t>& counts) {
+      histogram(batch.template get<column>().data(), batch.size(), lo, hi, bins, counts,
+                batch.validity(column).data());
+    }
+  }
+}
@@ -0,0 +1,303 @@
+#pragma once
+
+// C++20 coroutine support: a generator for result sets and awaitable query execution on an
+// executor thread. Compiled only when the compiler implements coroutines; SQLITE_HPP_HAS_COROUTINES
+// tells whether it is available.
+
+#if defined(__cpp_impl_coroutine)
+
+#define SQLITE_HPP_HAS_COROUTINES 1
+
+#include <sqlite3.h>
+
+#include <condition_variable>
+#include <coroutine>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "database.hpp"
+#include "logging.hpp"
+#include "memory.hpp"
+
+namespace sqlite {
+
+  // Lazily produces values with co_yield. The yielded value is referenced, not copied, so it
+  // is valid until the generator is resumed by advancing the iterator.
+  template <typename T>
+  class generator {
+  public:
+    struct promise_type {
+      const T* value_ = nullptr;
+
+      generator get_return_object() {
+        return generator(std::coroutine_handle<promise_type>::from_promise(*this));
+      }
+
+      std::suspend_always initial_suspend() noexcept {
+        return {};
+      }
+
+      std::suspend_always final_suspend() noexcept {
+        return {};
+      }
+
+      std::suspend_always yield_value(const T& value) noexcept {
+        value_ = &value;
+        return {};
+      }
+
+      void return_void() {
+      }
+
+      // The library does not throw; anything thrown by user code is fatal
+      void unhandled_exception() {
+        std::terminate();
+      }
+    };
+
+    class iterator {
+    public:
+      typedef std::input_iterator_tag iterator_category;
+      typedef T value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const T* pointer;
+      typedef const T& reference;
+
+      iterator() = default;
+
+      explicit iterator(std::coroutine_handle<promise_type> h) :
+        h_(h) {
+      }
+
+      iterator& operator++() {
+        h_.resume();
+        return *this;
+      }
+
+      void operator++(int) {
+        ++*this;
+      }
+
+      const T& operator*() const {
+        return *h_.promise().value_;
+      }
+
+      const T* operator->() const {
+        return h_.promise().value_;
+      }
+
+      bool operator==(std::default_sentinel_t) const {
+        return !h_ || h_.done();
+      }
+
+    private:
+      std::coroutine_handle<promise_type> h_;
+    };
+
+    generator(const generator&) = delete;
+    generator& operator=(const generator&) = delete;
+
+    generator(generator&& other) noexcept :
+      h_(std::exchange(other.h_, nullptr)) {
+    }
+
+    generator& operator=(generator&& other) noexcept {
+      if (this != &other) {
+        if (h_) h_.destroy();
+        h_ = std::exchange(other.h_, nullptr);
+      }
+      return *this;
+    }
+
+    ~generator() {
+      if (h_) h_.destroy();
+    }
+
+    iterator begin() {
+      if (h_) h_.resume();
+      return iterator(h_);
+    }
+
+    std::default_sentinel_t end() const {
+      return std::default_sentinel;
+    }
+
+  private:
+    explicit generator(std::coroutine_handle<promise_type> h) :
+      h_(h) {
+    }
+
+    std::coroutine_handle<promise_type> h_;
+  };
+
+  // A thread running posted tasks in order. Awaitables below run the database work on it
+  // and resume the awaiting coroutine there, so an event loop thread is never blocked by SQLite.
+  // Work on one connection should be kept on one executor.
+  class executor {
+  public:
+    typedef executor type;
+
+    executor() :
+      stop_(false),
+      thread_([this] () { run(); }) {
+    }
+
+    executor(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    // Runs the tasks already posted, then stops the thread
+    ~executor() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      cv_.notify_one();
+      thread_.join();
+    }
+
+    void post(std::function<void()> task) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+      }
+      cv_.notify_one();
+    }
+
+    std::thread::id thread_id() const {
+      return thread_.get_id();
+    }
+
+  private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool stop_;
+    std::thread thread_;
+
+    void run() {
+      for (;;) {
+        std::function<void()> task;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          cv_.wait(lock, [this] () { return stop_ || !tasks_.empty(); });
+          if (tasks_.empty()) return;
+          task = std::move(tasks_.front());
+          tasks_.pop_front();
+        }
+        task();
+      }
+    }
+  };
+
+  // co_await async_run(ex, fn) calls fn on the executor and evaluates to its result, if any.
+  // The awaiting coroutine is resumed on the executor thread, so the code after co_await runs
+  // there too, not on the thread that started the coroutine.
+  template <typename fn_t, typename result_t = decltype(std::declval<fn_t&>()())>
+  class run_awaitable {
+  public:
+    typedef result_t result_type;
+
+    run_awaitable(executor& ex, fn_t fn) :
+      ex_(ex),
+      fn_(std::move(fn)) {
+    }
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h) {
+      ex_.post([this, h] () {
+          result_.emplace(fn_());
+          h.resume();
+        });
+    }
+
+    result_type await_resume() {
+      return std::move(*result_);
+    }
+
+  private:
+    executor& ex_;
+    fn_t fn_;
+    std::optional<result_type> result_;
+  };
+
+  template <typename fn_t>
+  class run_awaitable<fn_t, void> {
+  public:
+    typedef void result_type;
+
+    run_awaitable(executor& ex, fn_t fn) :
+      ex_(ex),
+      fn_(std::move(fn)) {
+    }
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> h) {
+      ex_.post([this, h] () {
+          fn_();
+          h.resume();
+        });
+    }
+
+    void await_resume() {
+    }
+
+  private:
+    executor& ex_;
+    fn_t fn_;
+  };
+
+  template <typename fn_t>
+  run_awaitable<fn_t> async_run(executor& ex, fn_t fn) {
+    return run_awaitable<fn_t>(ex, std::move(fn));
+  }
+
+  // Steps the query on the executor; evaluates to its result code
+  template <typename query_t>
+  auto async_step(query_t& q, executor& ex) {
+    return async_run(ex, [&q] () {
+        q.step();
+        return q.result_code();
+      });
+  }
+
+  // Runs one or more SQL statements without results on the executor; evaluates to the result code.
+  // Like query_base, only the preparation of each statement counts as memory of statements.
+  inline auto async_execute(const database::type_ptr& db, std::string sql, executor& ex) {
+    return async_run(ex, [db, sql = std::move(sql)] () {
+        const char* tail = sql.c_str();
+        int rc = SQLITE_OK;
+        while ((rc == SQLITE_OK) && (*tail != '\0')) {
+          sqlite3_stmt* stmt = nullptr;
+          {
+            memory::scope scope(memory_category::statements);
+            rc = sqlite3_prepare_v2(db->db().get(), tail, -1, &stmt, &tail);
+          }
+          // Nothing but whitespace or comments left
+          if (stmt == nullptr) continue;
+          while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+          }
+          sqlite3_finalize(stmt);
+          if (rc == SQLITE_DONE) rc = SQLITE_OK;
+        }
+        if (rc != SQLITE_OK) {
+          SQLITE_HPP_LOG("async_execute Failed: " + sql);
+        }
+        return rc;
+      });
+  }
+}
+
+#endif
@@ -22,5 +22,16 @@ namespace sqlite {
     typedef ct_integer_list<> type;
     
   };
+
+  // 0, 1, ..., max - 1
+  template <size_t max>
+  struct ct_iota_0 {
+    typedef typename ct_iota_0<max-1>::type::template push_back<max-1>::type type;
+  };
+
+  template <>
+  struct ct_iota_0<0> {
+    typedef ct_integer_list<> type;
+  };
                
 }
@@ -1,13 +1,28 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <sqlite3.h>
 
+#include "busy_handler.hpp"
+#include "cancellation.hpp"
+#include "change_hooks.hpp"
 #include "logging.hpp"
+#include "tracer.hpp"
 #include "result_code_container.hpp"
 
+// sqlite3_serialize()/sqlite3_deserialize() appeared in 3.23.0 behind SQLITE_ENABLE_DESERIALIZE and
+// are built by default since 3.36.0. The bundled 3.11.1 amalgamation does not have them.
+#if defined(SQLITE_SERIALIZE_NOCOPY) && !defined(SQLITE_OMIT_DESERIALIZE) && \
+  ((SQLITE_VERSION_NUMBER >= 3036000) || defined(SQLITE_ENABLE_DESERIALIZE))
+#define SQLITE_HPP_HAS_SERIALIZE 1
+#endif
+
 namespace sqlite {
 
   class database : public result_code_container {
@@ -15,7 +30,8 @@ namespace sqlite {
     typedef database type;
     typedef std::shared_ptr<database> type_ptr;
     
-    database() {
+    database() :
+      connection_(std::make_shared<connection>()) {
       SQLITE_HPP_LOG("database::database() constructor");
     }
 
@@ -24,9 +40,16 @@ namespace sqlite {
       open(filename);
     }
 
+    // flags as for sqlite3_open_v2(), e.g. SQLITE_OPEN_READONLY
+    database(const std::string& filename, const int flags) : database() {
+      SQLITE_HPP_LOG("database::database(filename, flags) constructor");
+      open(filename, flags);
+    }
+
     database(const database& other) :
       result_code_container(other),
       filename_(other.filename_),
+      connection_(other.connection_),
       db_(other.db_) {
       SQLITE_HPP_LOG("database::database copy constructor");
     }
@@ -34,13 +57,16 @@ namespace sqlite {
     database(database&& other) :
       result_code_container(other),
       filename_(std::move(other.filename_)),
+      connection_(std::move(other.connection_)),
       db_(std::move(other.db_)) {
       SQLITE_HPP_LOG("database::database move constructor");
+      other.connection_ = std::make_shared<connection>();
     }
 
     void swap(database& other) {
       SQLITE_HPP_LOG("database::swap");
       std::swap(filename_, other.filename_);
+      std::swap(connection_, other.connection_);
       std::swap(db_, other.db_);
       std::swap(result_code_, other.result_code_);
     }
@@ -53,27 +79,195 @@ namespace sqlite {
     }
     
     const int open(const std::string& filename) {
+      return open(filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    }
+
+    const int open(const std::string& filename, const int flags) {
       ::sqlite3 *db;
-      result_code_ = sqlite3_open(filename.c_str(), &db);
+      result_code_ = sqlite3_open_v2(filename.c_str(), &db, flags, nullptr);
       if (result_code_ == SQLITE_OK) {
         filename_ = filename;
-        db_ = std::shared_ptr<::sqlite3>(db, [this] (sqlite3* p) {
-            SQLITE_HPP_LOG("database::db_ Database closed");
-            this->result_code_ = sqlite3_close(p); });
+        reset_connection(db);
+        if (connection_->busy.handler) {
+          sqlite3_busy_handler(db, &busy_handler::callback, &connection_->busy);
+        }
+        if (connection_->hooks) connection_->hooks->install(db);
+        if (connection_->progress) connection_->progress->install(db);
+#if defined(SQLITE_HPP_HAS_TRACE_V2)
+        if (connection_->trace) connection_->trace->install(db);
+#endif
       } else {
         SQLITE_HPP_LOG(std::string("sqlite::database::open failed to open ") + filename);
+        // A handle is returned even on failure, except when it could not be allocated
+        sqlite3_close(db);
       }
       return result_code_;
     }
 
+    // The connection is closed once the queries still holding db() are gone
     const void close() {
-      db_ = nullptr;
+      reset_connection(nullptr);
     }
 
     const std::shared_ptr<::sqlite3>& db() {
       return db_;
     }
 
+    const std::string& filename() const {
+      return filename_;
+    }
+
+    // Replaces SQLite's default behaviour of returning SQLITE_BUSY immediately
+    // with backoff-and-retry until the configured deadline
+    const int install_busy_handler(const busy_handler::config& cfg = busy_handler::config()) {
+      return install_busy_handler(std::make_shared<busy_handler>(cfg));
+    }
+
+    const int install_busy_handler(const busy_handler::type_ptr& handler) {
+      connection_->busy.handler = handler;
+      if (db_ != nullptr) {
+        result_code_ = sqlite3_busy_handler(db_.get(), handler ? &busy_handler::callback : nullptr,
+                                            &connection_->busy);
+      }
+      return result_code_;
+    }
+
+    const int remove_busy_handler() {
+      return install_busy_handler(busy_handler::type_ptr());
+    }
+
+    const busy_handler::type_ptr& get_busy_handler() const {
+      return connection_->busy.handler;
+    }
+
+    // Contention counters of the installed busy handler, all zeroes if there is none
+    busy_handler::stats busy_stats() const {
+      if (connection_->busy.handler) return connection_->busy.handler->get_stats();
+      return busy_handler::stats{0, 0, 0, 0};
+    }
+
+    // Update, commit and rollback hooks of the connection, shared by all listeners.
+    // Installed on first use and kept across open().
+    change_hooks& hooks() {
+      if (!connection_->hooks) {
+        connection_->hooks = std::make_shared<change_hooks>();
+        if (db_ != nullptr) connection_->hooks->install(db_.get());
+      }
+      return *connection_->hooks;
+    }
+
+    // Progress handler enforcing the deadlines and cancellation tokens of queries, installed on
+    // first use and kept across open()
+    progress_monitor& progress() {
+      if (!connection_->progress) {
+        connection_->progress = std::make_shared<progress_monitor>();
+        if (db_ != nullptr) connection_->progress->install(db_.get());
+      }
+      return *connection_->progress;
+    }
+
+    // Makes the statements running on the connection fail with SQLITE_INTERRUPT; may be called
+    // from any thread
+    void interrupt() {
+      if (db_ != nullptr) sqlite3_interrupt(db_.get());
+    }
+
+#if defined(SQLITE_HPP_HAS_TRACE_V2)
+    // Times every statement run on the connection, see profiler
+    const int install_profiler(const profiler::config& cfg = profiler::config()) {
+      return install_profiler(std::make_shared<profiler>(cfg));
+    }
+
+    const int install_profiler(const profiler::type_ptr& p) {
+      if (!connection_->trace) connection_->trace = std::make_shared<tracer>();
+      connection_->trace->set_profiler(p);
+      return install_tracer();
+    }
+
+    const int remove_profiler() {
+      return install_profiler(profiler::type_ptr());
+    }
+
+    const profiler::type_ptr& get_profiler() const {
+      static const profiler::type_ptr none;
+      return connection_->trace ? connection_->trace->get_profiler() : none;
+    }
+
+    // Logs the statements slower than the configured threshold, see slow_query_log
+    const int install_slow_query_log(const slow_query_log::config& cfg = slow_query_log::config()) {
+      return install_slow_query_log(std::make_shared<slow_query_log>(cfg));
+    }
+
+    const int install_slow_query_log(const slow_query_log::type_ptr& log) {
+      if (!connection_->trace) connection_->trace = std::make_shared<tracer>();
+      connection_->trace->set_slow_query_log(log);
+      return install_tracer();
+    }
+
+    const int remove_slow_query_log() {
+      return install_slow_query_log(slow_query_log::type_ptr());
+    }
+
+    const slow_query_log::type_ptr& get_slow_query_log() const {
+      static const slow_query_log::type_ptr none;
+      return connection_->trace ? connection_->trace->get_slow_query_log() : none;
+    }
+#endif
+
+#if defined(SQLITE_HPP_HAS_SERIALIZE)
+    // Copies the image of the schema into the vector
+    const int serialize(std::vector<uint8_t>& image, const std::string& schema = "main") {
+      sqlite3_int64 sz = 0;
+      unsigned char* data = sqlite3_serialize(db_.get(), schema.c_str(), &sz, 0);
+      if (data == nullptr) {
+        result_code_ = SQLITE_NOMEM;
+        return result_code_;
+      }
+      image.assign(data, data + sz);
+      sqlite3_free(data);
+      result_code_ = SQLITE_OK;
+      return result_code_;
+    }
+
+    // Returns a pointer to the schema's image without copying. Only succeeds for in-memory
+    // databases; the pointer is valid until the next change to the database.
+    const uint8_t* serialize_nocopy(size_t& size, const std::string& schema = "main") {
+      sqlite3_int64 sz = 0;
+      const unsigned char* data = sqlite3_serialize(db_.get(), schema.c_str(), &sz, SQLITE_SERIALIZE_NOCOPY);
+      size = data != nullptr ? size_t(sz) : 0;
+      result_code_ = data != nullptr ? SQLITE_OK : SQLITE_ERROR;
+      return data;
+    }
+
+    // Turns the schema into a read-only in-memory database backed directly by the given image
+    // (e.g. a memory-mapped snapshot file), without copying it. The memory has to outlive the
+    // connection. SQLite never writes to it, so it may be mapped read-only.
+    const int deserialize(const uint8_t* data, const size_t size, const std::string& schema = "main") {
+      // There is nothing to borrow; the schema becomes an empty database of its own
+      if (size == 0) return deserialize(std::vector<uint8_t>(), schema);
+      result_code_ = sqlite3_deserialize(db_.get(), schema.c_str(), const_cast<unsigned char*>(data),
+                                         sqlite3_int64(size), sqlite3_int64(size),
+                                         SQLITE_DESERIALIZE_READONLY);
+      return result_code_;
+    }
+
+    // Turns the schema into a writable in-memory database initialized with a copy of the image.
+    // An empty image gives an empty database.
+    const int deserialize(const std::vector<uint8_t>& image, const std::string& schema = "main") {
+      // sqlite3_malloc64(0) returns NULL, which SQLite cannot grow the database from
+      unsigned char* data = static_cast<unsigned char*>(sqlite3_malloc64(std::max<size_t>(image.size(), 1)));
+      if (data == nullptr) {
+        result_code_ = SQLITE_NOMEM;
+        return result_code_;
+      }
+      if (!image.empty()) std::memcpy(data, image.data(), image.size());
+      result_code_ = sqlite3_deserialize(db_.get(), schema.c_str(), data,
+                                         sqlite3_int64(image.size()), sqlite3_int64(image.size()),
+                                         SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE);
+      return result_code_;
+    }
+#endif
+
     const int sqlite_max_length() {
       return sqlite3_limit(db_.get(), SQLITE_LIMIT_LENGTH, -1);
     }
@@ -171,7 +365,50 @@ namespace sqlite {
     }
     
   private:
+    // The handle together with the objects its callbacks point to. Shared by the copies of the
+    // database and by db(), so the callbacks stay valid for as long as the handle is open,
+    // whichever of them goes away first.
+    struct connection {
+      ::sqlite3* handle = nullptr;
+      busy_handler::binding busy;
+      change_hooks::type_ptr hooks;
+      progress_monitor::type_ptr progress;
+#if defined(SQLITE_HPP_HAS_TRACE_V2)
+      tracer::type_ptr trace;
+#endif
+
+      ~connection() {
+        if (handle != nullptr) {
+          SQLITE_HPP_LOG("database::connection Database closed");
+          sqlite3_close(handle);
+        }
+      }
+    };
+
     std::string filename_;
+    std::shared_ptr<connection> connection_;
+    // Aliases connection_ while open
     std::shared_ptr<::sqlite3> db_;
+
+    // Moves the installed objects over to a new connection, kept across open() and close()
+    void reset_connection(::sqlite3* handle) {
+      std::shared_ptr<connection> next = std::make_shared<connection>();
+      next->busy.handler = connection_->busy.handler;
+      next->hooks = connection_->hooks;
+      next->progress = connection_->progress;
+#if defined(SQLITE_HPP_HAS_TRACE_V2)
+      next->trace = connection_->trace;
+#endif
+      next->handle = handle;
+      connection_ = next;
+      db_ = handle != nullptr ? std::shared_ptr<::sqlite3>(connection_, handle) : nullptr;
+    }
+
+#if defined(SQLITE_HPP_HAS_TRACE_V2)
+    const int install_tracer() {
+      if (db_ != nullptr) result_code_ = connection_->trace->install(db_.get());
+      return result_code_;
+    }
+#endif
   };
 }
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cctype>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace sqlite {
+
+  // Normalizes SQL text so that statements differing only in literal values, parameter names,
+  // whitespace, comments, keyword case or the number of repeated elements map to the same string:
+  //  - string, numeric and blob literals and all parameter forms become ?;
+  //  - comments are dropped, whitespace is collapsed and unquoted words are upper-cased;
+  //  - an element repeated after ",", "OR", "AND" or "UNION ALL" is kept once, so that
+  //    "IN (?, ?, ?)" becomes "IN (?)" and the batches of buffered::insert_query
+  //    ("SELECT ?, ? UNION ALL SELECT ?, ? ...") and buffered::input_query_by_keys
+  //    ("(`k` = ?) OR (`k` = ?) ...") have one fingerprint whatever their size.
+  // Quoted identifiers are kept as written.
+  inline std::string fingerprint(const std::string& sql) {
+    std::vector<std::string> tokens;
+    const size_t n = sql.size();
+    size_t i = 0;
+    auto is_word = [] (const char c) {
+      return std::isalnum(static_cast<unsigned char>(c)) || (c == '_') || (static_cast<unsigned char>(c) >= 0x80);
+    };
+    while (i < n) {
+      const char c = sql[i];
+      if (std::isspace(static_cast<unsigned char>(c))) {
+        ++i;
+      } else if ((c == '-') && (i + 1 < n) && (sql[i + 1] == '-')) {
+        while ((i < n) && (sql[i] != '\n')) ++i;
+      } else if ((c == '/') && (i + 1 < n) && (sql[i + 1] == '*')) {
+        const size_t end = sql.find("*/", i + 2);
+        i = end == std::string::npos ? n : end + 2;
+      } else if ((c == '\'') || (((c == 'x') || (c == 'X')) && (i + 1 < n) && (sql[i + 1] == '\''))) {
+        // String or blob literal, '' escapes a quote
+        i += c == '\'' ? 1 : 2;
+        while (i < n) {
+          if (sql[i] == '\'') {
+            if ((i + 1 < n) && (sql[i + 1] == '\'')) {
+              i += 2;
+              continue;
+            }
+            ++i;
+            break;
+          }
+          ++i;
+        }
+        tokens.push_back("?");
+      } else if ((c == '`') || (c == '"') || (c == '[')) {
+        const char close = c == '[' ? ']' : c;
+        size_t end = i + 1;
+        while (end < n) {
+          if (sql[end] == close) {
+            if ((close != ']') && (end + 1 < n) && (sql[end + 1] == close)) {
+              end += 2;
+              continue;
+            }
+            break;
+          }
+          ++end;
+        }
+        end = end < n ? end + 1 : n;
+        tokens.push_back(sql.substr(i, end - i));
+        i = end;
+      } else if (std::isdigit(static_cast<unsigned char>(c)) ||
+                 ((c == '.') && (i + 1 < n) && std::isdigit(static_cast<unsigned char>(sql[i + 1])))) {
+        // Numbers, including 0x1F, 1.5e-3
+        ++i;
+        while (i < n) {
+          if (is_word(sql[i]) || (sql[i] == '.')) {
+            ++i;
+          } else if (((sql[i] == '+') || (sql[i] == '-')) && ((sql[i - 1] == 'e') || (sql[i - 1] == 'E'))) {
+            ++i;
+          } else {
+            break;
+          }
+        }
+        tokens.push_back("?");
+      } else if ((c == '?') || (c == ':') || (c == '@') || (c == '$')) {
+        ++i;
+        while ((i < n) && (is_word(sql[i]) || (sql[i] == ':') || (sql[i] == '$'))) ++i;
+        tokens.push_back("?");
+      } else if (is_word(c)) {
+        size_t end = i;
+        while ((end < n) && is_word(sql[end])) ++end;
+        std::string word = sql.substr(i, end - i);
+        for (auto& ch : word) ch = char(std::toupper(static_cast<unsigned char>(ch)));
+        tokens.push_back(word);
+        i = end;
+      } else {
+        // Two-character operators stay together
+        static const char* const operators[] = {"<=", ">=", "<>", "!=", "==", "||", "<<", ">>", "->"};
+        size_t len = 1;
+        for (const char* op : operators) {
+          if ((i + 1 < n) && (sql[i] == op[0]) && (sql[i + 1] == op[1])) len = 2;
+        }
+        tokens.push_back(sql.substr(i, len));
+        i += len;
+      }
+    }
+
+    // Collapses "A sep A" into "A", where A is the run of tokens just before the separator
+    auto separator_length = [&tokens] (const size_t at) -> size_t {
+      if ((tokens[at] == ",") || (tokens[at] == "OR") || (tokens[at] == "AND")) return 1;
+      if ((tokens[at] == "UNION") && (at + 1 < tokens.size()) && (tokens[at + 1] == "ALL")) return 2;
+      return 0;
+    };
+    std::vector<std::string> out;
+    for (size_t t = 0; t < tokens.size();) {
+      const size_t sep = separator_length(t);
+      bool collapsed = false;
+      if ((sep > 0) && !out.empty()) {
+        const size_t next = t + sep;
+        for (size_t len = 1; (len <= out.size()) && (next + len <= tokens.size()) && (len <= 64); ++len) {
+          bool same = true;
+          for (size_t k = 0; same && (k < len); ++k) same = out[out.size() - len + k] == tokens[next + k];
+          // The repeated run has to end where the next separator, a closing bracket or the text does
+          const size_t after = next + len;
+          if (same && ((after == tokens.size()) || (separator_length(after) > 0) || (tokens[after] == ")") ||
+                       (tokens[after] == ";"))) {
+            t = after;
+            collapsed = true;
+            break;
+          }
+        }
+      }
+      if (!collapsed) out.push_back(tokens[t++]);
+    }
+
+    std::string result;
+    for (size_t t = 0; t < out.size(); ++t) {
+      const std::string& tok = out[t];
+      const bool no_space_before = (tok == ",") || (tok == ")") || (tok == ";") || (tok == ".");
+      const bool no_space_after_previous = (t > 0) && ((out[t - 1] == "(") || (out[t - 1] == "."));
+      if ((t > 0) && !no_space_before && !no_space_after_previous) result += ' ';
+      result += tok;
+    }
+    return result;
+  }
+}
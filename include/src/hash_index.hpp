@@ -0,0 +1,254 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "change_detector.hpp"
+#include "change_hooks.hpp"
+#include "database.hpp"
+#include "logging.hpp"
+#include "query.hpp"
+#include "rcu_cell.hpp"
+#include "result_code_container.hpp"
+
+namespace sqlite {
+
+  // In-memory hash index of one column of a rowid table: key -> rowids of the rows holding it.
+  // Lookups read an immutable snapshot through an rcu_cell, so any number of threads can call
+  // find() without locks and without entering SQLite, while the connection's thread keeps the
+  // index current:
+  //  - the update hook (database::hooks()) collects the rowids changed by each transaction; the
+  //    commit hook keeps them and the rollback hook drops them;
+  //  - refresh(), called on the connection's thread outside of transactions (e.g. after each
+  //    write), reads the keys of the committed rowids back and publishes a new snapshot;
+  //  - changes the hook does not report, including commits of other connections, make refresh()
+  //    rebuild the whole index (see change_detector).
+  // Every refresh copies the snapshot, so the index suits tables that are read far more often
+  // than they are written. NULL keys are not indexed. The update hook reports an UPDATE of the
+  // rowid and a REPLACE only for the new row, so the rowid a row had before may stay in the index
+  // until the next rebuild(); callers reading the rows by rowid will find it gone.
+  template <typename key_t, typename row_id_t = int64_t>
+  class hash_index : public change_listener, public result_code_container {
+  public:
+    typedef hash_index<key_t, row_id_t> type;
+    typedef std::shared_ptr<type> type_ptr;
+    typedef key_t key_type;
+    typedef row_id_t row_id_type;
+
+    class snapshot {
+      friend class hash_index<key_t, row_id_t>;
+    public:
+      typedef std::unordered_multimap<key_t, row_id_t> map_type;
+      typedef typename map_type::const_iterator const_iterator;
+
+      // Some row holding the key
+      bool find(const key_t& key, row_id_t& rowid) const {
+        const_iterator found = by_key_.find(key);
+        if (found == by_key_.end()) return false;
+        rowid = found->second;
+        return true;
+      }
+
+      size_t count(const key_t& key) const {
+        return by_key_.count(key);
+      }
+
+      std::pair<const_iterator, const_iterator> equal_range(const key_t& key) const {
+        return by_key_.equal_range(key);
+      }
+
+      // Number of indexed rows
+      size_t size() const {
+        return by_row_.size();
+      }
+
+    private:
+      map_type by_key_;
+      std::unordered_map<row_id_t, key_t> by_row_;
+
+      void erase(const row_id_t rowid) {
+        auto row = by_row_.find(rowid);
+        if (row == by_row_.end()) return;
+        auto range = by_key_.equal_range(row->second);
+        for (auto it = range.first; it != range.second; ++it) {
+          if (it->second == rowid) {
+            by_key_.erase(it);
+            break;
+          }
+        }
+        by_row_.erase(row);
+      }
+
+      void insert(const key_t& key, const row_id_t rowid) {
+        by_key_.insert(std::make_pair(key, rowid));
+        by_row_[rowid] = key;
+      }
+    };
+
+    typedef typename rcu_cell<snapshot>::read_guard snapshot_guard;
+
+    hash_index(const database::type_ptr& db, const std::string& table_name, const std::string& column,
+               const std::string& schema = "main") :
+      result_code_container(),
+      db_(db),
+      table_name_(table_name),
+      schema_(schema),
+      column_(column),
+      snapshot_(std::unique_ptr<snapshot>(new snapshot())),
+      changes_(db),
+      select_key_(db, "SELECT `" + column + "` FROM `" + schema + "`.`" + table_name + "` WHERE rowid = ?") {
+      db_->hooks().add(this);
+      if (select_key_.result_code() != SQLITE_OK) {
+        result_code_ = select_key_.result_code();
+        return;
+      }
+      rebuild();
+    }
+
+    hash_index(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    ~hash_index() {
+      db_->hooks().remove(this);
+    }
+
+    // The lookups below may be called from any thread
+
+    bool find(const key_t& key, row_id_t& rowid) const {
+      return snapshot_.read()->find(key, rowid);
+    }
+
+    size_t count(const key_t& key) const {
+      return snapshot_.read()->count(key);
+    }
+
+    // Replaces the contents of rowids with all rows holding the key
+    void find_all(const key_t& key, std::vector<row_id_t>& rowids) const {
+      rowids.clear();
+      snapshot_guard s = snapshot_.read();
+      auto range = s->equal_range(key);
+      for (auto it = range.first; it != range.second; ++it) rowids.push_back(it->second);
+    }
+
+    size_t size() const {
+      return snapshot_.read()->size();
+    }
+
+    // Consistent view for several lookups; hold it briefly, it delays refresh()
+    snapshot_guard read() const {
+      return snapshot_.read();
+    }
+
+    // Rebuilds the index from a full scan of the table; call outside of transactions
+    const int rebuild() {
+      changes_.unobserved_changes();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        committed_.clear();
+      }
+      std::unique_ptr<snapshot> next(new snapshot());
+      query scan(db_, "SELECT rowid, `" + column_ + "` FROM `" + schema_ + "`.`" + table_name_ + "`");
+      if (scan.result_code() != SQLITE_OK) {
+        result_code_ = scan.result_code();
+        return result_code_;
+      }
+      for (scan.step(); scan.result_code() == SQLITE_ROW; scan.step()) {
+        if (sqlite3_column_type(scan.statement().get(), 1) == SQLITE_NULL) continue;
+        next->insert(scan.get<key_t>(1), row_id_t(scan.get<int64_t>(0)));
+      }
+      result_code_ = scan.result_code() == SQLITE_DONE ? SQLITE_OK : scan.result_code();
+      if (result_code_ != SQLITE_OK) {
+        SQLITE_HPP_LOG("hash_index::rebuild Failed to scan " + table_name_);
+        return result_code_;
+      }
+      snapshot_.update(std::move(next));
+      return result_code_;
+    }
+
+    // Brings the index up to date with committed changes. Returns SQLITE_MISUSE inside a
+    // transaction, where the rows may hold uncommitted values.
+    const int refresh() {
+      ::sqlite3* db = db_->db().get();
+      if ((db == nullptr) || !sqlite3_get_autocommit(db)) {
+        SQLITE_HPP_LOG("hash_index::refresh Not in autocommit mode");
+        result_code_ = SQLITE_MISUSE;
+        return result_code_;
+      }
+      std::unordered_set<int64_t> changed;
+      const bool unobserved = changes_.unobserved_changes();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        changed.swap(committed_);
+      }
+      if (unobserved) {
+        SQLITE_HPP_LOG("hash_index::refresh Unobserved changes, rebuilding");
+        return rebuild();
+      }
+      result_code_ = SQLITE_OK;
+      if (changed.empty()) return result_code_;
+      std::unique_ptr<snapshot> next;
+      {
+        snapshot_guard current = snapshot_.read();
+        next.reset(new snapshot(*current));
+      }
+      for (const int64_t rowid : changed) {
+        next->erase(row_id_t(rowid));
+        select_key_.bind(1, rowid);
+        select_key_.step();
+        if ((select_key_.result_code() == SQLITE_ROW) &&
+            (sqlite3_column_type(select_key_.statement().get(), 0) != SQLITE_NULL)) {
+          next->insert(select_key_.get<key_t>(0), row_id_t(rowid));
+        }
+        const int rc = select_key_.result_code();
+        sqlite3_reset(select_key_.statement().get());
+        if ((rc != SQLITE_ROW) && (rc != SQLITE_DONE)) {
+          result_code_ = rc;
+          return result_code_;
+        }
+      }
+      snapshot_.update(std::move(next));
+      return result_code_;
+    }
+
+    void on_update(const int, const char* db_name, const char* table, const int64_t rowid) override {
+      changes_.observed();
+      std::lock_guard<std::mutex> lock(mutex_);
+      if ((sqlite3_stricmp(table, table_name_.c_str()) == 0) && (sqlite3_stricmp(db_name, schema_.c_str()) == 0)) {
+        pending_.insert(rowid);
+      }
+    }
+
+    void on_commit() override {
+      std::lock_guard<std::mutex> lock(mutex_);
+      committed_.insert(pending_.begin(), pending_.end());
+      pending_.clear();
+    }
+
+    void on_rollback() override {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.clear();
+    }
+
+  private:
+    database::type_ptr db_;
+    std::string table_name_;
+    std::string schema_;
+    std::string column_;
+    rcu_cell<snapshot> snapshot_;
+    std::mutex mutex_;
+    change_detector changes_;
+    // Rowids changed by the open transaction and by committed transactions not yet refreshed.
+    // Savepoints rolled back keep their rowids pending; reading them back does no harm.
+    std::unordered_set<int64_t> pending_;
+    std::unordered_set<int64_t> committed_;
+    query select_key_;
+  };
+}
@@ -4,6 +4,8 @@
 
 #include <tuple>
 
+#include "column_batch.hpp"
+#include "coroutine.hpp"
 #include "logging.hpp"
 #include "query.hpp"
 
@@ -14,6 +16,12 @@ namespace sqlite {
   template <typename record_tuple_t,
             typename value_access_policy_t>
   class input_query_iterator;
+  template <typename record_tuple_t,
+            typename value_access_policy_t>
+  class input_query_row_buffer_iterator;
+  template <typename record_tuple_t,
+            typename value_access_policy_t>
+  class input_query_row_buffer;
   template <typename... Rs>
   class input_query;
 
@@ -21,21 +29,66 @@ namespace sqlite {
             typename value_access_policy_t>
   class input_query_base : public query_base<value_access_policy_t> {
     friend class input_query_iterator<record_tuple_t, value_access_policy_t>;
+    friend class input_query_row_buffer_iterator<record_tuple_t, value_access_policy_t>;
   public:
     typedef input_query_base<record_tuple_t,
                              value_access_policy_t> type;
     typedef std::shared_ptr<type> type_ptr;
     typedef input_query_iterator<record_tuple_t, value_access_policy_t> iterator;
+    typedef input_query_row_buffer<record_tuple_t, value_access_policy_t> row_buffer_type;
 
     using query_base<value_access_policy_t>::query_base;
 
     iterator begin() {
       this->step();
-      return iterator(type_ptr(this, [] (type *) {}), false);
+      return iterator(this, false);
     }
 
     iterator end() {
-      return iterator(type_ptr(this, [] (type *) {}), true);
+      return iterator(this, true);
+    }
+
+    // Iteration that decodes every row into the same buffer and hands out const references to it,
+    // so strings and blobs reuse their capacity instead of being allocated for each row:
+    //   for (const auto& row : select.row_buffer()) { ... }
+    row_buffer_type row_buffer() {
+      return row_buffer_type(this);
+    }
+
+#if defined(SQLITE_HPP_HAS_COROUTINES)
+    // Generator over the rows, decoding each into the same buffer like row_buffer():
+    //   for (const auto& row : select.rows()) { ... }
+    generator<record_tuple_t> rows() {
+      record_tuple_t row;
+      for (this->step(); this->result_code() == SQLITE_ROW; this->step()) {
+        this->get_record(row);
+        co_yield row;
+      }
+    }
+#endif
+
+    typedef typename column_batch_of<record_tuple_t>::type column_batch_type;
+
+    // Steps through up to batch_size rows and returns them column by column (see column_batch.hpp).
+    // A batch smaller than batch_size means the query is done or failed, see result_code().
+    column_batch_type fetch_columns(const size_t batch_size) {
+      column_batch_type batch;
+      fetch_columns(batch, batch_size);
+      return batch;
+    }
+
+    // Same, filling an existing batch to reuse its memory. Returns the number of rows fetched.
+    size_t fetch_columns(column_batch_type& batch, const size_t batch_size) {
+      batch.clear();
+      // Stepping a finished statement would start it over, and one that failed would retry
+      if ((this->result_code() != SQLITE_OK) && (this->result_code() != SQLITE_ROW)) return 0;
+      batch.reserve(batch_size);
+      while (batch.size() < batch_size) {
+        this->step();
+        if (this->result_code() != SQLITE_ROW) break;
+        batch.append_row(*this);
+      }
+      return batch.size();
     }
   };
 
@@ -50,14 +103,14 @@ namespace sqlite {
     typedef record_tuple_t record_tuple_type;
     typedef record_tuple_t value_type;
 
-    input_query_iterator(const typename query_type::type_ptr& q) :
+    input_query_iterator(query_type* q) :
       result_code_container(), 
       q_(q),
       end_(false),
       pos_(0) {
     }
 
-    input_query_iterator(const typename query_type::type_ptr& q, bool end) :
+    input_query_iterator(query_type* q, bool end) :
       result_code_container(),
       q_(q),
       end_(end),
@@ -79,7 +132,7 @@ namespace sqlite {
     }
 
     void swap(input_query_iterator &other) {
-      typename query_type::type_ptr tmp_q(other.q_);
+      query_type* tmp_q(other.q_);
     }
     
     type operator=(const input_query_iterator &other) {
@@ -108,18 +161,101 @@ namespace sqlite {
 
     record_tuple_type operator*() {
       record_tuple_type* dummy_ptr(nullptr);
-      return q_->get_tuple(dummy_ptr);
+      return q_->get_record(dummy_ptr);
     }
 
   private:
-    typename query_type::type_ptr q_;
+    query_type* q_;
     bool end_;
     size_t pos_;
           
   };
 
+  template <typename record_tuple_t, typename value_access_policy_t>
+  class input_query_row_buffer_iterator :
+    public std::iterator<std::input_iterator_tag, record_tuple_t>,
+    public result_code_container {
+  public:
+    typedef input_query_row_buffer_iterator<record_tuple_t, value_access_policy_t> type;
+    typedef input_query_base<record_tuple_t, value_access_policy_t> query_type;
+    typedef record_tuple_t record_tuple_type;
+    typedef record_tuple_t value_type;
+
+    input_query_row_buffer_iterator(query_type* q, bool end) :
+      result_code_container(),
+      q_(q),
+      end_(end),
+      decoded_(false),
+      pos_(0) {
+    }
+
+    type& operator++() {
+      q_->step();
+      ++pos_;
+      decoded_ = false;
+      if (q_->result_code() != SQLITE_ROW) end_ = true;
+      return *this;
+    }
+
+    bool operator==(const type& other) const {
+      if (end_) {
+        return (q_ == other.q_) && (end_ == other.end_);
+      } else {
+        return (q_ == other.q_) && (end_ == other.end_) && (pos_ == other.pos_);
+      }
+    }
+
+    bool operator!=(const type& other) const {
+      return !(*this == other);
+    }
+
+    // Valid until the iterator is advanced
+    const record_tuple_type& operator*() {
+      if (!decoded_) {
+        q_->get_record(row_);
+        decoded_ = true;
+      }
+      return row_;
+    }
+
+    const record_tuple_type* operator->() {
+      return &**this;
+    }
+
+  private:
+    query_type* q_;
+    bool end_;
+    bool decoded_;
+    size_t pos_;
+    record_tuple_type row_;
+  };
+
+  template <typename record_tuple_t, typename value_access_policy_t>
+  class input_query_row_buffer {
+  public:
+    typedef input_query_row_buffer_iterator<record_tuple_t, value_access_policy_t> iterator;
+    typedef input_query_base<record_tuple_t, value_access_policy_t> query_type;
+
+    input_query_row_buffer(query_type* q) :
+      q_(q) {
+    }
+
+    iterator begin() {
+      q_->step();
+      return iterator(q_, q_->result_code() != SQLITE_ROW);
+    }
+
+    iterator end() {
+      return iterator(q_, true);
+    }
+
+  private:
+    query_type* q_;
+  };
+
+  // input_query<my_struct> decodes rows straight into my_struct if it has a record_mapping
   template <typename... Rs>
-  class input_query : public input_query_base<std::tuple<Rs...>, default_value_access_policy> {
-    using input_query_base<std::tuple<Rs...>, default_value_access_policy>::input_query_base;
+  class input_query : public input_query_base<typename record_type<Rs...>::type, default_value_access_policy> {
+    using input_query_base<typename record_type<Rs...>::type, default_value_access_policy>::input_query_base;
   };
 }
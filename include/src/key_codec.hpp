@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace sqlite {
+
+  // Text encoding of key values (keyset_cursor positions, query_cache keys): a type letter, the value, and a
+  // terminator (integers, doubles) or a length prefix (strings, blobs), e.g. "i42;s5:hello"
+  template <typename T, typename enable_t = void>
+  struct key_codec;
+
+  template <typename T>
+  struct key_codec<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+    static void encode(std::string& out, const T value) {
+      out += "i" + std::to_string(int64_t(value)) + ";";
+    }
+
+    static bool decode(const std::string& in, size_t& pos, T& value) {
+      if ((pos >= in.size()) || (in[pos] != 'i')) return false;
+      const size_t end = in.find(';', pos);
+      if (end == std::string::npos) return false;
+      char* parsed_end = nullptr;
+      const std::string digits(in, pos + 1, end - pos - 1);
+      const long long v = std::strtoll(digits.c_str(), &parsed_end, 10);
+      if (digits.empty() || (parsed_end != digits.c_str() + digits.size())) return false;
+      value = T(v);
+      pos = end + 1;
+      return true;
+    }
+  };
+
+  template <>
+  struct key_codec<double> {
+    static void encode(std::string& out, const double value) {
+      char buffer[32];
+      // 17 significant digits round-trip exactly
+      std::snprintf(buffer, sizeof(buffer), "d%.17g;", value);
+      out += buffer;
+    }
+
+    static bool decode(const std::string& in, size_t& pos, double& value) {
+      if ((pos >= in.size()) || (in[pos] != 'd')) return false;
+      const size_t end = in.find(';', pos);
+      if (end == std::string::npos) return false;
+      char* parsed_end = nullptr;
+      const std::string digits(in, pos + 1, end - pos - 1);
+      value = std::strtod(digits.c_str(), &parsed_end);
+      if (digits.empty() || (parsed_end != digits.c_str() + digits.size())) return false;
+      pos = end + 1;
+      return true;
+    }
+  };
+
+  template <typename container_t, char tag>
+  struct sized_key_codec {
+    static void encode(std::string& out, const container_t& value) {
+      out += tag + std::to_string(value.size()) + ":";
+      out.append(value.begin(), value.end());
+    }
+
+    static bool decode(const std::string& in, size_t& pos, container_t& value) {
+      if ((pos >= in.size()) || (in[pos] != tag)) return false;
+      const size_t colon = in.find(':', pos);
+      if (colon == std::string::npos) return false;
+      char* parsed_end = nullptr;
+      const std::string digits(in, pos + 1, colon - pos - 1);
+      const unsigned long long size = std::strtoull(digits.c_str(), &parsed_end, 10);
+      if (digits.empty() || (parsed_end != digits.c_str() + digits.size())) return false;
+      if (size > in.size() - colon - 1) return false;
+      value.assign(in.begin() + colon + 1, in.begin() + colon + 1 + size);
+      pos = colon + 1 + size;
+      return true;
+    }
+  };
+
+  template <>
+  struct key_codec<std::string> : sized_key_codec<std::string, 's'> {
+  };
+
+  template <>
+  struct key_codec<std::vector<uint8_t>> : sized_key_codec<std::vector<uint8_t>, 'b'> {
+  };
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "ct_integer_list.hpp"
+#include "database.hpp"
+#include "key_codec.hpp"
+#include "logging.hpp"
+#include "query.hpp"
+#include "result_code_container.hpp"
+
+namespace sqlite {
+
+  // Pages through a table ordered by a unique key, selecting
+  //   WHERE (<key columns>) > (<last key>) ORDER BY <key columns> LIMIT <page size>
+  // with two statements prepared once. The statement is reset after each page, so no read
+  // transaction stays open between pages: WAL checkpoints can complete and old snapshots are
+  // not pinned while a long export runs. Each page is read from the latest snapshot, so rows
+  // changed behind the cursor are not revisited and rows inserted ahead of it are seen.
+  //
+  // Records start with the key columns: record_tuple_t is std::tuple<key columns..., other columns...>.
+  // position() encodes the last key seen; passing it to set_position() on a new cursor resumes the
+  // scan after that key.
+  template <typename key_tuple_t, typename record_tuple_t, typename value_access_policy_t>
+  class keyset_cursor_base : public result_code_container {
+  public:
+    typedef keyset_cursor_base<key_tuple_t, record_tuple_t, value_access_policy_t> type;
+    typedef key_tuple_t key_tuple_type;
+    typedef record_tuple_t record_tuple_type;
+
+    static const size_t key_size = std::tuple_size<key_tuple_t>::value;
+
+    keyset_cursor_base(const database::type_ptr& db, const std::string& table_name,
+                       const std::vector<std::string>& key_columns,
+                       const std::vector<std::string>& other_columns,
+                       const size_t page_size = 1000, const std::string& where = "") :
+      result_code_container(),
+      page_size_(page_size),
+      started_(false),
+      done_(false),
+      first_(db),
+      next_(db) {
+      static_assert(std::tuple_size<record_tuple_t>::value >= key_size,
+                    "Records have to start with the key columns");
+      if (key_columns.size() != key_size) {
+        SQLITE_HPP_LOG("keyset_cursor_base::keyset_cursor_base Key columns do not match the key type");
+        result_code_ = SQLITE_MISUSE;
+        return;
+      }
+      std::string columns;
+      std::string order;
+      for (size_t i = 0; i < key_columns.size(); ++i) {
+        if (i > 0) order += ", ";
+        order += "`" + key_columns[i] + "`";
+      }
+      columns = order;
+      for (const auto& c : other_columns) columns += ", `" + c + "`";
+      const std::string select = "SELECT " + columns + " FROM `" + table_name + "` WHERE ";
+      const std::string filter = where.empty() ? "" : " AND (" + where + ")";
+      const std::string limit = " ORDER BY " + order + " LIMIT ?" + std::to_string(key_size + 1);
+      first_.prepare(select + "1" + filter + limit);
+      if (first_.result_code() != SQLITE_OK) {
+        result_code_ = first_.result_code();
+        return;
+      }
+      next_.prepare(select + after_key(key_columns) + filter + limit);
+      result_code_ = next_.result_code();
+    }
+
+    // Replaces the contents of rows with the next page. Returns the number of rows read;
+    // 0 once the scan is complete or on errors (see result_code()).
+    size_t next_page(std::vector<record_tuple_t>& rows) {
+      size_t n = 0;
+      if (done_ || ((result_code_ != SQLITE_OK) && (result_code_ != SQLITE_DONE))) {
+        rows.clear();
+        return 0;
+      }
+      query_base<value_access_policy_t>& q = started_ ? next_ : first_;
+      sqlite3_stmt* stmt = q.statement().get();
+      if (started_) bind_key(q, typename ct_iota_0<key_size>::type());
+      q.bind(int(key_size) + 1, int64_t(page_size_));
+      for (;;) {
+        q.step();
+        if (q.result_code() != SQLITE_ROW) break;
+        if (rows.size() <= n) rows.emplace_back();
+        q.get_record(rows[n]);
+        ++n;
+      }
+      const int rc = q.result_code();
+      // Ends the statement's read transaction until the next page
+      sqlite3_reset(stmt);
+      rows.resize(n);
+      if (rc != SQLITE_DONE) {
+        result_code_ = rc;
+        return 0;
+      }
+      result_code_ = SQLITE_DONE;
+      if (n > 0) {
+        copy_key(rows[n - 1], typename ct_iota_0<key_size>::type());
+        started_ = true;
+      }
+      if (n < page_size_) done_ = true;
+      return n;
+    }
+
+    bool done() const {
+      return done_;
+    }
+
+    // Last key returned; only meaningful once a page has been read
+    const key_tuple_t& last_key() const {
+      return last_key_;
+    }
+
+    // Where the scan stands, to be stored and handed to set_position() later.
+    // Empty before the first page.
+    std::string position() const {
+      std::string out;
+      if (started_) encode_key(out, typename ct_iota_0<key_size>::type());
+      return out;
+    }
+
+    // Continues the scan after the encoded key; an empty position restarts it.
+    // Returns false, leaving the cursor unchanged, if the position can not be decoded.
+    bool set_position(const std::string& position) {
+      if (position.empty()) {
+        started_ = false;
+        done_ = false;
+        return true;
+      }
+      key_tuple_t key;
+      size_t pos = 0;
+      if (!decode_key(position, pos, key, typename ct_iota_0<key_size>::type()) || (pos != position.size())) {
+        SQLITE_HPP_LOG("keyset_cursor_base::set_position Invalid position " + position);
+        return false;
+      }
+      last_key_ = key;
+      started_ = true;
+      done_ = false;
+      return true;
+    }
+
+  private:
+    size_t page_size_;
+    bool started_;
+    bool done_;
+    key_tuple_t last_key_;
+    query_base<value_access_policy_t> first_;
+    query_base<value_access_policy_t> next_;
+
+    // Row values compare lexicographically since SQLite 3.15.0; older versions get the
+    // equivalent (k1 > ?1) OR (k1 = ?1 AND k2 > ?2) ...
+    static std::string after_key(const std::vector<std::string>& key_columns) {
+      std::string columns;
+      std::string params;
+      for (size_t i = 0; i < key_columns.size(); ++i) {
+        if (i > 0) {
+          columns += ", ";
+          params += ", ";
+        }
+        columns += "`" + key_columns[i] + "`";
+        params += "?" + std::to_string(i + 1);
+      }
+      if ((key_columns.size() == 1) || (sqlite3_libversion_number() >= 3015000)) {
+        return "(" + columns + ") > (" + params + ")";
+      }
+      std::string expanded;
+      for (size_t i = 0; i < key_columns.size(); ++i) {
+        if (i > 0) expanded += " OR ";
+        expanded += "(";
+        for (size_t j = 0; j < i; ++j) {
+          expanded += "`" + key_columns[j] + "` = ?" + std::to_string(j + 1) + " AND ";
+        }
+        expanded += "`" + key_columns[i] + "` > ?" + std::to_string(i + 1) + ")";
+      }
+      return "(" + expanded + ")";
+    }
+
+    template <size_t... indices>
+    void bind_key(query_base<value_access_policy_t>& q, ct_integer_list<indices...>) {
+      const int expand[] = {0, (q.bind(int(indices) + 1, std::get<indices>(last_key_)), 0)...};
+      (void)expand;
+    }
+
+    template <size_t... indices>
+    void copy_key(const record_tuple_t& row, ct_integer_list<indices...>) {
+      const int expand[] = {0, (std::get<indices>(last_key_) = std::get<indices>(row), 0)...};
+      (void)expand;
+    }
+
+    template <size_t... indices>
+    void encode_key(std::string& out, ct_integer_list<indices...>) const {
+      const int expand[] = {0, (key_codec<typename std::tuple_element<indices, key_tuple_t>::type>::encode(
+                                  out, std::get<indices>(last_key_)), 0)...};
+      (void)expand;
+    }
+
+    template <size_t... indices>
+    static bool decode_key(const std::string& in, size_t& pos, key_tuple_t& key, ct_integer_list<indices...>) {
+      bool ok = true;
+      // Stops decoding at the first failure
+      const int expand[] = {0, (ok = ok && key_codec<typename std::tuple_element<indices, key_tuple_t>::type>::decode(
+                                  in, pos, std::get<indices>(key)), 0)...};
+      (void)expand;
+      return ok;
+    }
+  };
+
+  // keyset_cursor<std::tuple<key types...>, record types...>
+  template <typename key_tuple_t, typename... Rs>
+  class keyset_cursor : public keyset_cursor_base<key_tuple_t, std::tuple<Rs...>, default_value_access_policy> {
+    using keyset_cursor_base<key_tuple_t, std::tuple<Rs...>, default_value_access_policy>::keyset_cursor_base;
+  };
+}
@@ -6,6 +6,7 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <mutex>
 
 namespace sqlite {
   class logging {
@@ -15,14 +16,16 @@ namespace sqlite {
       return instance;
     }
 
+    // Background threads (backup, prefetch_query, parallel_scan) log too
     void log(const std::string& s) {
+      std::lock_guard<std::mutex> lock(mutex_);
       log_to_stream(log_, s);
     }
   
   private:
     logging() {
       log_.open(SQLITE_HPP_LOG_FILENAME);
-      log("Sqlite header-only library logging started");
+      log_to_stream(log_, "Sqlite header-only library logging started");
     }
     logging(logging const&) = delete;
     void operator=(logging const&) = delete;
@@ -43,6 +46,7 @@ namespace sqlite {
       log_.flush();
     }
 
+    std::mutex mutex_;
     std::ofstream log_;
   };
 }
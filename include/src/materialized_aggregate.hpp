@@ -0,0 +1,359 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "change_detector.hpp"
+#include "change_hooks.hpp"
+#include "database.hpp"
+#include "logging.hpp"
+#include "query.hpp"
+#include "result_code_container.hpp"
+
+namespace sqlite {
+
+  template <typename value_t>
+  struct aggregate_state {
+    // COUNT(*)
+    int64_t count;
+    // SUM(value column), 0 when all values are NULL
+    value_t sum;
+  };
+
+  namespace detail {
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, void>::type
+    value_from(sqlite3_value* v, T& out) {
+      out = T(sqlite3_value_int64(v));
+    }
+
+    inline void value_from(sqlite3_value* v, double& out) {
+      out = sqlite3_value_double(v);
+    }
+
+    inline void value_from(sqlite3_value* v, std::string& out) {
+      const unsigned char* text = sqlite3_value_text(v);
+      out.assign(text != nullptr ? reinterpret_cast<const char*>(text) : "", size_t(sqlite3_value_bytes(v)));
+    }
+  }
+
+  // Keeps the result of
+  //   SELECT <group column>, COUNT(*), SUM(<value column>) FROM <table> GROUP BY <group column>
+  // in memory and current with the changes made through the connection, so that it is read in
+  // constant time instead of being recomputed. The result is computed once; afterwards the changes
+  // of each transaction are gathered as deltas and applied when it commits, or dropped when it
+  // rolls back:
+  //  - with SQLITE_HPP_HAS_PREUPDATE_HOOK the old and new values of changed rows come from the
+  //    preupdate hook, and commits are applied in the commit hook;
+  //  - otherwise the update hook collects the changed rowids, and refresh() reads them back on the
+  //    connection's thread; the group and value of every row are kept to compute the deltas.
+  // Changes the hooks do not see, including commits of other connections, make refresh() compute
+  // the result again (see change_detector), so refresh() should be called after writes either way.
+  // Rows with a NULL group are not counted. A ROLLBACK TO a savepoint is not reported by SQLite:
+  // call rebuild() after one. Floating point sums drift from a fresh SUM() by rounding errors.
+  // The lookups may be called from any thread.
+  template <typename group_t, typename value_t = double>
+  class materialized_aggregate : public change_listener, public result_code_container {
+  public:
+    typedef materialized_aggregate<group_t, value_t> type;
+    typedef std::shared_ptr<type> type_ptr;
+    typedef aggregate_state<value_t> state_type;
+    typedef std::unordered_map<group_t, state_type> groups_type;
+
+    materialized_aggregate(const database::type_ptr& db, const std::string& table_name,
+                           const std::string& group_column, const std::string& value_column,
+                           const std::string& schema = "main") :
+      result_code_container(),
+      db_(db),
+      table_name_(table_name),
+      schema_(schema),
+      group_column_(group_column),
+      value_column_(value_column),
+      group_index_(-1),
+      value_index_(-1),
+      changes_(db),
+      total_{0, value_t()} {
+      db_->hooks().add(this);
+      result_code_ = find_columns();
+      if (result_code_ != SQLITE_OK) {
+        SQLITE_HPP_LOG("materialized_aggregate::materialized_aggregate Columns not found in " + table_name_);
+        return;
+      }
+      rebuild();
+    }
+
+    materialized_aggregate(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    ~materialized_aggregate() {
+      db_->hooks().remove(this);
+    }
+
+    bool get(const group_t& group, state_type& state) const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto found = groups_.find(group);
+      if (found == groups_.end()) return false;
+      state = found->second;
+      return true;
+    }
+
+    // Over all groups
+    state_type total() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return total_;
+    }
+
+    groups_type groups() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return groups_;
+    }
+
+    // Computes the result again from the table; call outside of transactions
+    const int rebuild() {
+      changes_.unobserved_changes();
+      groups_type groups;
+      state_type total{0, value_t()};
+#if defined(SQLITE_HPP_HAS_PREUPDATE_HOOK)
+      query select(db_, "SELECT `" + group_column_ + "`, COUNT(*), COALESCE(SUM(`" + value_column_ + "`), 0) FROM " +
+                   table() + " WHERE `" + group_column_ + "` IS NOT NULL GROUP BY `" + group_column_ + "`");
+      for (select.step(); select.result_code() == SQLITE_ROW; select.step()) {
+        const state_type s{select.get<int64_t>(1), select.get<value_t>(2)};
+        groups[select.get<group_t>(0)] = s;
+        add(total, s.count, s.sum);
+      }
+#else
+      rows_type rows;
+      query select(db_, "SELECT rowid, `" + group_column_ + "`, `" + value_column_ + "` FROM " + table());
+      for (select.step(); select.result_code() == SQLITE_ROW; select.step()) {
+        const row_state r = read_row(select, 1);
+        if (!r.has_group) continue;
+        rows[select.get<int64_t>(0)] = r;
+        add(groups.insert(std::make_pair(r.group, state_type{0, value_t()})).first->second, 1, r.value);
+        add(total, 1, r.value);
+      }
+#endif
+      if (select.result_code() != SQLITE_DONE) {
+        SQLITE_HPP_LOG("materialized_aggregate::rebuild Failed to read " + table_name_);
+        result_code_ = select.result_code();
+        return result_code_;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      groups_.swap(groups);
+      total_ = total;
+#if defined(SQLITE_HPP_HAS_PREUPDATE_HOOK)
+      pending_.clear();
+#else
+      rows_.swap(rows);
+      committed_rows_.clear();
+#endif
+      result_code_ = SQLITE_OK;
+      return result_code_;
+    }
+
+    // Catches up with changes not applied yet. Returns SQLITE_MISUSE inside a transaction.
+    const int refresh() {
+      ::sqlite3* db = db_->db().get();
+      if ((db == nullptr) || !sqlite3_get_autocommit(db)) {
+        SQLITE_HPP_LOG("materialized_aggregate::refresh Not in autocommit mode");
+        result_code_ = SQLITE_MISUSE;
+        return result_code_;
+      }
+      if (changes_.unobserved_changes()) {
+        SQLITE_HPP_LOG("materialized_aggregate::refresh Unobserved changes, rebuilding");
+        return rebuild();
+      }
+      result_code_ = SQLITE_OK;
+#if !defined(SQLITE_HPP_HAS_PREUPDATE_HOOK)
+      std::unordered_set<int64_t> changed;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        changed.swap(committed_rows_);
+      }
+      if (changed.empty()) return result_code_;
+      // Read without holding the lock the hooks take
+      std::vector<std::pair<int64_t, row_state>> current;
+      query select(db_, "SELECT `" + group_column_ + "`, `" + value_column_ + "` FROM " + table() + " WHERE rowid = ?");
+      for (const int64_t rowid : changed) {
+        select.bind(1, rowid);
+        select.step();
+        row_state r{false, group_t(), value_t()};
+        if (select.result_code() == SQLITE_ROW) r = read_row(select, 0);
+        if ((select.result_code() != SQLITE_ROW) && (select.result_code() != SQLITE_DONE)) {
+          result_code_ = select.result_code();
+          // Kept for the next refresh()
+          std::lock_guard<std::mutex> lock(mutex_);
+          committed_rows_.insert(changed.begin(), changed.end());
+          return result_code_;
+        }
+        sqlite3_reset(select.statement().get());
+        current.push_back(std::make_pair(rowid, r));
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto& c : current) {
+        auto old = rows_.find(c.first);
+        if (old != rows_.end()) {
+          if (old->second.has_group) apply(groups_, total_, old->second.group, -1, -old->second.value);
+          rows_.erase(old);
+        }
+        if (c.second.has_group) {
+          apply(groups_, total_, c.second.group, 1, c.second.value);
+          rows_[c.first] = c.second;
+        }
+      }
+#endif
+      return result_code_;
+    }
+
+#if defined(SQLITE_HPP_HAS_PREUPDATE_HOOK)
+    // The values come from on_preupdate()
+    void on_update(const int, const char*, const char*, const int64_t) override {
+      changes_.observed();
+    }
+
+    void on_preupdate(::sqlite3* db, const int op, const char* db_name, const char* table,
+                      const int64_t, const int64_t) override {
+      if (!is_table(db_name, table)) return;
+      std::lock_guard<std::mutex> lock(mutex_);
+      if ((op == SQLITE_DELETE) || (op == SQLITE_UPDATE)) {
+        sqlite3_value* g = nullptr;
+        sqlite3_value* v = nullptr;
+        if ((sqlite3_preupdate_old(db, group_index_, &g) == SQLITE_OK) &&
+            (sqlite3_preupdate_old(db, value_index_, &v) == SQLITE_OK)) {
+          delta(g, v, -1);
+        }
+      }
+      if ((op == SQLITE_INSERT) || (op == SQLITE_UPDATE)) {
+        sqlite3_value* g = nullptr;
+        sqlite3_value* v = nullptr;
+        if ((sqlite3_preupdate_new(db, group_index_, &g) == SQLITE_OK) &&
+            (sqlite3_preupdate_new(db, value_index_, &v) == SQLITE_OK)) {
+          delta(g, v, 1);
+        }
+      }
+    }
+#else
+    void on_update(const int, const char* db_name, const char* table, const int64_t rowid) override {
+      changes_.observed();
+      if (!is_table(db_name, table)) return;
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_rows_.insert(rowid);
+    }
+#endif
+
+    void on_commit() override {
+      std::lock_guard<std::mutex> lock(mutex_);
+#if defined(SQLITE_HPP_HAS_PREUPDATE_HOOK)
+      for (const auto& p : pending_) apply(groups_, total_, p.first, p.second.count, p.second.sum);
+      pending_.clear();
+#else
+      committed_rows_.insert(pending_rows_.begin(), pending_rows_.end());
+      pending_rows_.clear();
+#endif
+    }
+
+    void on_rollback() override {
+      std::lock_guard<std::mutex> lock(mutex_);
+#if defined(SQLITE_HPP_HAS_PREUPDATE_HOOK)
+      pending_.clear();
+#else
+      pending_rows_.clear();
+#endif
+    }
+
+  private:
+    struct row_state {
+      bool has_group;
+      group_t group;
+      value_t value;
+    };
+    typedef std::unordered_map<int64_t, row_state> rows_type;
+
+    database::type_ptr db_;
+    std::string table_name_;
+    std::string schema_;
+    std::string group_column_;
+    std::string value_column_;
+    // Positions of the columns in the table, for the preupdate hook
+    int group_index_;
+    int value_index_;
+    change_detector changes_;
+    mutable std::mutex mutex_;
+    groups_type groups_;
+    state_type total_;
+#if defined(SQLITE_HPP_HAS_PREUPDATE_HOOK)
+    // Deltas of the open transaction
+    groups_type pending_;
+#else
+    // Group and value of every row, to subtract when it changes
+    rows_type rows_;
+    // Rowids changed by the open transaction and by committed transactions not refreshed yet
+    std::unordered_set<int64_t> pending_rows_;
+    std::unordered_set<int64_t> committed_rows_;
+#endif
+
+    std::string table() const {
+      return "`" + schema_ + "`.`" + table_name_ + "`";
+    }
+
+    bool is_table(const char* db_name, const char* table) const {
+      return (sqlite3_stricmp(table, table_name_.c_str()) == 0) && (sqlite3_stricmp(db_name, schema_.c_str()) == 0);
+    }
+
+    int find_columns() {
+      query info(db_, "PRAGMA `" + schema_ + "`.table_info(`" + table_name_ + "`)");
+      for (info.step(); info.result_code() == SQLITE_ROW; info.step()) {
+        const std::string name = info.get<std::string>(1);
+        if (sqlite3_stricmp(name.c_str(), group_column_.c_str()) == 0) group_index_ = info.get<int>(0);
+        if (sqlite3_stricmp(name.c_str(), value_column_.c_str()) == 0) value_index_ = info.get<int>(0);
+      }
+      if (info.result_code() != SQLITE_DONE) return info.result_code();
+      return ((group_index_ >= 0) && (value_index_ >= 0)) ? SQLITE_OK : SQLITE_ERROR;
+    }
+
+    static void add(state_type& s, const int64_t count, const value_t sum) {
+      s.count += count;
+      s.sum += sum;
+    }
+
+    // Applies a delta to a group, dropping groups left without rows as GROUP BY would
+    static void apply(groups_type& groups, state_type& total, const group_t& group,
+                      const int64_t count, const value_t sum) {
+      if (count == 0 && sum == value_t()) return;
+      state_type& s = groups.insert(std::make_pair(group, state_type{0, value_t()})).first->second;
+      add(s, count, sum);
+      add(total, count, sum);
+      if (s.count == 0) groups.erase(group);
+    }
+
+    // Group and value of the current row of q, starting at column i
+    static row_state read_row(query& q, const int i) {
+      row_state r{false, group_t(), value_t()};
+      r.has_group = sqlite3_column_type(q.statement().get(), i) != SQLITE_NULL;
+      if (r.has_group) r.group = q.get<group_t>(i);
+      if (sqlite3_column_type(q.statement().get(), i + 1) != SQLITE_NULL) r.value = q.get<value_t>(i + 1);
+      return r;
+    }
+
+#if defined(SQLITE_HPP_HAS_PREUPDATE_HOOK)
+    void delta(sqlite3_value* g, sqlite3_value* v, const int64_t sign) {
+      if (sqlite3_value_type(g) == SQLITE_NULL) return;
+      group_t group;
+      value_t value = value_t();
+      detail::value_from(g, group);
+      if (sqlite3_value_type(v) != SQLITE_NULL) detail::value_from(v, value);
+      state_type& s = pending_.insert(std::make_pair(group, state_type{0, value_t()})).first->second;
+      s.count += sign;
+      s.sum += sign > 0 ? value : -value;
+    }
+#endif
+  };
+}
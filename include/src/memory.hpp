@@ -0,0 +1,385 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "logging.hpp"
+
+namespace sqlite {
+
+  enum class memory_category : uint8_t {
+    // Anything not attributed to one of the categories below
+    other = 0,
+    // Page cache arenas (see page_cache.hpp). With SQLite's default page cache the pages are
+    // ordinary SQLite allocations and count as other.
+    page_cache,
+    // Everything SQLite allocates while the library prepares a statement: the statement itself,
+    // but also the schema loaded by the first prepare on a connection and the pages read for it,
+    // which stay counted here until they are freed
+    statements,
+    // Library-owned buffers: pending records of buffered inserts, pending keys of buffered selects
+    buffers,
+    // Everything SQLite allocates while the library decodes column values: conversion buffers,
+    // and the overflow pages read for long strings and blobs
+    decoded_values
+  };
+
+  static const size_t memory_category_count = 5;
+
+  struct memory_stats {
+    // Bytes currently in use, indexed by memory_category
+    int64_t bytes[memory_category_count];
+    // High-water marks of the above
+    int64_t peak_bytes[memory_category_count];
+    // Allocations requested by SQLite
+    uint64_t sqlite_allocations;
+    // Allocations served from the size-class pools without calling the system allocator
+    uint64_t pool_allocations;
+    // Calls to the system allocator made by the pools
+    uint64_t system_allocations;
+    // Memory held by the pools, both in use and free
+    uint64_t reserved_bytes;
+
+    int64_t total_bytes() const {
+      int64_t total = 0;
+      for (size_t i = 0; i < memory_category_count; ++i) total += bytes[i];
+      return total;
+    }
+  };
+
+  struct memory_config {
+    // Requests larger than this go straight to the system allocator
+    size_t max_pooled_size = 16384;
+    // Size of the chunks the pools reserve from the system allocator at once
+    size_t chunk_size = 65536;
+  };
+
+  // Memory accounting, and an optional size-class pool allocator for SQLite
+  // (SQLITE_CONFIG_MALLOC). The allocator attributes each allocation to the category set
+  // for the current thread by memory::scope; library-owned memory is reported directly through track().
+  // Like page_cache, install() and uninstall() only work while SQLite is not initialized.
+  class memory {
+  public:
+    typedef memory_config config;
+
+    // Attributes SQLite allocations made by the current thread to a category while alive. Does
+    // nothing unless the allocator is installed.
+    class scope {
+    public:
+      explicit scope(const memory_category category) :
+        active_(installed()),
+        previous_(memory_category::other) {
+        if (active_) {
+          previous_ = current_category();
+          current_category() = category;
+        }
+      }
+
+      ~scope() {
+        if (active_) current_category() = previous_;
+      }
+
+      scope(const scope&) = delete;
+      scope& operator=(const scope&) = delete;
+
+    private:
+      bool active_;
+      memory_category previous_;
+    };
+
+    static const int install(const config& cfg = config()) {
+      state& s = get_state();
+      if (s.installed) return SQLITE_OK;
+      int rc = sqlite3_config(SQLITE_CONFIG_GETMALLOC, &s.previous);
+      if (rc != SQLITE_OK) return rc;
+      s.build_size_classes(cfg);
+      rc = sqlite3_config(SQLITE_CONFIG_MALLOC, &methods());
+      if (rc == SQLITE_OK) {
+        s.installed = true;
+        SQLITE_HPP_LOG("memory::install Pool allocator installed");
+      }
+      return rc;
+    }
+
+    // Restores the previous allocator and releases the pools. SQLite must have been shut down,
+    // so that nothing allocated by the pools is still in use.
+    static const int uninstall() {
+      state& s = get_state();
+      if (!s.installed) return SQLITE_OK;
+      const int rc = sqlite3_config(SQLITE_CONFIG_MALLOC, &s.previous);
+      if (rc == SQLITE_OK) {
+        s.installed = false;
+        s.release_pools();
+      }
+      return rc;
+    }
+
+    static bool installed() {
+      return get_state().installed;
+    }
+
+    // Reports memory the library allocates itself
+    static void track(const memory_category category, const int64_t delta) {
+      get_state().add(category, delta);
+    }
+
+    static memory_stats stats() {
+      const state& s = get_state();
+      memory_stats st;
+      for (size_t i = 0; i < memory_category_count; ++i) {
+        st.bytes[i] = s.bytes[i].load(std::memory_order_relaxed);
+        st.peak_bytes[i] = s.peak_bytes[i].load(std::memory_order_relaxed);
+      }
+      st.sqlite_allocations = s.sqlite_allocations.load(std::memory_order_relaxed);
+      st.pool_allocations = s.pool_allocations.load(std::memory_order_relaxed);
+      st.system_allocations = s.system_allocations.load(std::memory_order_relaxed);
+      st.reserved_bytes = s.reserved_bytes.load(std::memory_order_relaxed);
+      return st;
+    }
+
+    static memory_category& current_category() {
+      static thread_local memory_category category = memory_category::other;
+      return category;
+    }
+
+  private:
+    // Precedes every block handed out to SQLite. Size classes are multiples of 8, so blocks keep
+    // the 8-byte alignment SQLite requires.
+    struct block_header {
+      uint32_t size_class;
+      uint32_t category;
+      uint64_t size;
+    };
+
+    static const uint32_t large_block = 0xffffffff;
+
+    struct pool {
+      std::mutex mutex;
+      size_t block_size;
+      void* free;
+    };
+
+    struct state {
+      state() : installed(false), sqlite_allocations(0), pool_allocations(0),
+                system_allocations(0), reserved_bytes(0) {
+        for (size_t i = 0; i < memory_category_count; ++i) {
+          bytes[i] = 0;
+          peak_bytes[i] = 0;
+        }
+      }
+
+      // Size classes grow by a quarter of the preceding power of two, rounded up to a multiple of
+      // 8: 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, ...
+      void build_size_classes(const config& cfg) {
+        release_pools();
+        cfg_ = cfg;
+        for (size_t p = 16; p <= cfg.max_pooled_size; p *= 2) {
+          for (size_t q = 0; q < 4; ++q) {
+            const size_t sz = (p + q * p / 4 + 7) / 8 * 8;
+            if (sz > cfg.max_pooled_size) break;
+            if (!class_sizes.empty() && (class_sizes.back() == sz)) continue;
+            class_sizes.push_back(sz);
+          }
+        }
+        pools = std::vector<std::unique_ptr<pool>>(class_sizes.size());
+        for (size_t i = 0; i < pools.size(); ++i) {
+          pools[i].reset(new pool());
+          pools[i]->block_size = class_sizes[i] + sizeof(block_header);
+          pools[i]->free = nullptr;
+        }
+      }
+
+      void release_pools() {
+        std::lock_guard<std::mutex> lock(chunks_mutex);
+        for (void* c : chunks) std::free(c);
+        chunks.clear();
+        pools.clear();
+        class_sizes.clear();
+        reserved_bytes = 0;
+      }
+
+      void add(const memory_category category, const int64_t delta) {
+        const size_t i = size_t(category);
+        const int64_t now = bytes[i].fetch_add(delta, std::memory_order_relaxed) + delta;
+        int64_t peak = peak_bytes[i].load(std::memory_order_relaxed);
+        while ((now > peak) &&
+               !peak_bytes[i].compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+        }
+      }
+
+      bool installed;
+      config cfg_;
+      sqlite3_mem_methods previous;
+      std::vector<size_t> class_sizes;
+      std::vector<std::unique_ptr<pool>> pools;
+      std::mutex chunks_mutex;
+      std::vector<void*> chunks;
+      std::atomic<int64_t> bytes[memory_category_count];
+      std::atomic<int64_t> peak_bytes[memory_category_count];
+      std::atomic<uint64_t> sqlite_allocations;
+      std::atomic<uint64_t> pool_allocations;
+      std::atomic<uint64_t> system_allocations;
+      std::atomic<uint64_t> reserved_bytes;
+    };
+
+    static state& get_state() {
+      static state instance;
+      return instance;
+    }
+
+    static const sqlite3_mem_methods& methods() {
+      static const sqlite3_mem_methods m = {
+        &x_malloc, &x_free, &x_realloc, &x_size, &x_roundup, &x_init, &x_shutdown, nullptr
+      };
+      return m;
+    }
+
+    static uint32_t size_class(const state& s, const size_t n) {
+      auto it = std::lower_bound(s.class_sizes.begin(), s.class_sizes.end(), n);
+      if (it == s.class_sizes.end()) return large_block;
+      return uint32_t(it - s.class_sizes.begin());
+    }
+
+    static block_header* header(void* p) {
+      return static_cast<block_header*>(p) - 1;
+    }
+
+    static void* allocate(const size_t n, const memory_category category) {
+      state& s = get_state();
+      s.sqlite_allocations.fetch_add(1, std::memory_order_relaxed);
+      const uint32_t c = size_class(s, n);
+      block_header* h = nullptr;
+      if (c == large_block) {
+        h = static_cast<block_header*>(std::malloc(sizeof(block_header) + n));
+        if (h == nullptr) return nullptr;
+        s.system_allocations.fetch_add(1, std::memory_order_relaxed);
+        h->size = n;
+      } else {
+        pool& p = *s.pools[c];
+        std::lock_guard<std::mutex> lock(p.mutex);
+        if (p.free == nullptr) {
+          const size_t n_blocks = std::max<size_t>(1, s.cfg_.chunk_size / p.block_size);
+          unsigned char* chunk = static_cast<unsigned char*>(std::malloc(n_blocks * p.block_size));
+          if (chunk == nullptr) return nullptr;
+          s.system_allocations.fetch_add(1, std::memory_order_relaxed);
+          s.reserved_bytes.fetch_add(n_blocks * p.block_size, std::memory_order_relaxed);
+          {
+            std::lock_guard<std::mutex> chunks_lock(s.chunks_mutex);
+            s.chunks.push_back(chunk);
+          }
+          for (size_t i = n_blocks; i > 0; --i) {
+            void* block = chunk + (i - 1) * p.block_size;
+            *static_cast<void**>(block) = p.free;
+            p.free = block;
+          }
+        } else {
+          s.pool_allocations.fetch_add(1, std::memory_order_relaxed);
+        }
+        h = static_cast<block_header*>(p.free);
+        p.free = *static_cast<void**>(p.free);
+        h->size = s.class_sizes[c];
+      }
+      h->size_class = c;
+      h->category = uint32_t(category);
+      s.add(category, int64_t(h->size));
+      return h + 1;
+    }
+
+    static void deallocate(void* ptr) {
+      state& s = get_state();
+      block_header* h = header(ptr);
+      s.add(memory_category(h->category), -int64_t(h->size));
+      if (h->size_class == large_block) {
+        std::free(h);
+      } else {
+        pool& p = *s.pools[h->size_class];
+        std::lock_guard<std::mutex> lock(p.mutex);
+        *reinterpret_cast<void**>(h) = p.free;
+        p.free = h;
+      }
+    }
+
+    static void* x_malloc(int n) {
+      return allocate(size_t(n), current_category());
+    }
+
+    static void x_free(void* p) {
+      deallocate(p);
+    }
+
+    static void* x_realloc(void* p, int n) {
+      block_header* h = header(p);
+      if (size_t(n) <= h->size) return p;
+      void* q = allocate(size_t(n), memory_category(h->category));
+      if (q == nullptr) return nullptr;
+      std::memcpy(q, p, size_t(h->size));
+      deallocate(p);
+      return q;
+    }
+
+    static int x_size(void* p) {
+      return int(header(p)->size);
+    }
+
+    static int x_roundup(int n) {
+      const state& s = get_state();
+      const uint32_t c = size_class(s, size_t(n));
+      if (c == large_block) return (n + 7) / 8 * 8;
+      return int(s.class_sizes[c]);
+    }
+
+    static int x_init(void*) {
+      return SQLITE_OK;
+    }
+
+    static void x_shutdown(void*) {
+    }
+  };
+
+  // STL allocator reporting the memory of library-owned containers to memory::track()
+  template <typename T, memory_category category = memory_category::buffers>
+  struct tracking_allocator {
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind {
+      typedef tracking_allocator<U, category> other;
+    };
+
+    tracking_allocator() {
+    }
+
+    template <typename U>
+    tracking_allocator(const tracking_allocator<U, category>&) {
+    }
+
+    T* allocate(const size_t n) {
+      T* p = std::allocator<T>().allocate(n);
+      memory::track(category, int64_t(n * sizeof(T)));
+      return p;
+    }
+
+    void deallocate(T* p, const size_t n) {
+      memory::track(category, -int64_t(n * sizeof(T)));
+      std::allocator<T>().deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(const tracking_allocator<U, category>&) const {
+      return true;
+    }
+
+    template <typename U>
+    bool operator!=(const tracking_allocator<U, category>&) const {
+      return false;
+    }
+  };
+}
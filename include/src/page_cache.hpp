@@ -0,0 +1,491 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "logging.hpp"
+#include "memory.hpp"
+
+namespace sqlite {
+
+  struct page_cache_stats {
+    // Fetches of pages that were already cached
+    uint64_t hits;
+    // Fetches of pages that were not cached
+    uint64_t misses;
+    // Unpinned pages dropped to stay within the cache size
+    uint64_t evictions;
+    // Pages currently held by all caches
+    uint64_t pages;
+    // Memory reserved by the arenas
+    uint64_t arena_bytes;
+  };
+
+  struct page_cache_config {
+    // Share one arena between all caches with the same page size, instead of one arena per cache
+    bool shared_arena = false;
+    // Number of pages reserved at once when an arena runs out of free slots
+    size_t slots_per_slab = 64;
+  };
+
+  struct page_cache_counters {
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> evictions;
+    std::atomic<uint64_t> pages;
+    std::atomic<uint64_t> arena_bytes;
+  };
+
+  // Pool of fixed-size slots carved out of large slabs. Slots are never returned to the
+  // general-purpose allocator until the arena itself is destroyed.
+  class page_cache_arena {
+  public:
+    typedef page_cache_arena type;
+    typedef std::shared_ptr<type> type_ptr;
+
+    page_cache_arena(const size_t slot_size, const size_t slots_per_slab, page_cache_counters& counters) :
+      slot_size_(slot_size),
+      slots_per_slab_(slots_per_slab > 0 ? slots_per_slab : 1),
+      free_(nullptr),
+      counters_(counters) {
+    }
+
+    page_cache_arena(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    ~page_cache_arena() {
+      const size_t bytes = slabs_.size() * slot_size_ * slots_per_slab_;
+      counters_.arena_bytes -= bytes;
+      memory::track(memory_category::page_cache, -int64_t(bytes));
+    }
+
+    const size_t slot_size() const {
+      return slot_size_;
+    }
+
+    void* allocate() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (free_ == nullptr) {
+        const size_t slab_bytes = slot_size_ * slots_per_slab_;
+        std::unique_ptr<unsigned char[]> slab(new (std::nothrow) unsigned char[slab_bytes]);
+        if (!slab) return nullptr;
+        for (size_t i = slots_per_slab_; i > 0; --i) {
+          void* slot = slab.get() + (i - 1) * slot_size_;
+          *static_cast<void**>(slot) = free_;
+          free_ = slot;
+        }
+        slabs_.push_back(std::move(slab));
+        counters_.arena_bytes += slab_bytes;
+        memory::track(memory_category::page_cache, int64_t(slab_bytes));
+      }
+      void* slot = free_;
+      free_ = *static_cast<void**>(slot);
+      return slot;
+    }
+
+    void deallocate(void* slot) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      *static_cast<void**>(slot) = free_;
+      free_ = slot;
+    }
+
+  private:
+    const size_t slot_size_;
+    const size_t slots_per_slab_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<unsigned char[]>> slabs_;
+    void* free_;
+    page_cache_counters& counters_;
+  };
+
+  // Header of an arena slot. The page buffer and the extra space follow it in the same slot.
+  struct page_cache_slot {
+    sqlite3_pcache_page page;
+    page_cache_slot* hash_next;
+    page_cache_slot* lru_prev;
+    page_cache_slot* lru_next;
+    unsigned key;
+    bool pinned;
+  };
+
+  // One cache as created by xCreate. SQLite serializes calls on a single cache, so the only
+  // synchronization needed is inside the arena when it is shared.
+  class page_cache_instance {
+  public:
+    page_cache_instance(const page_cache_arena::type_ptr& arena, const int page_size, const int extra_size,
+                        const bool purgeable, page_cache_counters& counters) :
+      arena_(arena),
+      page_offset_(header_size()),
+      extra_offset_(header_size() + round_up(page_size)),
+      extra_size_(extra_size),
+      purgeable_(purgeable),
+      max_pages_(0),
+      n_pages_(0),
+      buckets_(64, nullptr),
+      counters_(counters) {
+      lru_.lru_prev = &lru_;
+      lru_.lru_next = &lru_;
+    }
+
+    page_cache_instance(const page_cache_instance&) = delete;
+    page_cache_instance& operator=(const page_cache_instance&) = delete;
+
+    ~page_cache_instance() {
+      truncate(0);
+    }
+
+    static size_t slot_size(const int page_size, const int extra_size) {
+      return round_up(header_size() + round_up(page_size) + extra_size, 16);
+    }
+
+    void cache_size(const int n_max) {
+      max_pages_ = n_max > 0 ? unsigned(n_max) : 0;
+      enforce_limit();
+    }
+
+    unsigned page_count() const {
+      return n_pages_;
+    }
+
+    sqlite3_pcache_page* fetch(const unsigned key, const int create_flag) {
+      page_cache_slot* slot = find(key);
+      if (slot != nullptr) {
+        counters_.hits.fetch_add(1, std::memory_order_relaxed);
+        if (!slot->pinned) {
+          lru_remove(slot);
+          slot->pinned = true;
+        }
+        return &slot->page;
+      }
+      counters_.misses.fetch_add(1, std::memory_order_relaxed);
+      if (create_flag == 0) return nullptr;
+
+      void* mem = nullptr;
+      if (purgeable_ && (n_pages_ >= max_pages_)) {
+        if (lru_.lru_prev != &lru_) {
+          // Recycle the least recently used page in place
+          page_cache_slot* victim = lru_.lru_prev;
+          lru_remove(victim);
+          hash_remove(victim);
+          --n_pages_;
+          counters_.pages.fetch_sub(1, std::memory_order_relaxed);
+          counters_.evictions.fetch_add(1, std::memory_order_relaxed);
+          mem = victim;
+        } else if (create_flag == 1) {
+          return nullptr;
+        }
+      }
+      if (mem == nullptr) {
+        mem = arena_->allocate();
+        if (mem == nullptr) return nullptr;
+      }
+      slot = static_cast<page_cache_slot*>(mem);
+      unsigned char* base = static_cast<unsigned char*>(mem);
+      slot->page.pBuf = base + page_offset_;
+      slot->page.pExtra = base + extra_offset_;
+      std::memset(slot->page.pExtra, 0, extra_size_);
+      slot->key = key;
+      slot->pinned = true;
+      slot->lru_prev = slot->lru_next = nullptr;
+      hash_insert(slot);
+      ++n_pages_;
+      counters_.pages.fetch_add(1, std::memory_order_relaxed);
+      return &slot->page;
+    }
+
+    void unpin(sqlite3_pcache_page* page, const bool discard) {
+      page_cache_slot* slot = reinterpret_cast<page_cache_slot*>(page);
+      slot->pinned = false;
+      if (discard) {
+        hash_remove(slot);
+        release(slot);
+      } else {
+        lru_push_front(slot);
+        enforce_limit();
+      }
+    }
+
+    // A page already cached under new_key, pinned or not, is dropped
+    void rekey(sqlite3_pcache_page* page, const unsigned, const unsigned new_key) {
+      page_cache_slot* slot = reinterpret_cast<page_cache_slot*>(page);
+      page_cache_slot* existing = find(new_key);
+      if ((existing != nullptr) && (existing != slot)) {
+        discard(existing);
+      }
+      hash_remove(slot);
+      slot->key = new_key;
+      hash_insert(slot);
+    }
+
+    // Drops all pages with keys greater than or equal to the limit, pinned or not
+    void truncate(const unsigned limit) {
+      for (auto& bucket : buckets_) {
+        page_cache_slot** link = &bucket;
+        while (*link != nullptr) {
+          page_cache_slot* slot = *link;
+          if (slot->key >= limit) {
+            *link = slot->hash_next;
+            if (!slot->pinned) lru_remove(slot);
+            release(slot);
+          } else {
+            link = &slot->hash_next;
+          }
+        }
+      }
+    }
+
+    // Gives all unpinned pages back to the arena
+    void shrink() {
+      while (lru_.lru_prev != &lru_) {
+        discard(lru_.lru_prev);
+      }
+    }
+
+  private:
+    static size_t round_up(const size_t n, const size_t alignment = 8) {
+      return (n + alignment - 1) / alignment * alignment;
+    }
+
+    static size_t header_size() {
+      return round_up(sizeof(page_cache_slot), 16);
+    }
+
+    page_cache_slot* find(const unsigned key) const {
+      page_cache_slot* slot = buckets_[key & (buckets_.size() - 1)];
+      while ((slot != nullptr) && (slot->key != key)) slot = slot->hash_next;
+      return slot;
+    }
+
+    void hash_insert(page_cache_slot* slot) {
+      if (n_pages_ >= buckets_.size()) rehash(buckets_.size() * 2);
+      page_cache_slot*& bucket = buckets_[slot->key & (buckets_.size() - 1)];
+      slot->hash_next = bucket;
+      bucket = slot;
+    }
+
+    void hash_remove(page_cache_slot* slot) {
+      page_cache_slot** link = &buckets_[slot->key & (buckets_.size() - 1)];
+      while (*link != slot) link = &(*link)->hash_next;
+      *link = slot->hash_next;
+    }
+
+    void rehash(const size_t n_buckets) {
+      std::vector<page_cache_slot*> buckets(n_buckets, nullptr);
+      for (auto slot : buckets_) {
+        while (slot != nullptr) {
+          page_cache_slot* next = slot->hash_next;
+          page_cache_slot*& bucket = buckets[slot->key & (n_buckets - 1)];
+          slot->hash_next = bucket;
+          bucket = slot;
+          slot = next;
+        }
+      }
+      buckets_.swap(buckets);
+    }
+
+    void lru_push_front(page_cache_slot* slot) {
+      slot->lru_prev = &lru_;
+      slot->lru_next = lru_.lru_next;
+      lru_.lru_next->lru_prev = slot;
+      lru_.lru_next = slot;
+    }
+
+    void lru_remove(page_cache_slot* slot) {
+      slot->lru_prev->lru_next = slot->lru_next;
+      slot->lru_next->lru_prev = slot->lru_prev;
+      slot->lru_prev = slot->lru_next = nullptr;
+    }
+
+    // Removes a page from the hash table, and from the LRU list if it is unpinned
+    void discard(page_cache_slot* slot) {
+      if (!slot->pinned) lru_remove(slot);
+      hash_remove(slot);
+      release(slot);
+    }
+
+    void release(page_cache_slot* slot) {
+      --n_pages_;
+      counters_.pages.fetch_sub(1, std::memory_order_relaxed);
+      arena_->deallocate(slot);
+    }
+
+    void enforce_limit() {
+      if (!purgeable_) return;
+      while ((n_pages_ > max_pages_) && (lru_.lru_prev != &lru_)) {
+        discard(lru_.lru_prev);
+        counters_.evictions.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    page_cache_arena::type_ptr arena_;
+    const size_t page_offset_;
+    const size_t extra_offset_;
+    const size_t extra_size_;
+    const bool purgeable_;
+    unsigned max_pages_;
+    unsigned n_pages_;
+    std::vector<page_cache_slot*> buckets_;
+    // Sentinel of the list of unpinned pages, most recently used first
+    page_cache_slot lru_;
+    page_cache_counters& counters_;
+  };
+
+  // Optional replacement of SQLite's page cache (SQLITE_CONFIG_PCACHE2). Pages come from
+  // slab arenas of fixed-size slots instead of one general-purpose allocation per page,
+  // and unpinned pages are recycled in LRU order.
+  // SQLite only accepts configuration changes while it is not initialized, so install()
+  // and uninstall() have to be called before the first connection is opened or after
+  // sqlite3_shutdown(). They return SQLITE_MISUSE otherwise.
+  class page_cache {
+  public:
+    typedef page_cache_config config;
+
+    static const int install(const config& cfg = config()) {
+      state& s = get_state();
+      if (s.installed) return SQLITE_OK;
+      int rc = sqlite3_config(SQLITE_CONFIG_GETPCACHE2, &s.previous);
+      if (rc != SQLITE_OK) return rc;
+      s.cfg = cfg;
+      rc = sqlite3_config(SQLITE_CONFIG_PCACHE2, &methods());
+      if (rc == SQLITE_OK) {
+        s.installed = true;
+        SQLITE_HPP_LOG("page_cache::install Page cache installed");
+      }
+      return rc;
+    }
+
+    // Restores the page cache that was configured before install()
+    static const int uninstall() {
+      state& s = get_state();
+      if (!s.installed) return SQLITE_OK;
+      const int rc = sqlite3_config(SQLITE_CONFIG_PCACHE2, &s.previous);
+      if (rc == SQLITE_OK) {
+        s.installed = false;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.shared_arenas.clear();
+      }
+      return rc;
+    }
+
+    static bool installed() {
+      return get_state().installed;
+    }
+
+    static page_cache_stats stats() {
+      const page_cache_counters& c = get_state().counters;
+      page_cache_stats st;
+      st.hits = c.hits.load(std::memory_order_relaxed);
+      st.misses = c.misses.load(std::memory_order_relaxed);
+      st.evictions = c.evictions.load(std::memory_order_relaxed);
+      st.pages = c.pages.load(std::memory_order_relaxed);
+      st.arena_bytes = c.arena_bytes.load(std::memory_order_relaxed);
+      return st;
+    }
+
+    static void reset_stats() {
+      page_cache_counters& c = get_state().counters;
+      c.hits = 0;
+      c.misses = 0;
+      c.evictions = 0;
+    }
+
+  private:
+    struct state {
+      state() : installed(false) {
+        counters.hits = 0;
+        counters.misses = 0;
+        counters.evictions = 0;
+        counters.pages = 0;
+        counters.arena_bytes = 0;
+      }
+      bool installed;
+      config cfg;
+      sqlite3_pcache_methods2 previous;
+      page_cache_counters counters;
+      std::mutex mutex;
+      std::map<size_t, page_cache_arena::type_ptr> shared_arenas;
+    };
+
+    static state& get_state() {
+      static state instance;
+      return instance;
+    }
+
+    static const sqlite3_pcache_methods2& methods() {
+      static const sqlite3_pcache_methods2 m = {
+        1, nullptr,
+        &x_init, &x_shutdown, &x_create, &x_cachesize, &x_pagecount, &x_fetch,
+        &x_unpin, &x_rekey, &x_truncate, &x_destroy, &x_shrink
+      };
+      return m;
+    }
+
+    static page_cache_instance* instance(sqlite3_pcache* p) {
+      return reinterpret_cast<page_cache_instance*>(p);
+    }
+
+    static int x_init(void*) {
+      return SQLITE_OK;
+    }
+
+    static void x_shutdown(void*) {
+    }
+
+    static sqlite3_pcache* x_create(int page_size, int extra_size, int purgeable) {
+      state& s = get_state();
+      const size_t slot_size = page_cache_instance::slot_size(page_size, extra_size);
+      page_cache_arena::type_ptr arena;
+      if (s.cfg.shared_arena) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        page_cache_arena::type_ptr& shared = s.shared_arenas[slot_size];
+        if (!shared) shared = std::make_shared<page_cache_arena>(slot_size, s.cfg.slots_per_slab, s.counters);
+        arena = shared;
+      } else {
+        arena = std::make_shared<page_cache_arena>(slot_size, s.cfg.slots_per_slab, s.counters);
+      }
+      page_cache_instance* cache = new (std::nothrow) page_cache_instance(arena, page_size, extra_size,
+                                                                          purgeable != 0, s.counters);
+      return reinterpret_cast<sqlite3_pcache*>(cache);
+    }
+
+    static void x_cachesize(sqlite3_pcache* p, int n_max) {
+      instance(p)->cache_size(n_max);
+    }
+
+    static int x_pagecount(sqlite3_pcache* p) {
+      return int(instance(p)->page_count());
+    }
+
+    static sqlite3_pcache_page* x_fetch(sqlite3_pcache* p, unsigned key, int create_flag) {
+      return instance(p)->fetch(key, create_flag);
+    }
+
+    static void x_unpin(sqlite3_pcache* p, sqlite3_pcache_page* page, int discard) {
+      instance(p)->unpin(page, discard != 0);
+    }
+
+    static void x_rekey(sqlite3_pcache* p, sqlite3_pcache_page* page, unsigned old_key, unsigned new_key) {
+      instance(p)->rekey(page, old_key, new_key);
+    }
+
+    static void x_truncate(sqlite3_pcache* p, unsigned limit) {
+      instance(p)->truncate(limit);
+    }
+
+    static void x_destroy(sqlite3_pcache* p) {
+      delete instance(p);
+    }
+
+    static void x_shrink(sqlite3_pcache* p) {
+      instance(p)->shrink();
+    }
+  };
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "database.hpp"
+#include "input_query.hpp"
+#include "logging.hpp"
+#include "result_code_container.hpp"
+
+namespace sqlite {
+
+  struct parallel_scan_config {
+    // Worker threads, each with its own read-only connection
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    // The rowid range is cut into threads * partitions_per_thread pieces that workers take
+    // one at a time, so that a worker stuck on a dense range does not hold up the others
+    unsigned partitions_per_thread = 4;
+    // Rows per column_batch in reduce_batches()
+    size_t batch_size = 4096;
+  };
+
+  // Scan of a rowid table split by rowid range over several read-only connections to the same
+  // database file. Every worker runs
+  //   SELECT <columns> FROM <table> WHERE rowid BETWEEN ? AND ? [AND (<where>)]
+  // for the partitions it takes and folds the rows into its own partial state; the partial states
+  // are combined on the calling thread, in worker order, once all workers are done.
+  // The rowid range is taken from MIN(rowid) and MAX(rowid), so partitions of a table with
+  // clustered rowid gaps are uneven; partitions_per_thread evens out the work.
+  // The connections read independently, so rows written during the scan may or may not be seen.
+  // In-memory databases can not be scanned this way.
+  template <typename record_tuple_t, typename value_access_policy_t>
+  class parallel_scan_base : public result_code_container {
+  public:
+    typedef parallel_scan_base<record_tuple_t, value_access_policy_t> type;
+    typedef parallel_scan_config config;
+    typedef input_query_base<record_tuple_t, value_access_policy_t> query_type;
+    typedef typename query_type::column_batch_type column_batch_type;
+
+    parallel_scan_base(const std::string& filename, const std::string& table_name,
+                       const std::vector<std::string>& columns, const std::string& where = "",
+                       const config& cfg = config()) :
+      result_code_container(),
+      filename_(filename),
+      table_name_(table_name),
+      cfg_(cfg) {
+      query_str_ = "SELECT ";
+      for (size_t i = 0; i < columns.size(); ++i) {
+        if (i > 0) query_str_ += ", ";
+        query_str_ += "`" + columns[i] + "`";
+      }
+      query_str_ += " FROM `" + table_name_ + "` WHERE rowid BETWEEN ? AND ?";
+      if (!where.empty()) query_str_ += " AND (" + where + ")";
+    }
+
+    // Calls on_row(state, row) for every row, with the state of the worker that read it, then
+    // combine(result, partial) for every worker's partial state, starting from init
+    template <typename state_t, typename row_fn_t, typename combine_fn_t>
+    state_t reduce(const state_t& init, row_fn_t on_row, combine_fn_t combine) {
+      return run(init, [&] (query_type& q, state_t& state) {
+          for (const auto& row : q.row_buffer()) on_row(state, row);
+        }, combine);
+    }
+
+    // Same with column batches of up to cfg.batch_size rows: on_batch(state, batch)
+    template <typename state_t, typename batch_fn_t, typename combine_fn_t>
+    state_t reduce_batches(const state_t& init, batch_fn_t on_batch, combine_fn_t combine) {
+      return run(init, [&] (query_type& q, state_t& state) {
+          column_batch_type batch;
+          while (q.fetch_columns(batch, cfg_.batch_size) > 0) on_batch(state, batch);
+        }, combine);
+    }
+
+    // Calls on_row(row) concurrently from all workers
+    template <typename row_fn_t>
+    void for_each(row_fn_t on_row) {
+      struct nothing {};
+      run(nothing(), [&] (query_type& q, nothing&) {
+          for (const auto& row : q.row_buffer()) on_row(row);
+        }, [] (nothing&, const nothing&) {});
+    }
+
+    const std::string& query_string() const {
+      return query_str_;
+    }
+
+  private:
+    std::string filename_;
+    std::string table_name_;
+    std::string query_str_;
+    config cfg_;
+
+    struct partition {
+      int64_t first;
+      int64_t last;
+    };
+
+    // Splits [min, max] rowids into at most n contiguous partitions
+    int partitions(std::vector<partition>& parts, const uint64_t n) {
+      database::type_ptr db(new database(filename_, SQLITE_OPEN_READONLY));
+      if (db->result_code() != SQLITE_OK) return db->result_code();
+      query bounds(db, "SELECT MIN(rowid), MAX(rowid) FROM `" + table_name_ + "`");
+      if (bounds.result_code() != SQLITE_OK) return bounds.result_code();
+      bounds.step();
+      if (bounds.result_code() != SQLITE_ROW) return bounds.result_code();
+      // Empty table
+      if (sqlite3_column_type(bounds.statement().get(), 0) == SQLITE_NULL) return SQLITE_OK;
+      const int64_t mn = bounds.get<int64_t>(0);
+      const int64_t mx = bounds.get<int64_t>(1);
+      // Unsigned arithmetic, as the span of rowids may not fit into int64_t
+      const uint64_t span = uint64_t(mx) - uint64_t(mn);
+      const uint64_t count = span < n - 1 ? span + 1 : n;
+      // span + 1 only overflows for the full int64_t range, where one rowid less does not matter
+      const uint64_t total = span + 1 == 0 ? span : span + 1;
+      uint64_t first = uint64_t(mn);
+      for (uint64_t i = 0; i < count; ++i) {
+        const uint64_t size = total / count + (i < total % count ? 1 : 0);
+        const uint64_t last = (i + 1 == count) ? uint64_t(mx) : first + size - 1;
+        parts.push_back(partition{int64_t(first), int64_t(last)});
+        first = last + 1;
+      }
+      return SQLITE_OK;
+    }
+
+    template <typename state_t, typename scan_fn_t, typename combine_fn_t>
+    state_t run(const state_t& init, scan_fn_t scan, combine_fn_t combine) {
+      std::vector<partition> parts;
+      const unsigned n_threads = std::max(1u, cfg_.threads);
+      result_code_ = partitions(parts, uint64_t(n_threads) * std::max(1u, cfg_.partitions_per_thread));
+      state_t result(init);
+      if (result_code_ != SQLITE_OK) {
+        SQLITE_HPP_LOG("parallel_scan_base::run Failed to find the rowid range of " + table_name_);
+        return result;
+      }
+      // Wrapped, so that std::vector<bool> does not get in the way of a bool state
+      struct partial_state {
+        state_t state;
+      };
+      std::vector<partial_state> partial(n_threads, partial_state{init});
+      std::vector<int> result_codes(n_threads, SQLITE_DONE);
+      std::atomic<size_t> next_partition(0);
+      std::vector<std::thread> workers;
+      for (unsigned t = 0; t < n_threads; ++t) {
+        workers.push_back(std::thread([&, t] () {
+              database::type_ptr db(new database(filename_, SQLITE_OPEN_READONLY));
+              if (db->result_code() != SQLITE_OK) {
+                result_codes[t] = db->result_code();
+                return;
+              }
+              db->install_busy_handler();
+              query_type q(db, query_str_);
+              if (q.result_code() != SQLITE_OK) {
+                result_codes[t] = q.result_code();
+                return;
+              }
+              for (size_t i = next_partition++; i < parts.size(); i = next_partition++) {
+                sqlite3_reset(q.statement().get());
+                q.bind(1, parts[i].first);
+                q.bind(2, parts[i].last);
+                scan(q, partial[t].state);
+                if (q.result_code() != SQLITE_DONE) {
+                  result_codes[t] = q.result_code();
+                  return;
+                }
+              }
+            }));
+      }
+      for (auto& w : workers) w.join();
+      result_code_ = SQLITE_DONE;
+      for (unsigned t = 0; t < n_threads; ++t) {
+        if ((result_code_ == SQLITE_DONE) && (result_codes[t] != SQLITE_DONE)) result_code_ = result_codes[t];
+        combine(result, partial[t].state);
+      }
+      return result;
+    }
+  };
+
+  template <typename... Rs>
+  class parallel_scan : public parallel_scan_base<typename record_type<Rs...>::type, default_value_access_policy> {
+    using parallel_scan_base<typename record_type<Rs...>::type, default_value_access_policy>::parallel_scan_base;
+  };
+}
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "logging.hpp"
+#include "query.hpp"
+#include "spsc_ring.hpp"
+
+namespace sqlite {
+  template <typename record_tuple_t,
+            typename value_access_policy_t>
+  class prefetch_query_base;
+  template <typename record_tuple_t,
+            typename value_access_policy_t>
+  class prefetch_query_iterator;
+
+  struct prefetch_stats {
+    // Rows decoded by the producer thread
+    uint64_t rows;
+    // Times the producer found the ring full and the consumer found it empty, and had to wait
+    uint64_t producer_stalls;
+    uint64_t consumer_stalls;
+  };
+
+  // Single-pass select whose statement is stepped and decoded by a background thread, so that
+  // SQLite's work overlaps with the consumer's. Rows travel through an spsc_ring of `capacity`
+  // records. The producer thread is started by begin() and stopped at the end of the result set
+  // or when the query is destroyed. While it runs the query must only be used through its
+  // iterators, and the connection should not be used by other threads unless SQLite is in
+  // serialized mode. Deadlines and cancellation tokens apply to the producer's steps; set them
+  // before begin().
+  template <typename record_tuple_t,
+            typename value_access_policy_t>
+  class prefetch_query_base : public query_base<value_access_policy_t> {
+    friend class prefetch_query_iterator<record_tuple_t, value_access_policy_t>;
+  public:
+    typedef prefetch_query_base<record_tuple_t, value_access_policy_t> type;
+    typedef prefetch_query_iterator<record_tuple_t, value_access_policy_t> iterator;
+
+    prefetch_query_base(const database::type_ptr& db, const std::string& query_str,
+                        const size_t capacity = 1024) :
+      query_base<value_access_policy_t>(db, query_str),
+      ring_(capacity),
+      started_(false),
+      stop_(false),
+      done_(false),
+      producer_result_code_(SQLITE_OK),
+      rows_(0),
+      producer_stalls_(0),
+      consumer_stalls_(0),
+      waiting_(0) {
+    }
+
+    prefetch_query_base(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    ~prefetch_query_base() {
+      stop();
+    }
+
+    iterator begin() {
+      if (!started_) {
+        started_ = true;
+        if (this->result_code_ == SQLITE_OK) {
+          producer_ = std::thread([this] () { produce(); });
+        } else {
+          done_ = true;
+          producer_result_code_ = this->result_code_;
+        }
+      }
+      iterator it(this, false);
+      ++it;
+      return it;
+    }
+
+    iterator end() {
+      return iterator(this, true);
+    }
+
+    prefetch_stats stats() const {
+      prefetch_stats s;
+      s.rows = rows_.load(std::memory_order_relaxed);
+      s.producer_stalls = producer_stalls_.load(std::memory_order_relaxed);
+      s.consumer_stalls = consumer_stalls_.load(std::memory_order_relaxed);
+      return s;
+    }
+
+  private:
+    // Polls of a full or empty ring before the waiting thread parks on the condition variable
+    static const int spin_limit = 64;
+
+    spsc_ring<record_tuple_t> ring_;
+    std::thread producer_;
+    bool started_;
+    std::atomic<bool> stop_;
+    std::atomic<bool> done_;
+    std::atomic<int> producer_result_code_;
+    std::atomic<uint64_t> rows_;
+    std::atomic<uint64_t> producer_stalls_;
+    std::atomic<uint64_t> consumer_stalls_;
+    // Threads parked in wait_until()
+    std::atomic<int> waiting_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+
+    void stop() {
+      stop_.store(true, std::memory_order_relaxed);
+      wake();
+      if (producer_.joinable()) producer_.join();
+    }
+
+    // Polls ready() a few times, then sleeps until the other thread's wake() makes it true
+    template <typename predicate_t>
+    void wait_until(predicate_t ready, std::atomic<uint64_t>& stalls) {
+      if (ready()) return;
+      stalls.fetch_add(1, std::memory_order_relaxed);
+      for (int i = 0; i < spin_limit; ++i) {
+        std::this_thread::yield();
+        if (ready()) return;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      waiting_.fetch_add(1, std::memory_order_relaxed);
+      // Pairs with the fence in wake(): either ready() sees the other thread's change, or
+      // wake() sees waiting_ and notifies once the wait below has released the mutex
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      cv_.wait(lock, ready);
+      waiting_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Called after every change of the ring, stop_ or done_
+    void wake() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (waiting_.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cv_.notify_all();
+      }
+    }
+
+    // Decodes every row straight into a ring slot, reusing the memory the slot already holds
+    void produce() {
+      int rc = SQLITE_OK;
+      while (!stop_.load(std::memory_order_relaxed)) {
+        rc = this->step_statement();
+        if (rc != SQLITE_ROW) break;
+        record_tuple_t* slot = nullptr;
+        wait_until([this, &slot] () {
+            slot = ring_.write_slot();
+            return (slot != nullptr) || stop_.load(std::memory_order_relaxed);
+          }, producer_stalls_);
+        if (slot == nullptr) break;
+        this->get_record(*slot);
+        ring_.publish();
+        rows_.fetch_add(1, std::memory_order_relaxed);
+        wake();
+      }
+      SQLITE_HPP_LOG("prefetch_query_base::produce Finished with result code " + std::to_string(rc));
+      producer_result_code_.store(rc, std::memory_order_relaxed);
+      // The consumer may stop reading now, but the query is not destroyed before the
+      // destructor has joined this thread
+      done_.store(true, std::memory_order_release);
+      wake();
+    }
+
+    // Swaps the next row into row. Returns false at the end of the result set.
+    bool next(record_tuple_t& row) {
+      record_tuple_t* slot = nullptr;
+      wait_until([this, &slot] () {
+          slot = ring_.read_slot();
+          return (slot != nullptr) || done_.load(std::memory_order_acquire);
+        }, consumer_stalls_);
+      if (slot == nullptr) {
+        // Rows published before done_ was set are visible once it is seen
+        slot = ring_.read_slot();
+        if (slot == nullptr) {
+          this->result_code_ = producer_result_code_.load(std::memory_order_relaxed);
+          return false;
+        }
+      }
+      std::swap(row, *slot);
+      ring_.release();
+      wake();
+      this->result_code_ = SQLITE_ROW;
+      return true;
+    }
+  };
+
+  template <typename record_tuple_t, typename value_access_policy_t>
+  class prefetch_query_iterator {
+  public:
+    typedef prefetch_query_iterator<record_tuple_t, value_access_policy_t> type;
+    typedef prefetch_query_base<record_tuple_t, value_access_policy_t> query_type;
+    typedef std::input_iterator_tag iterator_category;
+    typedef record_tuple_t value_type;
+    typedef record_tuple_t record_tuple_type;
+    typedef ptrdiff_t difference_type;
+    typedef const record_tuple_t* pointer;
+    typedef const record_tuple_t& reference;
+
+    prefetch_query_iterator(query_type* q, bool end) :
+      q_(q),
+      end_(end),
+      pos_(0) {
+    }
+
+    type& operator++() {
+      if (!q_->next(row_)) end_ = true;
+      ++pos_;
+      return *this;
+    }
+
+    bool operator==(const type& other) const {
+      if (end_) {
+        return (q_ == other.q_) && (end_ == other.end_);
+      } else {
+        return (q_ == other.q_) && (end_ == other.end_) && (pos_ == other.pos_);
+      }
+    }
+
+    bool operator!=(const type& other) const {
+      return !(*this == other);
+    }
+
+    // Valid until the iterator is advanced
+    const record_tuple_type& operator*() const {
+      return row_;
+    }
+
+    const record_tuple_type* operator->() const {
+      return &row_;
+    }
+
+  private:
+    query_type* q_;
+    bool end_;
+    size_t pos_;
+    record_tuple_type row_;
+  };
+
+  template <typename... Rs>
+  class prefetch_query : public prefetch_query_base<typename record_type<Rs...>::type, default_value_access_policy> {
+    using prefetch_query_base<typename record_type<Rs...>::type, default_value_access_policy>::prefetch_query_base;
+  };
+}
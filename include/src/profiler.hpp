@@ -0,0 +1,334 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "fingerprint.hpp"
+#include "logging.hpp"
+#include "statement_stats.hpp"
+
+// sqlite3_trace_v2() appeared in 3.14.0. The bundled 3.11.1 amalgamation does not have it.
+#if SQLITE_VERSION_NUMBER >= 3014000
+#define SQLITE_HPP_HAS_TRACE_V2 1
+#endif
+
+#if defined(SQLITE_HPP_HAS_TRACE_V2)
+
+namespace sqlite {
+
+  // Latency histogram with four buckets per power of two (relative error below 25%), updated with
+  // relaxed atomic increments only
+  class latency_histogram {
+  public:
+    typedef latency_histogram type;
+
+    static const size_t bucket_count = 4 * 64;
+
+    latency_histogram() {
+      for (auto& b : buckets_) b.store(0, std::memory_order_relaxed);
+    }
+
+    latency_histogram(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    void record(const uint64_t ns) {
+      buckets_[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Upper bound of the bucket holding the q-quantile (0 < q <= 1), 0 without samples
+    uint64_t quantile(const double q) const {
+      uint64_t counts[bucket_count];
+      uint64_t total = 0;
+      for (size_t i = 0; i < bucket_count; ++i) {
+        counts[i] = buckets_[i].load(std::memory_order_relaxed);
+        total += counts[i];
+      }
+      if (total == 0) return 0;
+      const uint64_t rank = std::max(uint64_t(1), uint64_t(q * double(total) + 0.5));
+      uint64_t seen = 0;
+      for (size_t i = 0; i < bucket_count; ++i) {
+        seen += counts[i];
+        if (seen >= rank) return upper_bound(i);
+      }
+      return upper_bound(bucket_count - 1);
+    }
+
+    void reset() {
+      for (auto& b : buckets_) b.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> buckets_[bucket_count];
+
+    static size_t bucket(const uint64_t ns) {
+      if (ns < 4) return size_t(ns);
+      unsigned e = 63;
+      while ((ns >> e) == 0) --e;
+      // The two bits below the leading one pick the sub-bucket
+      return size_t(4 * (e - 1) + ((ns >> (e - 2)) & 3));
+    }
+
+    static uint64_t upper_bound(const size_t i) {
+      if (i < 4) return uint64_t(i);
+      const unsigned e = unsigned(i / 4) + 1;
+      const uint64_t sub = uint64_t(i % 4);
+      if (e >= 63) return UINT64_MAX;
+      return (uint64_t(1) << e) + ((sub + 1) << (e - 2)) - 1;
+    }
+  };
+
+  // A single run of a statement took more full scan steps than profiler_config::fullscan_alert_steps
+  struct fullscan_alert {
+    std::string fingerprint;
+    // SQL text as prepared, without bound values
+    std::string sql;
+    uint64_t fullscan_steps;
+    uint64_t ns;
+  };
+
+  struct profiler_config {
+    // Collapse statements into fingerprint(), otherwise profile the exact SQL text
+    bool fingerprints = true;
+    // Runs with more full scan steps than this call on_fullscan, 0 disables the alert
+    uint64_t fullscan_alert_steps = 0;
+    // Called from the trace callback on the thread that stepped the statement; must not use the
+    // connection
+    std::function<void(const fullscan_alert&)> on_fullscan;
+  };
+
+  struct statement_profile {
+    std::string fingerprint;
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    // sqlite3_stmt_status() counters summed over all calls
+    statement_stats stats;
+  };
+
+  // Times every statement run on a connection through sqlite3_trace_v2(SQLITE_TRACE_PROFILE) and
+  // keeps a latency histogram per fingerprint, along with the statement_stats counters of the
+  // runs. Installed through database::install_profiler().
+  // The trace callback runs on the thread stepping the statement and only takes a lock the first
+  // time it sees a statement; counters are atomics, so reports can be produced from any thread
+  // while statements run. One profiler per connection.
+  class profiler {
+  public:
+    typedef profiler type;
+    typedef std::shared_ptr<type> type_ptr;
+    typedef profiler_config config;
+
+    profiler() : profiler(config()) {
+    }
+
+    profiler(const config& cfg) :
+      cfg_(cfg) {
+    }
+
+    profiler(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    const config& get_config() const {
+      return cfg_;
+    }
+
+    static int callback(unsigned event, void* p, void* x, void* y) {
+      type* self = static_cast<type*>(p);
+      sqlite3_stmt* stmt = static_cast<sqlite3_stmt*>(x);
+      if (event == SQLITE_TRACE_PROFILE) {
+        self->profile(stmt, *static_cast<const sqlite3_int64*>(y));
+      } else if (event == SQLITE_TRACE_CLOSE) {
+        self->statements_.clear();
+      }
+      return 0;
+    }
+
+    static unsigned mask() {
+      return SQLITE_TRACE_PROFILE | SQLITE_TRACE_CLOSE;
+    }
+
+    // Statements with the largest total time first
+    std::vector<statement_profile> top_by_total(const size_t n) const {
+      return top(n, [] (const statement_profile& a, const statement_profile& b) { return a.total_ns > b.total_ns; });
+    }
+
+    // Statements with the largest 99th percentile latency first
+    std::vector<statement_profile> top_by_p99(const size_t n) const {
+      return top(n, [] (const statement_profile& a, const statement_profile& b) { return a.p99_ns > b.p99_ns; });
+    }
+
+    // Statements with the most full scan steps first
+    std::vector<statement_profile> top_by_fullscan(const size_t n) const {
+      return top(n, [] (const statement_profile& a, const statement_profile& b) {
+          return a.stats.fullscan_steps > b.stats.fullscan_steps;
+        });
+    }
+
+    // Text table of the top n statements by total time and by p99 latency
+    std::string report(const size_t n = 10) const {
+      std::string out;
+      append_table(out, "Top statements by total time", top_by_total(n));
+      append_table(out, "Top statements by p99 latency", top_by_p99(n));
+      return out;
+    }
+
+    // Zeroes the counters; fingerprints seen so far are kept
+    void reset() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto& e : entries_) {
+        e.calls.store(0, std::memory_order_relaxed);
+        e.total_ns.store(0, std::memory_order_relaxed);
+        e.max_ns.store(0, std::memory_order_relaxed);
+        e.histogram.reset();
+        for (auto& c : e.counters) c.store(0, std::memory_order_relaxed);
+      }
+    }
+
+  private:
+    struct entry {
+      std::string fingerprint;
+      std::atomic<uint64_t> calls;
+      std::atomic<uint64_t> total_ns;
+      std::atomic<uint64_t> max_ns;
+      latency_histogram histogram;
+      // statement_stats fields in declaration order
+      std::atomic<uint64_t> counters[6];
+
+      explicit entry(const std::string& f) :
+        fingerprint(f),
+        calls(0),
+        total_ns(0),
+        max_ns(0) {
+        for (auto& c : counters) c.store(0, std::memory_order_relaxed);
+      }
+
+      void record(const uint64_t ns, const statement_stats& d) {
+        calls.fetch_add(1, std::memory_order_relaxed);
+        total_ns.fetch_add(ns, std::memory_order_relaxed);
+        // Only the connection's thread writes
+        if (ns > max_ns.load(std::memory_order_relaxed)) max_ns.store(ns, std::memory_order_relaxed);
+        histogram.record(ns);
+        const uint64_t values[6] = {d.fullscan_steps, d.sorts, d.autoindex_rows, d.vm_steps, d.reprepares, d.runs};
+        for (size_t i = 0; i < 6; ++i) {
+          if (values[i] != 0) counters[i].fetch_add(values[i], std::memory_order_relaxed);
+        }
+      }
+
+      statement_stats stats() const {
+        return statement_stats{counters[0].load(std::memory_order_relaxed), counters[1].load(std::memory_order_relaxed),
+            counters[2].load(std::memory_order_relaxed), counters[3].load(std::memory_order_relaxed),
+            counters[4].load(std::memory_order_relaxed), counters[5].load(std::memory_order_relaxed)};
+      }
+    };
+
+    // What the trace callback remembers of a statement it has seen
+    struct seen_statement {
+      std::string text;
+      entry* e;
+      // Counters at the end of the previous run; stmt_status counters are never reset here so
+      // that query_base::stats() keeps its values
+      statement_stats last;
+    };
+
+    config cfg_;
+    // Guards the addition of entries; entries never move or go away
+    mutable std::mutex mutex_;
+    std::deque<entry> entries_;
+    std::unordered_map<std::string, entry*> by_fingerprint_;
+    // Statements seen, used by the trace callback only
+    std::unordered_map<sqlite3_stmt*, seen_statement> statements_;
+
+    void profile(sqlite3_stmt* stmt, const sqlite3_int64 elapsed) {
+      const uint64_t ns = elapsed > 0 ? uint64_t(elapsed) : 0;
+      seen_statement& seen = statement(stmt);
+      const statement_stats now = statement_stats::read(stmt);
+      const statement_stats d = now.since(seen.last);
+      seen.last = now;
+      seen.e->record(ns, d);
+      if ((cfg_.fullscan_alert_steps != 0) && (d.fullscan_steps > cfg_.fullscan_alert_steps) && cfg_.on_fullscan) {
+        SQLITE_HPP_LOG("profiler::profile Full scan alert for " + seen.e->fingerprint);
+        cfg_.on_fullscan(fullscan_alert{seen.e->fingerprint, seen.text, d.fullscan_steps, ns});
+      }
+    }
+
+    seen_statement& statement(sqlite3_stmt* stmt) {
+      const char* sql = sqlite3_sql(stmt);
+      if (sql == nullptr) sql = "";
+      auto found = statements_.find(stmt);
+      // Comparing the text tells a finalized statement from a new one at the same address
+      if ((found != statements_.end()) && (found->second.text == sql)) return found->second;
+      const std::string text(sql);
+      // Finalized statements are never reported, so forget all of them now and then. Live
+      // statements forgotten this way count their earlier runs' counters once more.
+      if (statements_.size() >= 4096) statements_.clear();
+      const std::string key = cfg_.fingerprints ? fingerprint(text) : text;
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto known = by_fingerprint_.find(key);
+      entry* e = nullptr;
+      if (known != by_fingerprint_.end()) {
+        e = known->second;
+      } else {
+        entries_.emplace_back(key);
+        e = &entries_.back();
+        by_fingerprint_[key] = e;
+      }
+      seen_statement& seen = statements_[stmt];
+      seen.text = text;
+      seen.e = e;
+      // A statement at a reused address starts with fresh counters
+      seen.last = statement_stats{0, 0, 0, 0, 0, 0};
+      return seen;
+    }
+
+    template <typename compare_t>
+    std::vector<statement_profile> top(const size_t n, compare_t compare) const {
+      std::vector<statement_profile> profiles;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& e : entries_) {
+          statement_profile p;
+          p.fingerprint = e.fingerprint;
+          p.calls = e.calls.load(std::memory_order_relaxed);
+          if (p.calls == 0) continue;
+          p.total_ns = e.total_ns.load(std::memory_order_relaxed);
+          p.max_ns = e.max_ns.load(std::memory_order_relaxed);
+          p.p50_ns = e.histogram.quantile(0.5);
+          p.p99_ns = e.histogram.quantile(0.99);
+          p.stats = e.stats();
+          profiles.push_back(p);
+        }
+      }
+      std::sort(profiles.begin(), profiles.end(), compare);
+      if (profiles.size() > n) profiles.resize(n);
+      return profiles;
+    }
+
+    static void append_table(std::string& out, const std::string& title, const std::vector<statement_profile>& profiles) {
+      char line[160];
+      out += title + "\n";
+      std::snprintf(line, sizeof(line), "%10s %12s %12s %12s %12s %12s %8s  %s\n", "calls", "total ms", "p50 us",
+                    "p99 us", "max us", "scan steps", "sorts", "statement");
+      out += line;
+      for (const auto& p : profiles) {
+        std::snprintf(line, sizeof(line), "%10llu %12.3f %12.1f %12.1f %12.1f %12llu %8llu  ", (unsigned long long)p.calls,
+                      double(p.total_ns) / 1e6, double(p.p50_ns) / 1e3, double(p.p99_ns) / 1e3, double(p.max_ns) / 1e3,
+                      (unsigned long long)p.stats.fullscan_steps, (unsigned long long)p.stats.sorts);
+        out += line + p.fingerprint + "\n";
+      }
+    }
+  };
+}
+
+#endif
@@ -4,6 +4,10 @@
 
 #include <memory>
 
+#include "cancellation.hpp"
+#include "memory.hpp"
+#include "record_mapping.hpp"
+#include "statement_stats.hpp"
 #include "tuple_utils.hpp"
 #include "value_access_policy.hpp"
 
@@ -32,14 +36,16 @@ namespace sqlite {
       result_code_container(other),
       query_str_(other.query_str_),
       stmt_(other.stmt_),
-      db_(other.db_) {
+      db_(other.db_),
+      limits_(other.limits_) {
     }
 
     query_base(type&& other) :
       result_code_container(other),
       query_str_(std::move(other.query_str_)),
       stmt_(std::move(other.stmt_)),
-      db_(std::move(other.db_)) {
+      db_(std::move(other.db_)),
+      limits_(std::move(other.limits_)) {
     }
 
     void swap(type& other) {
@@ -47,6 +53,7 @@ namespace sqlite {
       std::swap(query_str_, other.query_str_);
       std::swap(stmt_, other.stmt_);
       std::swap(db_, other.db_);
+      std::swap(limits_, other.limits_);
     }
 
     type& operator=(const type& other) {
@@ -59,12 +66,29 @@ namespace sqlite {
       return stmt_;
     }
 
+    // SQL text of the statement, e.g. the last batch prepared by the buffered queries
+    const std::string& query_string() const {
+      return query_str_;
+    }
+
+    // Runtime counters of the prepared statement, zeroed afterwards if reset is set
+    statement_stats stats(const bool reset = false) const {
+      return statement_stats::read(stmt_.get(), reset);
+    }
+
     template <typename T>
     void bind(const int i, const T& value) {
       typedef typename value_access_policy_t::template local_type<T> value_policy;
       result_code_ = value_policy::bind(stmt_.get(), i, value);
     }
     
+    // Binds without copying, see value_access_policy. Types without bind_static() are bound as usual.
+    template <typename T>
+    void bind_static(const int i, const T& value) {
+      typedef typename value_access_policy_t::template local_type<T> value_policy;
+      result_code_ = bind_static_<value_policy>(stmt_.get(), i, value, 0);
+    }
+
     template <std::size_t I = 0, typename... Tp>
     typename std::enable_if<I == sizeof...(Tp), void>::type bind_tuple(const int i, const std::tuple<Tp...>& t) {
     }
@@ -75,9 +99,43 @@ namespace sqlite {
       bind_tuple<I + 1, Tp...>(i+ 1, t);
     }
 
+    template <std::size_t I = 0, typename... Tp>
+    typename std::enable_if<I == sizeof...(Tp), void>::type bind_tuple_static(const int i, const std::tuple<Tp...>& t) {
+    }
+
+    template <std::size_t I = 0, typename... Tp>
+    typename std::enable_if <I < sizeof...(Tp), void>::type bind_tuple_static(const int i, const std::tuple<Tp...>& t) {
+      bind_static(i, std::get<I>(t));
+      bind_tuple_static<I + 1, Tp...>(i+ 1, t);
+    }
+
+    // Binds a record, a tuple or a struct with a record_mapping, to consecutive parameters starting at i
+    template <typename... Tp>
+    void bind_record(const int i, const std::tuple<Tp...>& t) {
+      bind_tuple(i, t);
+    }
+
+    template <typename record_t>
+    typename std::enable_if<record_mapping<record_t>::is_mapped, void>::type
+    bind_record(const int i, const record_t& r) {
+      bind_fields_<false>(i, r, typename ct_iota_0<record_size<record_t>::value>::type());
+    }
+
+    template <typename... Tp>
+    void bind_record_static(const int i, const std::tuple<Tp...>& t) {
+      bind_tuple_static(i, t);
+    }
+
+    template <typename record_t>
+    typename std::enable_if<record_mapping<record_t>::is_mapped, void>::type
+    bind_record_static(const int i, const record_t& r) {
+      bind_fields_<true>(i, r, typename ct_iota_0<record_size<record_t>::value>::type());
+    }
+
     template <typename T>
     T get(const int i) {
       typedef typename value_access_policy_t::template local_type<T> value_policy;
+      memory::scope scope(memory_category::decoded_values);
       const int ct = ::sqlite3_column_type(stmt_.get(), i);
       if (ct == SQLITE_NULL) {
         return value_policy::null_value();
@@ -91,29 +149,81 @@ namespace sqlite {
       value = get<T>(i);
     }
 
-    template <std::size_t I = 0, typename tuple_t>
-    typename std::enable_if<0 == std::tuple_size<tuple_t>::value, tuple_t>::type
-    get_tuple_() {
-      return std::tuple<>();
-    }
-
-    template <std::size_t I = 0, typename tuple_t>
-    typename std::enable_if<0 != std::tuple_size<tuple_t>::value, tuple_t>::type 
-    get_tuple_() {
-      typedef typename std::tuple_element<0, tuple_t>::type A;
-      A value;
-      get(I, value);
-      return std::tuple_cat(std::tuple<A>(value), get_tuple_<I+1, typename tuple_tail_type<tuple_t>::type>());
+    // Like get(i, value), but reuses the memory already held by value where the type allows it
+    template <typename T>
+    void get_into(const int i, T& value) {
+      typedef typename value_access_policy_t::template local_type<T> value_policy;
+      memory::scope scope(memory_category::decoded_values);
+      const int ct = ::sqlite3_column_type(stmt_.get(), i);
+      if (ct == SQLITE_NULL) {
+        null_into_<value_policy>(value, 0);
+      } else {
+        get_column_into_<value_policy>(stmt_.get(), i, value, 0);
+      }
     }
 
     template <typename tuple_t>
     tuple_t get_tuple(tuple_t* dummy_tuple_ptr) {
-      typedef tuple_t tuple_type;
-      return get_tuple_<0, tuple_type>();
+      return get_tuple_<tuple_t>(typename ct_iota_0<std::tuple_size<tuple_t>::value>::type());
+    }
+
+    // Decodes the current row into an existing tuple, reusing the memory of its elements
+    template <typename... Tp>
+    void get_tuple(std::tuple<Tp...>& t) {
+      get_tuple_into_(t, typename ct_iota_0<sizeof...(Tp)>::type());
+    }
+
+    // Decodes the current row into a record, a tuple or a struct with a record_mapping
+    template <typename... Tp>
+    std::tuple<Tp...> get_record(std::tuple<Tp...>* dummy_record_ptr) {
+      return get_tuple(dummy_record_ptr);
+    }
+
+    template <typename record_t>
+    typename std::enable_if<record_mapping<record_t>::is_mapped, record_t>::type
+    get_record(record_t*) {
+      record_t r;
+      get_record(r);
+      return r;
+    }
+
+    template <typename... Tp>
+    void get_record(std::tuple<Tp...>& t) {
+      get_tuple(t);
+    }
+
+    template <typename record_t>
+    typename std::enable_if<record_mapping<record_t>::is_mapped, void>::type
+    get_record(record_t& r) {
+      get_fields_(r, typename ct_iota_0<record_size<record_t>::value>::type());
     }
 
     void step() {
-      result_code_ = sqlite3_step(stmt_.get());
+      result_code_ = step_statement();
+    }
+
+    // Steps after the deadline fail with SQLITE_INTERRUPT, and so does a step running when
+    // the deadline passes. The statement has to be reset before it is run again.
+    void set_deadline(const execution_limits::clock::time_point& deadline) {
+      limits_.deadline = deadline;
+      if (limits_.active()) db_->progress();
+    }
+
+    // Deadline timeout from now
+    template <typename rep_t, typename period_t>
+    void set_timeout(const std::chrono::duration<rep_t, period_t>& timeout) {
+      set_deadline(execution_limits::clock::now() +
+                   std::chrono::duration_cast<execution_limits::clock::duration>(timeout));
+    }
+
+    // Steps fail with SQLITE_INTERRUPT once the token is cancelled
+    void set_cancellation(const cancellation_token::type_ptr& token) {
+      limits_.token = token;
+      if (limits_.active()) db_->progress();
+    }
+
+    const execution_limits& limits() const {
+      return limits_;
     }
 
     void prepare(const std::string& query_str) {
@@ -121,13 +231,95 @@ namespace sqlite {
       prepare();
     }
   protected:
+    // sqlite3_step() under the deadline and cancellation token of the query. Leaves result_code_
+    // alone, so that a background thread can step the statement (see prefetch_query).
+    int step_statement() {
+      if (!limits_.active()) return sqlite3_step(stmt_.get());
+      if (limits_.exceeded()) {
+        SQLITE_HPP_LOG("query_base::step Deadline passed or cancelled");
+        return SQLITE_INTERRUPT;
+      }
+      ::sqlite3* db = db_->db().get();
+      progress_monitor::scope scope(db_->progress(), limits_);
+      if (limits_.token) limits_.token->enter(db);
+      int rc = sqlite3_step(stmt_.get());
+      if (limits_.token) limits_.token->leave(db);
+      // Statements from the legacy sqlite3_prepare() report the interruption as SQLITE_ERROR
+      if ((rc == SQLITE_ERROR) && limits_.exceeded()) rc = SQLITE_INTERRUPT;
+      return rc;
+    }
+
+    // Each element is constructed in place from its column, without intermediate tuples
+    template <typename tuple_t, size_t... indices>
+    tuple_t get_tuple_(ct_integer_list<indices...>) {
+      tuple_t t{get<typename std::tuple_element<indices, tuple_t>::type>(indices)...};
+      return t;
+    }
+
+    template <typename tuple_t, size_t... indices>
+    void get_tuple_into_(tuple_t& t, ct_integer_list<indices...>) {
+      const int expand[] = {0, (get_into(indices, std::get<indices>(t)), 0)...};
+      (void)expand;
+    }
+
+    template <typename record_t, size_t... indices>
+    void get_fields_(record_t& r, ct_integer_list<indices...>) {
+      typedef typename record_mapping<record_t>::fields_type fields;
+      const int expand[] = {0, (get_into(indices, std::tuple_element<indices, fields>::type::get(r)), 0)...};
+      (void)expand;
+    }
+
+    template <bool static_binding, typename record_t, size_t... indices>
+    void bind_fields_(const int i, const record_t& r, ct_integer_list<indices...>) {
+      typedef typename record_mapping<record_t>::fields_type fields;
+      const int expand[] = {0, (static_binding ?
+                                bind_static(i + int(indices), std::tuple_element<indices, fields>::type::get(r)) :
+                                bind(i + int(indices), std::tuple_element<indices, fields>::type::get(r)), 0)...};
+      (void)expand;
+    }
+
+    template <typename value_policy, typename T>
+    static auto bind_static_(sqlite3_stmt* stmt, const int i, const T& value, int)
+      -> decltype(value_policy::bind_static(stmt, i, value)) {
+      return value_policy::bind_static(stmt, i, value);
+    }
+
+    template <typename value_policy, typename T>
+    static int bind_static_(sqlite3_stmt* stmt, const int i, const T& value, long) {
+      return value_policy::bind(stmt, i, value);
+    }
+
+    template <typename value_policy, typename T>
+    static auto get_column_into_(sqlite3_stmt* stmt, const int i, T& value, int)
+      -> decltype(value_policy::get_column_into(stmt, i, value)) {
+      value_policy::get_column_into(stmt, i, value);
+    }
+
+    template <typename value_policy, typename T>
+    static void get_column_into_(sqlite3_stmt* stmt, const int i, T& value, long) {
+      value = value_policy::get_column_from_stmt(stmt, i);
+    }
+
+    template <typename value_policy, typename T>
+    static auto null_into_(T& value, int) -> decltype(value_policy::null_into(value)) {
+      value_policy::null_into(value);
+    }
+
+    template <typename value_policy, typename T>
+    static void null_into_(T& value, long) {
+      value = value_policy::null_value();
+    }
+
     database::type_ptr db_;
     std::string query_str_;
     std::shared_ptr<sqlite3_stmt> stmt_;    
+    execution_limits limits_;
+
 
     void prepare() {
       ::sqlite3_stmt* stmt;
       if (db_->db().get() != nullptr) {
+        memory::scope scope(memory_category::statements);
         result_code_ = sqlite3_prepare(db_->db().get(), query_str_.c_str(),
                                        query_str_.length() + 1, &stmt, nullptr);
         if (result_code_ == SQLITE_OK) {
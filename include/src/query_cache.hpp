@@ -0,0 +1,398 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <tuple>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "change_detector.hpp"
+#include "change_hooks.hpp"
+#include "ct_integer_list.hpp"
+#include "database.hpp"
+#include "key_codec.hpp"
+#include "logging.hpp"
+#include "query.hpp"
+
+namespace sqlite {
+
+  struct query_cache_config {
+    // Upper bound of the estimated memory held by cached rows; least recently used results
+    // are evicted to stay below it
+    size_t max_bytes = size_t(64) << 20;
+  };
+
+  struct query_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    // Lookups inside a transaction, which neither use nor fill the cache
+    uint64_t bypasses;
+    // Results dropped because a table they read changed
+    uint64_t invalidations;
+    // Results dropped to stay below max_bytes
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;
+  };
+
+  // Results of cached_query selects on one connection, keyed by record type, SQL text and bound
+  // values. A result is dropped when a table it reads changes through this connection, as seen
+  // by the update hook (database::hooks()). Changes the hook does not see, including commits of
+  // other connections, drop everything (see change_detector).
+  // The cache is only used in autocommit mode, so results never contain uncommitted rows and
+  // rollbacks need no special treatment. Schema changes through this connection (DROP, ALTER)
+  // are not detected; call clear() after them.
+  // Use from the thread that uses the connection; get_stats() may be called from anywhere.
+  class query_cache : public change_listener {
+  public:
+    typedef query_cache type;
+    typedef std::shared_ptr<type> type_ptr;
+    typedef query_cache_config config;
+    typedef query_cache_stats stats;
+
+    query_cache(const database::type_ptr& db, const config& cfg = config()) :
+      db_(db),
+      cfg_(cfg),
+      changes_(db),
+      bytes_(0),
+      hits_(0),
+      misses_(0),
+      bypasses_(0),
+      invalidations_(0),
+      evictions_(0) {
+      db_->hooks().add(this);
+    }
+
+    query_cache(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    ~query_cache() {
+      db_->hooks().remove(this);
+    }
+
+    const database::type_ptr& db() const {
+      return db_;
+    }
+
+    // Rows stored under key, or nullptr
+    std::shared_ptr<const void> find(const std::string& key) {
+      if (!usable()) return nullptr;
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto found = entries_.find(key);
+      if (found == entries_.end()) {
+        ++misses_;
+        return nullptr;
+      }
+      ++hits_;
+      lru_.splice(lru_.begin(), lru_, found->second);
+      return found->second->rows;
+    }
+
+    // Stores rows read from tables under key; bytes is their estimated size
+    void insert(const std::string& key, const std::set<std::string>& tables,
+                const std::shared_ptr<const void>& rows, const size_t bytes) {
+      ::sqlite3* db = db_->db().get();
+      if ((bytes > cfg_.max_bytes) || (db == nullptr) || !sqlite3_get_autocommit(db)) return;
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto found = entries_.find(key);
+      if (found != entries_.end()) erase(found->second);
+      while ((bytes_ + bytes > cfg_.max_bytes) && !lru_.empty()) {
+        erase(std::prev(lru_.end()));
+        ++evictions_;
+      }
+      lru_.push_front(entry{key, tables, rows, bytes});
+      entries_[key] = lru_.begin();
+      for (const auto& t : tables) by_table_[t].insert(key);
+      bytes_ += bytes;
+    }
+
+    // Drops the results that read the table
+    void invalidate(const std::string& table) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      invalidate_table(table);
+    }
+
+    void clear() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      invalidations_ += entries_.size();
+      clear_entries();
+    }
+
+    stats get_stats() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stats s;
+      s.hits = hits_;
+      s.misses = misses_;
+      s.bypasses = bypasses_;
+      s.invalidations = invalidations_;
+      s.evictions = evictions_;
+      s.entries = entries_.size();
+      s.bytes = bytes_;
+      return s;
+    }
+
+    void reset_stats() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      hits_ = 0;
+      misses_ = 0;
+      bypasses_ = 0;
+      invalidations_ = 0;
+      evictions_ = 0;
+    }
+
+    void on_update(const int, const char*, const char* table, const int64_t) override {
+      changes_.observed();
+      std::lock_guard<std::mutex> lock(mutex_);
+      invalidate_table(table);
+    }
+
+  private:
+    struct entry {
+      std::string key;
+      std::set<std::string> tables;
+      std::shared_ptr<const void> rows;
+      size_t bytes;
+    };
+    typedef std::list<entry>::iterator entry_iterator;
+
+    database::type_ptr db_;
+    config cfg_;
+    change_detector changes_;
+    mutable std::mutex mutex_;
+    // Most recently used first
+    std::list<entry> lru_;
+    std::unordered_map<std::string, entry_iterator> entries_;
+    std::unordered_map<std::string, std::set<std::string>> by_table_;
+    size_t bytes_;
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t bypasses_;
+    uint64_t invalidations_;
+    uint64_t evictions_;
+
+    // Brings the cache up to date with changes the update hook did not see. False inside
+    // transactions, where results may differ from the committed state.
+    bool usable() {
+      ::sqlite3* db = db_->db().get();
+      if (db == nullptr) return false;
+      if (!sqlite3_get_autocommit(db)) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++bypasses_;
+        return false;
+      }
+      const bool unobserved = changes_.unobserved_changes();
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (unobserved) {
+        if (!entries_.empty()) {
+          SQLITE_HPP_LOG("query_cache::usable Unobserved changes, clearing");
+        }
+        invalidations_ += entries_.size();
+        clear_entries();
+      }
+      return true;
+    }
+
+    void erase(const entry_iterator it) {
+      for (const auto& t : it->tables) {
+        auto keys = by_table_.find(t);
+        if (keys == by_table_.end()) continue;
+        keys->second.erase(it->key);
+        if (keys->second.empty()) by_table_.erase(keys);
+      }
+      bytes_ -= it->bytes;
+      entries_.erase(it->key);
+      lru_.erase(it);
+    }
+
+    void invalidate_table(const std::string& table) {
+      auto keys = by_table_.find(table);
+      if (keys == by_table_.end()) return;
+      // Copied, erase() modifies the set
+      const std::set<std::string> dropped(keys->second);
+      for (const auto& k : dropped) {
+        auto found = entries_.find(k);
+        if (found == entries_.end()) continue;
+        erase(found->second);
+        ++invalidations_;
+      }
+    }
+
+    void clear_entries() {
+      lru_.clear();
+      entries_.clear();
+      by_table_.clear();
+      bytes_ = 0;
+    }
+  };
+
+  namespace detail {
+    // Estimated memory held by a value outside of the value itself
+    inline size_t heap_bytes(const std::string& s) {
+      return s.capacity();
+    }
+
+    template <typename T>
+    size_t heap_bytes(const std::vector<T>& v) {
+      return v.capacity() * sizeof(T);
+    }
+
+    template <typename T>
+    size_t heap_bytes(const T&) {
+      return 0;
+    }
+
+    template <typename... Tp, size_t... indices>
+    size_t record_heap_bytes(const std::tuple<Tp...>& r, ct_integer_list<indices...>) {
+      size_t n = 0;
+      const int expand[] = {0, (n += heap_bytes(std::get<indices>(r)), 0)...};
+      (void)expand;
+      return n;
+    }
+
+    template <typename... Tp>
+    size_t record_heap_bytes(const std::tuple<Tp...>& r) {
+      return record_heap_bytes(r, typename ct_iota_0<sizeof...(Tp)>::type());
+    }
+
+    template <typename record_t, size_t... indices>
+    size_t record_heap_bytes(const record_t& r, ct_integer_list<indices...>) {
+      typedef typename record_mapping<record_t>::fields_type fields;
+      size_t n = 0;
+      const int expand[] = {0, (n += heap_bytes(std::tuple_element<indices, fields>::type::get(r)), 0)...};
+      (void)expand;
+      return n;
+    }
+
+    template <typename record_t>
+    typename std::enable_if<record_mapping<record_t>::is_mapped, size_t>::type
+    record_heap_bytes(const record_t& r) {
+      return record_heap_bytes(r, typename ct_iota_0<record_size<record_t>::value>::type());
+    }
+  }
+
+  // Select whose results go through a query_cache. Values are bound with bind(), the only binding
+  // function available since it also records the cache key, and must have a key_codec (integers,
+  // double, std::string, blobs); rows() then returns the result for the current bindings, from the
+  // cache when possible. The returned rows are shared and immutable,
+  // stored in one vector per result.
+  // The tables the select reads are found once, from the cursors its EXPLAIN program opens
+  // (an authorizer would expire every statement prepared on the connection).
+  template <typename record_tuple_t, typename value_access_policy_t>
+  class cached_query_base : public query_base<value_access_policy_t> {
+  public:
+    typedef cached_query_base<record_tuple_t, value_access_policy_t> type;
+    typedef record_tuple_t record_tuple_type;
+    typedef std::vector<record_tuple_t> rows_type;
+    typedef std::shared_ptr<const rows_type> rows_ptr;
+
+    cached_query_base(const query_cache::type_ptr& cache, const std::string& query_str) :
+      query_base<value_access_policy_t>(cache->db(), query_str),
+      cache_(cache) {
+      if (this->result_code_ == SQLITE_OK) find_tables();
+      params_.resize(this->stmt_ ? sqlite3_bind_parameter_count(this->stmt_.get()) : 0);
+    }
+
+    template <typename T>
+    void bind(const int i, const T& value) {
+      if ((i >= 1) && (size_t(i) <= params_.size())) {
+        params_[i - 1].clear();
+        key_codec<T>::encode(params_[i - 1], value);
+      }
+      query_base<value_access_policy_t>::bind(i, value);
+    }
+
+    // The result for the current bindings; nullptr on errors (see result_code())
+    rows_ptr rows() {
+      if (!this->stmt_) return nullptr;
+      const std::string key = cache_key();
+      std::shared_ptr<const void> cached = cache_->find(key);
+      if (cached) {
+        this->result_code_ = SQLITE_DONE;
+        return std::static_pointer_cast<const rows_type>(cached);
+      }
+      std::shared_ptr<rows_type> rows = std::make_shared<rows_type>();
+      size_t bytes = 0;
+      for (;;) {
+        this->step();
+        if (this->result_code_ != SQLITE_ROW) break;
+        rows->emplace_back();
+        this->get_record(rows->back());
+        bytes += detail::record_heap_bytes(rows->back());
+      }
+      sqlite3_reset(this->stmt_.get());
+      if (this->result_code_ != SQLITE_DONE) return nullptr;
+      rows->shrink_to_fit();
+      bytes += rows->capacity() * sizeof(record_tuple_t) + key.size();
+      cache_->insert(key, tables_, rows, bytes);
+      return rows;
+    }
+
+    // Tables read by the select
+    const std::set<std::string>& tables() const {
+      return tables_;
+    }
+
+  private:
+    // These bind without updating params_, so rows() would return the result of stale bindings
+    using query_base<value_access_policy_t>::bind_static;
+    using query_base<value_access_policy_t>::bind_tuple;
+    using query_base<value_access_policy_t>::bind_tuple_static;
+    using query_base<value_access_policy_t>::bind_record;
+    using query_base<value_access_policy_t>::bind_record_static;
+
+    query_cache::type_ptr cache_;
+    std::set<std::string> tables_;
+    // Encoded value of each parameter
+    std::vector<std::string> params_;
+
+    // Maps the root pages of the b-trees opened for reading to the tables they belong to
+    void find_tables() {
+      query explain(this->db_, "EXPLAIN " + this->query_str_);
+      std::set<std::pair<int, int64_t>> roots;
+      for (explain.step(); explain.result_code() == SQLITE_ROW; explain.step()) {
+        // Columns are addr, opcode, p1, p2 (root page), p3 (schema index), ...
+        if (explain.get<std::string>(1) == "OpenRead") {
+          roots.insert(std::make_pair(explain.get<int>(4), explain.get<int64_t>(3)));
+        }
+      }
+      std::map<int, std::string> schemas;
+      query database_list(this->db_, "PRAGMA database_list");
+      for (database_list.step(); database_list.result_code() == SQLITE_ROW; database_list.step()) {
+        schemas[database_list.get<int>(0)] = database_list.get<std::string>(1);
+      }
+      for (const auto& root : roots) {
+        auto schema = schemas.find(root.first);
+        if (schema == schemas.end()) continue;
+        query table(this->db_, "SELECT `tbl_name` FROM `" + schema->second + "`.sqlite_master WHERE `rootpage` = ?");
+        table.bind(1, root.second);
+        table.step();
+        if (table.result_code() == SQLITE_ROW) tables_.insert(table.get<std::string>(0));
+      }
+    }
+
+    std::string cache_key() const {
+      std::string key(typeid(record_tuple_t).name());
+      key += '\n' + this->query_str_ + '\n';
+      for (const auto& p : params_) {
+        // Unbound parameters are NULL
+        key += p.empty() ? "n;" : p;
+      }
+      return key;
+    }
+  };
+
+  template <typename... Rs>
+  class cached_query : public cached_query_base<typename record_type<Rs...>::type, default_value_access_policy> {
+    using cached_query_base<typename record_type<Rs...>::type, default_value_access_policy>::cached_query_base;
+  };
+}
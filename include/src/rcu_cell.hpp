@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace sqlite {
+
+  // Holds a pointer to an immutable T that readers use without locks while writers replace it
+  // (read-copy-update). A reader registers itself in the counter of the current epoch for as long
+  // as it holds a read_guard; a writer publishes the new value, then flips the epoch twice, each
+  // time waiting for the readers of the previous epoch to leave, before freeing the old value.
+  // Readers never wait; writers wait for the readers that may still see the old value.
+  // Guards should be short-lived and must not be held by a thread that updates the cell.
+  template <typename T>
+  class rcu_cell {
+  public:
+    typedef rcu_cell<T> type;
+    typedef T value_type;
+
+    class read_guard {
+    public:
+      read_guard(const type& cell) :
+        cell_(&cell),
+        epoch_(cell.epoch_.load(std::memory_order_seq_cst) & 1) {
+        cell_->readers_[epoch_].count.fetch_add(1, std::memory_order_seq_cst);
+        value_ = cell_->value_.load(std::memory_order_seq_cst);
+      }
+
+      read_guard(read_guard&& other) :
+        cell_(other.cell_),
+        epoch_(other.epoch_),
+        value_(other.value_) {
+        other.cell_ = nullptr;
+      }
+
+      read_guard(const read_guard&) = delete;
+      read_guard& operator=(const read_guard&) = delete;
+
+      ~read_guard() {
+        if (cell_ != nullptr) cell_->readers_[epoch_].count.fetch_sub(1, std::memory_order_release);
+      }
+
+      const T& operator*() const {
+        return *value_;
+      }
+
+      const T* operator->() const {
+        return value_;
+      }
+
+    private:
+      const type* cell_;
+      unsigned epoch_;
+      const T* value_;
+    };
+
+    explicit rcu_cell(std::unique_ptr<T> value) :
+      value_(value.release()),
+      epoch_(0) {
+      readers_[0].count = 0;
+      readers_[1].count = 0;
+    }
+
+    rcu_cell(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    ~rcu_cell() {
+      delete value_.load();
+    }
+
+    read_guard read() const {
+      return read_guard(*this);
+    }
+
+    // Publishes value and frees the previous one once no reader can see it
+    void update(std::unique_ptr<T> value) {
+      std::lock_guard<std::mutex> lock(writer_mutex_);
+      const T* old = value_.exchange(value.release(), std::memory_order_seq_cst);
+      for (int i = 0; i < 2; ++i) {
+        const unsigned previous = epoch_.fetch_add(1, std::memory_order_seq_cst) & 1;
+        while (readers_[previous].count.load(std::memory_order_acquire) != 0) std::this_thread::yield();
+      }
+      delete old;
+    }
+
+  private:
+    // On separate cache lines, so that the readers of one epoch do not slow down the other
+    struct alignas(64) reader_count {
+      std::atomic<uint64_t> count;
+    };
+
+    std::atomic<const T*> value_;
+    std::atomic<unsigned> epoch_;
+    mutable reader_count readers_[2];
+    std::mutex writer_mutex_;
+  };
+}
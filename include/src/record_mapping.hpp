@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+
+// Maps the members of a user struct to result columns / query parameters, in declaration order
+// of the mapping, so that input_query<my_struct> and buffered::insert_query<my_struct> read and
+// bind the members directly without going through a tuple:
+//
+//   struct my_struct { int64_t id; std::string name; };
+//   namespace sqlite {
+//     template <> struct record_mapping<my_struct> :
+//       record_fields<SQLITE_HPP_FIELD(my_struct, id), SQLITE_HPP_FIELD(my_struct, name)> {};
+//   }
+#define SQLITE_HPP_FIELD(record, member) \
+  ::sqlite::record_field<record, decltype(record::member), &record::member>
+
+namespace sqlite {
+
+  template <typename record_t, typename member_t, member_t record_t::*member_ptr>
+  struct record_field {
+    typedef member_t value_type;
+
+    static member_t& get(record_t& r) {
+      return r.*member_ptr;
+    }
+
+    static const member_t& get(const record_t& r) {
+      return r.*member_ptr;
+    }
+  };
+
+  template <typename... fields_t>
+  struct record_fields {
+    static const bool is_mapped = true;
+    static const size_t size = sizeof...(fields_t);
+    typedef std::tuple<fields_t...> fields_type;
+  };
+
+  // Specialized by users for their structs, see above
+  template <typename record_t>
+  struct record_mapping {
+    static const bool is_mapped = false;
+  };
+
+  // Number of columns in a record, tuple or mapped struct
+  template <typename record_t>
+  struct record_size : std::integral_constant<size_t, record_mapping<record_t>::size> {
+  };
+
+  template <typename... Tp>
+  struct record_size<std::tuple<Tp...>> : std::integral_constant<size_t, sizeof...(Tp)> {
+  };
+
+  // Record type of input_query<Rs...> and friends: a single mapped struct is used as is,
+  // anything else becomes a tuple
+  template <typename... Rs>
+  struct record_type {
+    typedef std::tuple<Rs...> type;
+  };
+
+  template <typename R>
+  struct record_type<R> {
+    typedef typename std::conditional<record_mapping<R>::is_mapped, R, std::tuple<R>>::type type;
+  };
+}
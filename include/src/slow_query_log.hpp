@@ -0,0 +1,401 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "fingerprint.hpp"
+#include "logging.hpp"
+#include "profiler.hpp"
+#include "spsc_ring.hpp"
+#include "statement_stats.hpp"
+
+#if defined(SQLITE_HPP_HAS_TRACE_V2)
+
+namespace sqlite {
+
+  // One run of a statement that took longer than slow_query_log_config::threshold
+  struct slow_query {
+    std::string fingerprint;
+    // sqlite3_expanded_sql() of the run, i.e. with the bound values in place of the parameters
+    std::string sql;
+    // Bound values as SQL literals, indexed by parameter number - 1
+    std::vector<std::string> bindings;
+    // EXPLAIN QUERY PLAN details, captured the first time the fingerprint is logged and empty
+    // in later entries
+    std::vector<std::string> plan;
+    // sqlite3_stmt_status() counters of this run
+    statement_stats stats;
+    uint64_t ns;
+  };
+
+  struct slow_query_log_config {
+    // Runs taking longer than this are logged
+    std::chrono::microseconds threshold = std::chrono::milliseconds(100);
+    // String and blob literals longer than this many characters are cut short
+    size_t max_literal_length = 64;
+    // Entries waiting for the sink; when full, new entries are dropped
+    size_t capacity = 256;
+    // Receives the entries on the log's own thread
+    std::function<void(const slow_query&)> sink;
+  };
+
+  namespace detail {
+    // Cuts string and blob literals of SQL text down to max characters of their value, noting
+    // the full size. An escaped quote or a UTF-8 sequence counts as one character and is never
+    // split; blobs keep whole bytes.
+    inline std::string truncate_literals(const std::string& sql, const size_t max) {
+      std::string out;
+      const size_t n = sql.size();
+      size_t i = 0;
+      while (i < n) {
+        const bool blob = ((sql[i] == 'x') || (sql[i] == 'X')) && (i + 1 < n) && (sql[i + 1] == '\'');
+        if ((sql[i] != '\'') && !blob) {
+          out += sql[i++];
+          continue;
+        }
+        const size_t start = i;
+        i += blob ? 2 : 1;
+        while (i < n) {
+          if (sql[i] == '\'') {
+            if ((i + 1 < n) && (sql[i + 1] == '\'')) {
+              i += 2;
+              continue;
+            }
+            ++i;
+            break;
+          }
+          ++i;
+        }
+        const size_t open = start + (blob ? 2 : 1);
+        const size_t close = ((i > open) && (sql[i - 1] == '\'')) ? i - 1 : i;
+        size_t length = 0;
+        size_t cut = close;
+        for (size_t k = open; k < close; ++length) {
+          if (length == max) cut = k;
+          if (blob) {
+            k += 2;
+          } else if (sql[k] == '\'') {
+            k += 2;
+          } else {
+            ++k;
+            while ((k < close) && ((static_cast<unsigned char>(sql[k]) & 0xc0) == 0x80)) ++k;
+          }
+        }
+        if (length <= max) {
+          out.append(sql, start, i - start);
+        } else {
+          out.append(sql, start, cut - start);
+          out += "...' /* " + std::to_string(length) + (blob ? " bytes */" : " characters */");
+        }
+      }
+      return out;
+    }
+
+    // Length of the SQL literal sqlite3_expanded_sql() put at the start of s: NULL, a number,
+    // a string or a blob (or zeroblob(N))
+    inline size_t literal_length(const char* s, const size_t n) {
+      size_t i = 0;
+      if ((n > 0) && ((s[0] == '\'') || (((s[0] == 'x') || (s[0] == 'X')) && (n > 1) && (s[1] == '\'')))) {
+        i = s[0] == '\'' ? 1 : 2;
+        while (i < n) {
+          if (s[i] == '\'') {
+            if ((i + 1 < n) && (s[i + 1] == '\'')) {
+              i += 2;
+              continue;
+            }
+            return i + 1;
+          }
+          ++i;
+        }
+        return n;
+      }
+      if ((n >= 9) && (sqlite3_strnicmp(s, "zeroblob(", 9) == 0)) {
+        while ((i < n) && (s[i] != ')')) ++i;
+        return i < n ? i + 1 : n;
+      }
+      // NULL or a number, possibly negative and with an exponent
+      if ((i < n) && (s[i] == '-')) ++i;
+      while (i < n) {
+        if (std::isalnum(static_cast<unsigned char>(s[i])) || (s[i] == '.')) {
+          ++i;
+        } else if (((s[i] == '+') || (s[i] == '-')) && ((s[i - 1] == 'e') || (s[i - 1] == 'E'))) {
+          ++i;
+        } else {
+          break;
+        }
+      }
+      return i;
+    }
+
+    // Recovers the bound values from the expanded SQL, which is the prepared text with each
+    // parameter replaced by a literal
+    inline void split_bindings(sqlite3_stmt* stmt, const std::string& sql, const std::string& expanded,
+                               const size_t max, std::vector<std::string>& bindings) {
+      bindings.assign(size_t(sqlite3_bind_parameter_count(stmt)), std::string());
+      auto is_word = [] (const char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || (c == '_') || (static_cast<unsigned char>(c) >= 0x80);
+      };
+      size_t i = 0;
+      size_t j = 0;
+      int last = 0;
+      while ((i < sql.size()) && (j < expanded.size())) {
+        const char c = sql[i];
+        if ((c == '\'') || (c == '"') || (c == '`') || (c == '[')) {
+          const char close = c == '[' ? ']' : c;
+          size_t end = i + 1;
+          while ((end < sql.size()) && (sql[end] != close)) ++end;
+          end = end < sql.size() ? end + 1 : end;
+          j += end - i;
+          i = end;
+        } else if ((c == '-') && (i + 1 < sql.size()) && (sql[i + 1] == '-')) {
+          const size_t end = std::min(sql.find('\n', i), sql.size());
+          j += end - i;
+          i = end;
+        } else if ((c == '/') && (i + 1 < sql.size()) && (sql[i + 1] == '*')) {
+          const size_t close = sql.find("*/", i + 2);
+          const size_t end = close == std::string::npos ? sql.size() : close + 2;
+          j += end - i;
+          i = end;
+        } else if ((c == '?') || (c == ':') || (c == '@') || (c == '$')) {
+          size_t end = i + 1;
+          while ((end < sql.size()) && (is_word(sql[end]) || (sql[end] == ':') || (sql[end] == '$'))) ++end;
+          const std::string name = sql.substr(i, end - i);
+          int index = 0;
+          if (name == "?") {
+            index = last + 1;
+          } else if (c == '?') {
+            index = std::atoi(name.c_str() + 1);
+          } else {
+            index = sqlite3_bind_parameter_index(stmt, name.c_str());
+          }
+          if (index > last) last = index;
+          const size_t len = literal_length(expanded.c_str() + j, expanded.size() - j);
+          if ((index > 0) && (size_t(index) <= bindings.size())) {
+            bindings[size_t(index) - 1] = truncate_literals(expanded.substr(j, len), max);
+          }
+          i = end;
+          j += len;
+        } else {
+          ++i;
+          ++j;
+        }
+      }
+    }
+  }
+
+  // Logs the statements that run longer than a threshold, with what it takes to reproduce them:
+  // the SQL with its bound values, the query plan and the stmt_status counters of the run.
+  // Installed through database::install_slow_query_log(). The trace callback only does work for
+  // slow runs: it builds the entry and hands it over through an spsc_ring to the log's thread,
+  // which calls the sink, so a slow sink never holds up the connection. The query plan is the
+  // exception: the first slow run of each fingerprint prepares and steps its EXPLAIN QUERY PLAN
+  // right in the trace callback, i.e. inside the sqlite3_step() that finished the slow run, which
+  // adds that much to its latency. Later runs of the fingerprint do not. One log per connection.
+  class slow_query_log {
+  public:
+    typedef slow_query_log type;
+    typedef std::shared_ptr<type> type_ptr;
+    typedef slow_query_log_config config;
+
+    slow_query_log() : slow_query_log(config()) {
+    }
+
+    slow_query_log(const config& cfg) :
+      cfg_(cfg),
+      ring_(cfg.capacity),
+      stop_(false),
+      waiting_(0),
+      capturing_(false),
+      logged_(0),
+      dropped_(0),
+      delivered_(0) {
+      writer_ = std::thread([this] () { write(); });
+    }
+
+    slow_query_log(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    // Entries already queued are passed to the sink first
+    ~slow_query_log() {
+      stop_.store(true, std::memory_order_relaxed);
+      wake();
+      if (writer_.joinable()) writer_.join();
+    }
+
+    const config& get_config() const {
+      return cfg_;
+    }
+
+    static int callback(unsigned event, void* p, void* x, void* y) {
+      type* self = static_cast<type*>(p);
+      if (event == SQLITE_TRACE_PROFILE) {
+        self->profile(static_cast<sqlite3_stmt*>(x), *static_cast<const sqlite3_int64*>(y));
+      } else if (event == SQLITE_TRACE_CLOSE) {
+        self->statements_.clear();
+      }
+      return 0;
+    }
+
+    static unsigned mask() {
+      return SQLITE_TRACE_PROFILE | SQLITE_TRACE_CLOSE;
+    }
+
+    // Entries queued, and entries dropped because the ring was full
+    uint64_t logged() const {
+      return logged_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t dropped() const {
+      return dropped_.load(std::memory_order_relaxed);
+    }
+
+    // Waits until the sink has received every entry queued so far
+    void flush() const {
+      const uint64_t target = logged_.load(std::memory_order_relaxed);
+      wait_until([this, target] () { return delivered_.load(std::memory_order_acquire) >= target; });
+    }
+
+  private:
+    struct seen_statement {
+      std::string text;
+      statement_stats last;
+    };
+
+    config cfg_;
+    spsc_ring<slow_query> ring_;
+    std::thread writer_;
+    std::atomic<bool> stop_;
+    // Threads parked in wait_until(); wake() skips the mutex while nobody waits
+    mutable std::atomic<int> waiting_;
+    mutable std::mutex wake_mutex_;
+    mutable std::condition_variable wake_;
+    // The fields below are used by the trace callback only
+    bool capturing_;
+    std::unordered_map<sqlite3_stmt*, seen_statement> statements_;
+    std::unordered_set<std::string> planned_;
+    std::atomic<uint64_t> logged_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<uint64_t> delivered_;
+
+    void profile(sqlite3_stmt* stmt, const sqlite3_int64 elapsed) {
+      // Statements run by capture_plan() itself
+      if (capturing_) return;
+      const uint64_t ns = elapsed > 0 ? uint64_t(elapsed) : 0;
+      const char* sql = sqlite3_sql(stmt);
+      if (sql == nullptr) sql = "";
+      auto found = statements_.find(stmt);
+      // Comparing the text tells a finalized statement from a new one at the same address
+      if ((found == statements_.end()) || (found->second.text != sql)) {
+        if (statements_.size() >= 4096) statements_.clear();
+        seen_statement& seen = statements_[stmt];
+        seen.text = sql;
+        seen.last = statement_stats{0, 0, 0, 0, 0, 0};
+        found = statements_.find(stmt);
+      }
+      const statement_stats now = statement_stats::read(stmt);
+      const statement_stats d = now.since(found->second.last);
+      found->second.last = now;
+      if (ns <= uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(cfg_.threshold).count())) return;
+
+      slow_query* entry = ring_.write_slot();
+      if (entry == nullptr) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      const std::string text(sql);
+      entry->fingerprint = fingerprint(text);
+      entry->stats = d;
+      entry->ns = ns;
+      char* expanded = sqlite3_expanded_sql(stmt);
+      if (expanded != nullptr) {
+        const std::string expanded_text(expanded);
+        sqlite3_free(expanded);
+        entry->sql = detail::truncate_literals(expanded_text, cfg_.max_literal_length);
+        detail::split_bindings(stmt, text, expanded_text, cfg_.max_literal_length, entry->bindings);
+      } else {
+        // Too long to expand, or out of memory
+        entry->sql = text;
+        entry->bindings.clear();
+      }
+      entry->plan.clear();
+      if (planned_.insert(entry->fingerprint).second) capture_plan(sqlite3_db_handle(stmt), text, entry->plan);
+      ring_.publish();
+      logged_.fetch_add(1, std::memory_order_release);
+      wake();
+    }
+
+    void capture_plan(::sqlite3* db, const std::string& sql, std::vector<std::string>& plan) {
+      capturing_ = true;
+      sqlite3_stmt* explain = nullptr;
+      const std::string explain_sql = "EXPLAIN QUERY PLAN " + sql;
+      if (sqlite3_prepare_v2(db, explain_sql.c_str(), int(explain_sql.size()), &explain, nullptr) == SQLITE_OK) {
+        // The last column is the detail in every SQLite version
+        const int detail = sqlite3_column_count(explain) - 1;
+        while (sqlite3_step(explain) == SQLITE_ROW) {
+          const unsigned char* text = sqlite3_column_text(explain, detail);
+          plan.push_back(text != nullptr ? reinterpret_cast<const char*>(text) : "");
+        }
+      } else {
+        SQLITE_HPP_LOG("slow_query_log::capture_plan Failed to explain " + sql);
+      }
+      sqlite3_finalize(explain);
+      capturing_ = false;
+    }
+
+    void write() {
+      slow_query entry;
+      for (;;) {
+        if (ring_.try_pop(entry)) {
+          if (cfg_.sink) cfg_.sink(entry);
+          delivered_.fetch_add(1, std::memory_order_release);
+          // flush() may be waiting for this entry
+          wake();
+          continue;
+        }
+        if (stop_.load(std::memory_order_relaxed)) {
+          // Entries published before stop_ was set are visible now
+          if (ring_.read_slot() == nullptr) break;
+          continue;
+        }
+        wait_until([this] () { return ring_.read_slot() != nullptr || stop_.load(std::memory_order_relaxed); });
+      }
+    }
+
+    // The waiter announces itself before checking ready() and the waker fences before checking
+    // waiting_, so either the waker sees the waiter or the waiter sees the new state
+    template <typename predicate_t>
+    void wait_until(predicate_t ready) const {
+      if (ready()) return;
+      std::unique_lock<std::mutex> lock(wake_mutex_);
+      waiting_.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      wake_.wait(lock, ready);
+      waiting_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void wake() const {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (waiting_.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        wake_.notify_all();
+      }
+    }
+  };
+}
+
+#endif
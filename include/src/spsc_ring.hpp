@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace sqlite {
+
+  // Bounded lock-free queue for exactly one producer thread and one consumer thread.
+  // Elements stay in their slots: the producer fills the slot returned by write_slot() in place
+  // and publishes it, the consumer takes the contents of read_slot() (e.g. by swapping) and
+  // releases it, so the memory held by elements is recycled instead of reallocated.
+  template <typename T>
+  class spsc_ring {
+  public:
+    typedef spsc_ring<T> type;
+    typedef T value_type;
+
+    // Capacity is rounded up to a power of two
+    explicit spsc_ring(const size_t capacity) :
+      head_(0),
+      tail_(0) {
+      size_t n = 1;
+      while (n < capacity) n *= 2;
+      slots_ = std::vector<T>(n);
+      mask_ = n - 1;
+    }
+
+    spsc_ring(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    size_t capacity() const {
+      return slots_.size();
+    }
+
+    // Producer side: the next free slot, or nullptr if the ring is full
+    T* write_slot() {
+      const size_t tail = tail_.load(std::memory_order_relaxed);
+      if (tail - head_.load(std::memory_order_acquire) == slots_.size()) return nullptr;
+      return &slots_[tail & mask_];
+    }
+
+    void publish() {
+      tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer side: the oldest published slot, or nullptr if the ring is empty
+    T* read_slot() {
+      const size_t head = head_.load(std::memory_order_relaxed);
+      if (head == tail_.load(std::memory_order_acquire)) return nullptr;
+      return &slots_[head & mask_];
+    }
+
+    void release() {
+      head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    bool try_push(T&& value) {
+      T* slot = write_slot();
+      if (slot == nullptr) return false;
+      *slot = std::move(value);
+      publish();
+      return true;
+    }
+
+    bool try_pop(T& value) {
+      T* slot = read_slot();
+      if (slot == nullptr) return false;
+      value = std::move(*slot);
+      release();
+      return true;
+    }
+
+  private:
+    std::vector<T> slots_;
+    size_t mask_;
+    // Kept on separate cache lines so that the two threads do not invalidate each other's
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+  };
+}
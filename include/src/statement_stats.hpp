@@ -0,0 +1,77 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <cstdint>
+
+namespace sqlite {
+
+  // Runtime counters of a prepared statement from sqlite3_stmt_status(). They accumulate over
+  // all runs of the statement until it is finalized or the counters are reset. SQLite keeps them
+  // as 32-bit unsigned values that wrap around; since() takes that into account.
+  struct statement_stats {
+    // Forward steps of full table scans; a large value usually means a missing index
+    uint64_t fullscan_steps;
+    // Sort operations, which an index could have avoided
+    uint64_t sorts;
+    // Rows inserted into automatic indexes built for a single run
+    uint64_t autoindex_rows;
+    // Virtual machine operations
+    uint64_t vm_steps;
+    // Automatic re-preparations after schema changes (SQLite 3.20.0+, 0 otherwise)
+    uint64_t reprepares;
+    // Completed runs (SQLite 3.20.0+, 0 otherwise)
+    uint64_t runs;
+
+    statement_stats& operator+=(const statement_stats& other) {
+      fullscan_steps += other.fullscan_steps;
+      sorts += other.sorts;
+      autoindex_rows += other.autoindex_rows;
+      vm_steps += other.vm_steps;
+      reprepares += other.reprepares;
+      runs += other.runs;
+      return *this;
+    }
+
+    // Counters accumulated since an earlier reading of the same statement, modulo 2^32 like the
+    // counters themselves. A counter that seems to have gone back by 2^31 or more was reset in
+    // between rather than wrapped, and is taken as a whole.
+    statement_stats since(const statement_stats& earlier) const {
+      statement_stats d;
+      d.fullscan_steps = delta(fullscan_steps, earlier.fullscan_steps);
+      d.sorts = delta(sorts, earlier.sorts);
+      d.autoindex_rows = delta(autoindex_rows, earlier.autoindex_rows);
+      d.vm_steps = delta(vm_steps, earlier.vm_steps);
+      d.reprepares = delta(reprepares, earlier.reprepares);
+      d.runs = delta(runs, earlier.runs);
+      return d;
+    }
+
+    // Reads the counters of stmt, zeroing them if reset is set; all zeroes for a null statement
+    static statement_stats read(sqlite3_stmt* stmt, const bool reset = false) {
+      statement_stats s{0, 0, 0, 0, 0, 0};
+      if (stmt == nullptr) return s;
+      const int r = reset ? 1 : 0;
+      s.fullscan_steps = counter(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, r));
+      s.sorts = counter(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, r));
+      s.autoindex_rows = counter(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, r));
+      s.vm_steps = counter(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, r));
+#if defined(SQLITE_STMTSTATUS_REPREPARE)
+      s.reprepares = counter(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, r));
+      s.runs = counter(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_RUN, r));
+#endif
+      return s;
+    }
+
+  private:
+    // sqlite3_stmt_status() returns the u32 counter cast to int
+    static uint64_t counter(const int v) {
+      return uint64_t(uint32_t(v));
+    }
+
+    static uint64_t delta(const uint64_t now, const uint64_t before) {
+      const uint32_t d = uint32_t(now - before);
+      return d < (uint32_t(1) << 31) ? d : now;
+    }
+  };
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <sqlite3.h>
+
+#include <memory>
+
+#include "logging.hpp"
+#include "profiler.hpp"
+#include "slow_query_log.hpp"
+
+#if defined(SQLITE_HPP_HAS_TRACE_V2)
+
+namespace sqlite {
+
+  // SQLite keeps one sqlite3_trace_v2() callback per connection. tracer takes it and passes the
+  // events on to the profiler and the slow query log, whichever are set. Owned by database,
+  // which re-installs it after changing either of them.
+  class tracer {
+  public:
+    typedef tracer type;
+    typedef std::shared_ptr<type> type_ptr;
+
+    tracer() {
+    }
+
+    tracer(const type&) = delete;
+    type& operator=(const type&) = delete;
+
+    const profiler::type_ptr& get_profiler() const {
+      return profiler_;
+    }
+
+    void set_profiler(const profiler::type_ptr& p) {
+      profiler_ = p;
+    }
+
+    const slow_query_log::type_ptr& get_slow_query_log() const {
+      return slow_query_log_;
+    }
+
+    void set_slow_query_log(const slow_query_log::type_ptr& log) {
+      slow_query_log_ = log;
+    }
+
+    // Registers the callback on the connection, or removes it if there is nothing to trace
+    int install(::sqlite3* db) {
+      SQLITE_HPP_LOG("tracer::install");
+      if (!profiler_ && !slow_query_log_) return sqlite3_trace_v2(db, 0, nullptr, nullptr);
+      return sqlite3_trace_v2(db, mask(), &callback, this);
+    }
+
+  private:
+    profiler::type_ptr profiler_;
+    slow_query_log::type_ptr slow_query_log_;
+
+    static unsigned mask() {
+      return profiler::mask() | slow_query_log::mask();
+    }
+
+    static int callback(unsigned event, void* p, void* x, void* y) {
+      type* self = static_cast<type*>(p);
+      if (self->profiler_) profiler::callback(event, self->profiler_.get(), x, y);
+      if (self->slow_query_log_) slow_query_log::callback(event, self->slow_query_log_.get(), x, y);
+      return 0;
+    }
+  };
+}
+
+#endif
@@ -4,10 +4,32 @@
 
 #include <cstdint>
 #include <string>
+#include <utility>
 #include <vector>
 
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+#if defined(__cpp_lib_string_view)
+#define SQLITE_HPP_HAS_STRING_VIEW 1
+#endif
+#if defined(__cpp_lib_span)
+#define SQLITE_HPP_HAS_SPAN 1
+#endif
+
+#include "views.hpp"
+
 namespace sqlite {
 
+  // get_column_into() and null_into(), where a local type provides them, decode into an existing
+  // value, so that owning types can reuse its capacity.
+  // bind() lets SQLite copy the value (SQLITE_TRANSIENT). bind_static(), where a local type provides it,
+  // binds with SQLITE_STATIC instead, for callers that guarantee the memory outlives the statement's
+  // next step() or the rebinding of the parameter.
   template <typename derived_t>
   struct value_access_policy {
   };
@@ -28,16 +50,28 @@ namespace sqlite {
       }
 
       static value_type get_column_from_stmt(sqlite3_stmt* stmt, int i) {
-        ::sqlite3_column_blob(stmt, i);
+        const uint8_t* b = static_cast<const uint8_t*>(::sqlite3_column_blob(stmt, i));
         const int sz = ::sqlite3_column_bytes(stmt, i);
-        value_type value(sz);
-        const char* b = reinterpret_cast<const char*>(::sqlite3_column_blob(stmt, i));
-        std::copy(b, b + sz, &value[0]);
-        return value;
+        return value_type(b, b + sz);
+      }
+
+      // Reuses the capacity of the existing value
+      static void get_column_into(sqlite3_stmt* stmt, int i, value_type& value) {
+        const uint8_t* b = static_cast<const uint8_t*>(::sqlite3_column_blob(stmt, i));
+        const int sz = ::sqlite3_column_bytes(stmt, i);
+        value.assign(b, b + sz);
+      }
+
+      static void null_into(value_type& value) {
+        value.clear();
       }
 
       static int bind(sqlite3_stmt* stmt, int i, const value_type& value) {
-        return sqlite3_bind_blob(stmt, i, &value[0], value.size(), SQLITE_TRANSIENT);
+        return sqlite3_bind_blob(stmt, i, value.data(), value.size(), SQLITE_TRANSIENT);
+      }
+
+      static int bind_static(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return sqlite3_bind_blob(stmt, i, value.data(), value.size(), SQLITE_STATIC);
       }
     };
   
@@ -51,19 +85,170 @@ namespace sqlite {
       }
 
       static value_type get_column_from_stmt(sqlite3_stmt* stmt, int i) {
-        ::sqlite3_column_text(stmt, i);
+        const char* c = reinterpret_cast<const char*>(::sqlite3_column_text(stmt, i));
         const int sz = ::sqlite3_column_bytes(stmt, i);
-        value_type value;
-        value.resize(sz);
-        const unsigned char *c = ::sqlite3_column_text(stmt, i);
-        std::copy(c, c + value.size(), &value[0]);
-        return value;
+        return value_type(c, sz);
+      }
+
+      // Reuses the capacity of the existing value
+      static void get_column_into(sqlite3_stmt* stmt, int i, value_type& value) {
+        const char* c = reinterpret_cast<const char*>(::sqlite3_column_text(stmt, i));
+        const int sz = ::sqlite3_column_bytes(stmt, i);
+        value.assign(c, sz);
+      }
+
+      static void null_into(value_type& value) {
+        value.clear();
+      }
+
+      static int bind(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return sqlite3_bind_text(stmt, i, value.data(), value.size(), SQLITE_TRANSIENT);
+      }
+
+      static int bind_static(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return sqlite3_bind_text(stmt, i, value.data(), value.size(), SQLITE_STATIC);
+      }
+    };
+
+    template <>
+    struct default_value_access_policy::local_type<text_view> {
+      const int sqlite_type = SQLITE_TEXT;
+      typedef text_view value_type;
+
+      static value_type null_value() {
+        return value_type();
+      }
+
+      // Points into the statement, valid until the next step(), reset or finalization
+      static value_type get_column_from_stmt(sqlite3_stmt* stmt, int i) {
+        const char* c = reinterpret_cast<const char*>(::sqlite3_column_text(stmt, i));
+        return value_type(c, ::sqlite3_column_bytes(stmt, i));
+      }
+
+      static int bind(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return sqlite3_bind_text(stmt, i, value.data(), value.size(), SQLITE_TRANSIENT);
+      }
+
+      static int bind_static(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return sqlite3_bind_text(stmt, i, value.data(), value.size(), SQLITE_STATIC);
+      }
+    };
+
+    template <>
+    struct default_value_access_policy::local_type<blob_view> {
+      const int sqlite_type = SQLITE_BLOB;
+      typedef blob_view value_type;
+
+      static value_type null_value() {
+        return value_type();
+      }
+
+      // Points into the statement, valid until the next step(), reset or finalization
+      static value_type get_column_from_stmt(sqlite3_stmt* stmt, int i) {
+        const uint8_t* b = static_cast<const uint8_t*>(::sqlite3_column_blob(stmt, i));
+        return value_type(b, ::sqlite3_column_bytes(stmt, i));
+      }
+
+      static int bind(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return sqlite3_bind_blob(stmt, i, value.data(), value.size(), SQLITE_TRANSIENT);
+      }
+
+      static int bind_static(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return sqlite3_bind_blob(stmt, i, value.data(), value.size(), SQLITE_STATIC);
+      }
+    };
+
+    template <>
+    struct default_value_access_policy::local_type<std::pair<const char*, size_t>> {
+      const int sqlite_type = SQLITE_TEXT;
+      typedef std::pair<const char*, size_t> value_type;
+
+      static int bind(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return local_type<text_view>::bind(stmt, i, text_view(value.first, value.second));
+      }
+
+      static int bind_static(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return local_type<text_view>::bind_static(stmt, i, text_view(value.first, value.second));
+      }
+    };
+
+    template <>
+    struct default_value_access_policy::local_type<std::pair<const uint8_t*, size_t>> {
+      const int sqlite_type = SQLITE_BLOB;
+      typedef std::pair<const uint8_t*, size_t> value_type;
+
+      static int bind(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return local_type<blob_view>::bind(stmt, i, blob_view(value.first, value.second));
+      }
+
+      static int bind_static(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return local_type<blob_view>::bind_static(stmt, i, blob_view(value.first, value.second));
+      }
+    };
+
+    template <>
+    struct default_value_access_policy::local_type<zeroblob> {
+      const int sqlite_type = SQLITE_BLOB;
+      typedef zeroblob value_type;
+
+      static int bind(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return sqlite3_bind_zeroblob64(stmt, i, sqlite3_uint64(value.size));
+      }
+
+      static int bind_static(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return bind(stmt, i, value);
+      }
+    };
+
+#if defined(SQLITE_HPP_HAS_STRING_VIEW)
+    template <>
+    struct default_value_access_policy::local_type<std::string_view> {
+      const int sqlite_type = SQLITE_TEXT;
+      typedef std::string_view value_type;
+
+      static value_type null_value() {
+        return value_type();
+      }
+
+      static value_type get_column_from_stmt(sqlite3_stmt* stmt, int i) {
+        const char* c = reinterpret_cast<const char*>(::sqlite3_column_text(stmt, i));
+        return value_type(c, ::sqlite3_column_bytes(stmt, i));
       }
 
       static int bind(sqlite3_stmt* stmt, int i, const value_type& value) {
-        return sqlite3_bind_text(stmt, i, value.c_str(), -1, SQLITE_TRANSIENT);
+        return sqlite3_bind_text(stmt, i, value.data(), value.size(), SQLITE_TRANSIENT);
+      }
+
+      static int bind_static(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return sqlite3_bind_text(stmt, i, value.data(), value.size(), SQLITE_STATIC);
+      }
+    };
+#endif
+
+#if defined(SQLITE_HPP_HAS_SPAN)
+    template <>
+    struct default_value_access_policy::local_type<std::span<const uint8_t>> {
+      const int sqlite_type = SQLITE_BLOB;
+      typedef std::span<const uint8_t> value_type;
+
+      static value_type null_value() {
+        return value_type();
+      }
+
+      static value_type get_column_from_stmt(sqlite3_stmt* stmt, int i) {
+        const uint8_t* b = static_cast<const uint8_t*>(::sqlite3_column_blob(stmt, i));
+        return value_type(b, ::sqlite3_column_bytes(stmt, i));
+      }
+
+      static int bind(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return sqlite3_bind_blob(stmt, i, value.data(), value.size(), SQLITE_TRANSIENT);
+      }
+
+      static int bind_static(sqlite3_stmt* stmt, int i, const value_type& value) {
+        return sqlite3_bind_blob(stmt, i, value.data(), value.size(), SQLITE_STATIC);
       }
     };
+#endif
 
     template <>
     struct default_value_access_policy::local_type<int64_t> {
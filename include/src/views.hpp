@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace sqlite {
+
+  // Non-owning pointer and length pair. Used to bind values without copying them and to read
+  // column values straight from the statement. The referenced memory is not copied, so it has
+  // to stay valid for as long as the view is used. Views read from a column point into the
+  // statement and are valid until its next step(), reset or finalization, which makes rows of
+  // views cheap to hash or compare while iterating an input_query.
+  template <typename T>
+  class basic_view {
+  public:
+    typedef basic_view<T> type;
+    typedef T value_type;
+    typedef const T* const_iterator;
+
+    basic_view() :
+      data_(nullptr),
+      size_(0) {
+    }
+
+    basic_view(const T* data, const size_t size) :
+      data_(data),
+      size_(size) {
+    }
+
+    template <typename alloc_t>
+    basic_view(const std::vector<T, alloc_t>& v) :
+      data_(v.data()),
+      size_(v.size()) {
+    }
+
+    template <typename traits_t, typename alloc_t>
+    basic_view(const std::basic_string<T, traits_t, alloc_t>& s) :
+      data_(s.data()),
+      size_(s.size()) {
+    }
+
+    const T* data() const {
+      return data_;
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    bool empty() const {
+      return size_ == 0;
+    }
+
+    const_iterator begin() const {
+      return data_;
+    }
+
+    const_iterator end() const {
+      return data_ + size_;
+    }
+
+    const T& operator[](const size_t i) const {
+      return data_[i];
+    }
+
+    bool operator==(const type& other) const {
+      return (size_ == other.size_) &&
+        ((size_ == 0) || (std::memcmp(data_, other.data_, size_ * sizeof(T)) == 0));
+    }
+
+    bool operator!=(const type& other) const {
+      return !(*this == other);
+    }
+
+    bool operator<(const type& other) const {
+      return std::lexicographical_compare(begin(), end(), other.begin(), other.end());
+    }
+
+  private:
+    const T* data_;
+    size_t size_;
+  };
+
+  typedef basic_view<char> text_view;
+  typedef basic_view<uint8_t> blob_view;
+
+  // Binds a blob of size zero bytes without allocating it, to be filled in place through
+  // blob_handle and blob_ostream
+  struct zeroblob {
+    uint64_t size;
+
+    explicit zeroblob(const uint64_t n) :
+      size(n) {
+    }
+  };
+}
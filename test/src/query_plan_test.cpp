@@ -0,0 +1,177 @@
+#include <gtest/gtest.h>
+
+#define SQLITE_HPP_LOG_FILENAME "sqlite_debug.log"
+
+#include <sqlite>
+#include <sqlite_buffered>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Query plan regression checks. Every registered query is run through EXPLAIN QUERY PLAN and
+// its normalized plan is compared with test/golden/<name>.plan. The test fails when a plan
+// gains a full table scan or a temporary b-tree that the golden file does not have; other
+// differences, e.g. between SQLite versions, are only reported. Run with
+// SQLITE_HPP_UPDATE_GOLDEN=1 in the environment to rewrite the golden files.
+
+#if !defined(SQLITE_HPP_GOLDEN_DIR)
+#define SQLITE_HPP_GOLDEN_DIR "golden"
+#endif
+
+namespace {
+
+  const char* const schema[] = {
+    "CREATE TABLE `users` (`id` INTEGER PRIMARY KEY, `email` TEXT UNIQUE, `name` TEXT, `created` INTEGER)",
+    "CREATE INDEX `users_created` ON `users` (`created`)",
+    "CREATE TABLE `orders` (`id` INTEGER PRIMARY KEY, `user_id` INTEGER, `status` TEXT, `amount` INTEGER)",
+    "CREATE INDEX `orders_user_status` ON `orders` (`user_id`, `status`)"
+  };
+
+  struct plan_case {
+    std::string name;
+    std::string sql;
+  };
+
+  sqlite::database::type_ptr open_schema() {
+    sqlite::database::type_ptr db(new sqlite::database::type(":memory:"));
+    for (const char* sql : schema) {
+      sqlite::query q(db, sql);
+      q.step();
+    }
+    return db;
+  }
+
+  // The registered queries, including the batches generated by the buffered queries
+  std::vector<plan_case> plan_cases(const sqlite::database::type_ptr& db) {
+    std::vector<plan_case> cases{
+      {"user_by_id", "SELECT `name` FROM `users` WHERE `id` = ?"},
+      {"user_by_email", "SELECT `id`, `name` FROM `users` WHERE `email` = ?"},
+      {"users_created_range", "SELECT `id` FROM `users` WHERE `created` BETWEEN ? AND ? ORDER BY `created`"},
+      {"users_keyset_page", "SELECT `id`, `name` FROM `users` WHERE `id` > ? ORDER BY `id` LIMIT ?"},
+      {"orders_by_user_status", "SELECT `id`, `amount` FROM `orders` WHERE `user_id` = ? AND `status` = ?"},
+      {"orders_of_user_by_email",
+       "SELECT o.`id`, o.`amount` FROM `users` u JOIN `orders` o ON o.`user_id` = u.`id` WHERE u.`email` = ?"}
+    };
+
+    {
+      sqlite::buffered::insert_query<int64_t, std::string, std::string, int64_t>
+        insert(db, "users", std::vector<std::string>{"id", "email", "name", "created"});
+      for (int64_t i = 0; i < 3; ++i) {
+        insert.push_back(std::make_tuple(i, "user" + std::to_string(i), std::string("name"), i));
+      }
+      insert.flush();
+      cases.push_back(plan_case{"buffered_insert_batch", insert.query_string()});
+    }
+    {
+      typedef std::tuple<int64_t, std::string> record_type;
+      sqlite::buffered::input_query_by_keys_base<record_type, std::tuple<int64_t>, sqlite::default_value_access_policy>
+        select(db, "SELECT `id`, `name` FROM `users` WHERE ", std::vector<std::string>{"id"});
+      for (int64_t i = 0; i < 3; ++i) select.add_key(std::make_tuple(i));
+      select.pull();
+      cases.push_back(plan_case{"buffered_by_keys_batch", select.query_string()});
+    }
+    {
+      typedef std::tuple<int64_t, int64_t> record_type;
+      sqlite::buffered::input_query_by_keys_base<record_type, std::tuple<int64_t, std::string>,
+                                                 sqlite::default_value_access_policy>
+        select(db, "SELECT `id`, `amount` FROM `orders` WHERE ", std::vector<std::string>{"user_id", "status"});
+      for (int64_t i = 0; i < 3; ++i) select.add_key(std::make_tuple(i, std::string("open")));
+      select.pull();
+      cases.push_back(plan_case{"buffered_by_composite_keys_batch", select.query_string()});
+    }
+    return cases;
+  }
+
+  // One detail line per plan step. Older SQLite versions say "SCAN TABLE t" and
+  // "SEARCH TABLE t" where newer ones say "SCAN t" and "SEARCH t"; the newer form is kept.
+  std::vector<std::string> explain(const sqlite::database::type_ptr& db, const std::string& sql) {
+    std::vector<std::string> plan;
+    sqlite::query q(db, "EXPLAIN QUERY PLAN " + sql);
+    EXPECT_EQ(SQLITE_OK, q.result_code()) << sql;
+    const int detail = sqlite3_column_count(q.statement().get()) - 1;
+    for (q.step(); q.result_code() == SQLITE_ROW; q.step()) {
+      std::string line = q.get<std::string>(detail);
+      for (const std::string verb : {"SCAN TABLE ", "SEARCH TABLE "}) {
+        if (line.compare(0, verb.size(), verb) == 0) line.erase(verb.size() - 6, 6);
+      }
+      plan.push_back(line);
+    }
+    return plan;
+  }
+
+  // Steps that read a whole table or sort through a temporary b-tree. A scan in index order
+  // ("SCAN t USING INDEX i") still reads every row, so only the constant row of a VALUES or
+  // table-less SELECT is not a scan.
+  bool is_regression(const std::string& line) {
+    if (line.find("USE TEMP B-TREE") != std::string::npos) return true;
+    return (line.compare(0, 5, "SCAN ") == 0) && (line != "SCAN CONSTANT ROW");
+  }
+
+  std::string golden_path(const std::string& name) {
+    return std::string(SQLITE_HPP_GOLDEN_DIR) + "/" + name + ".plan";
+  }
+
+  bool read_golden(const std::string& name, std::vector<std::string>& plan) {
+    std::ifstream in(golden_path(name));
+    if (!in) return false;
+    std::string line;
+    while (std::getline(in, line)) {
+      if (!line.empty()) plan.push_back(line);
+    }
+    return true;
+  }
+
+  void write_golden(const std::string& name, const std::vector<std::string>& plan) {
+    std::ofstream out(golden_path(name));
+    for (const auto& line : plan) out << line << "\n";
+  }
+}
+
+TEST(QueryPlanTest, NoNewScans) {
+  sqlite::database::type_ptr db = open_schema();
+  const bool update = std::getenv("SQLITE_HPP_UPDATE_GOLDEN") != nullptr;
+  for (const plan_case& c : plan_cases(db)) {
+    SCOPED_TRACE(c.name);
+    const std::vector<std::string> plan = explain(db, c.sql);
+    ASSERT_FALSE(plan.empty()) << c.sql;
+    if (update) {
+      write_golden(c.name, plan);
+      continue;
+    }
+    std::vector<std::string> golden;
+    ASSERT_TRUE(read_golden(c.name, golden)) << "No golden plan at " << golden_path(c.name);
+    for (const auto& line : plan) {
+      if (is_regression(line)) {
+        EXPECT_NE(golden.end(), std::find(golden.begin(), golden.end(), line))
+          << "New plan step \"" << line << "\" for " << c.sql;
+      }
+    }
+    if (plan != golden) {
+      std::cout << "Plan of " << c.name << " differs from " << golden_path(c.name) << ":\n";
+      for (const auto& line : plan) std::cout << "  " << line << "\n";
+    }
+  }
+}
+
+TEST(QueryPlanTest, DetectsScans) {
+  sqlite::database::type_ptr db = open_schema();
+  bool found = false;
+  for (const auto& line : explain(db, "SELECT `id` FROM `users` WHERE `id` = ?")) {
+    found = found || is_regression(line);
+  }
+  ASSERT_FALSE(found);
+  for (const auto& line : explain(db, "SELECT `id` FROM `users` WHERE `name` = ? ORDER BY abs(`created`)")) {
+    found = found || is_regression(line);
+  }
+  ASSERT_TRUE(found);
+  // A full scan in index order avoids the sort but is still a scan
+  found = false;
+  for (const auto& line : explain(db, "SELECT `name` FROM `users` WHERE `name` = ? ORDER BY `created`")) {
+    found = found || is_regression(line);
+  }
+  ASSERT_TRUE(found);
+}
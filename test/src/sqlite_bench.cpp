@@ -0,0 +1,351 @@
+// Micro-benchmarks. Not part of the test suite: run sqlite_bench [benchmark names...]
+
+#include <sqlite>
+#include <sqlite_buffered>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+  typedef std::chrono::steady_clock bench_clock;
+
+  double seconds_since(const bench_clock::time_point& started) {
+    return std::chrono::duration<double>(bench_clock::now() - started).count();
+  }
+
+  void report(const std::string& benchmark, const std::string& variant, const double seconds,
+              const double operations, const std::string& unit) {
+    std::printf("%-24s %-28s %10.3f s %14.0f %s/s\n", benchmark.c_str(), variant.c_str(),
+                seconds, operations / seconds, unit.c_str());
+  }
+
+  void execute(const sqlite::database::type_ptr& db, const std::string& sql) {
+    sqlite::query q(db, sql);
+    q.step();
+  }
+
+  // Point lookups by rowid from several threads, one connection per thread, with a small
+  // cache so that pages are constantly recycled.
+  void page_cache_multithreaded_reads() {
+    const std::string filename = "bench_page_cache.db";
+    const int64_t n_rows = 200000;
+    const int n_threads = 4;
+    const int n_lookups = 200000;
+    {
+      sqlite::database::type_ptr db(new sqlite::database::type(filename));
+      execute(db, "DROP TABLE IF EXISTS `bench`");
+      execute(db, "CREATE TABLE `bench` (`id` INTEGER PRIMARY KEY, `payload` BLOB)");
+      execute(db, "BEGIN");
+      sqlite::buffered::insert_query<int64_t, std::vector<uint8_t>> insert(db, "bench",
+                                                                             std::vector<std::string>{"id", "payload"});
+      for (int64_t i = 0; i < n_rows; ++i) {
+        insert.push_back(std::make_tuple(i, std::vector<uint8_t>(100, uint8_t(i))));
+      }
+      insert.flush();
+      execute(db, "COMMIT");
+    }
+
+    auto run = [&] (const std::string& variant) {
+      std::vector<std::thread> threads;
+      const bench_clock::time_point started = bench_clock::now();
+      for (int t = 0; t < n_threads; ++t) {
+        threads.push_back(std::thread([&, t] () {
+              sqlite::database::type_ptr db(new sqlite::database::type(filename));
+              execute(db, "PRAGMA cache_size = 200");
+              sqlite::query select(db, "SELECT `payload` FROM `bench` WHERE `id` = ?");
+              std::default_random_engine re(t);
+              std::uniform_int_distribution<int64_t> uniform(0, n_rows - 1);
+              for (int i = 0; i < n_lookups; ++i) {
+                select.bind(1, uniform(re));
+                select.step();
+                sqlite3_reset(select.statement().get());
+              }
+            }));
+      }
+      for (auto& t : threads) t.join();
+      report("page_cache", variant, seconds_since(started), double(n_threads) * n_lookups, "lookups");
+    };
+
+    sqlite3_shutdown();
+    run("default");
+    sqlite3_shutdown();
+    sqlite::page_cache::install();
+    run("arena per connection");
+    auto stats = sqlite::page_cache::stats();
+    std::printf("%-24s hits %llu, misses %llu, evictions %llu\n", "", (unsigned long long)stats.hits,
+                (unsigned long long)stats.misses, (unsigned long long)stats.evictions);
+    sqlite3_shutdown();
+    sqlite::page_cache::uninstall();
+    sqlite::page_cache::config shared;
+    shared.shared_arena = true;
+    sqlite::page_cache::install(shared);
+    run("shared arena");
+    sqlite3_shutdown();
+    sqlite::page_cache::uninstall();
+  }
+
+  // Recursive tuple_cat decoder the library used before decoding over an index list,
+  // kept here as the baseline
+  template <std::size_t I, typename tuple_t, typename query_t>
+  typename std::enable_if<0 == std::tuple_size<tuple_t>::value, tuple_t>::type
+  tuple_cat_get_tuple(query_t&) {
+    return std::tuple<>();
+  }
+
+  template <std::size_t I, typename tuple_t, typename query_t>
+  typename std::enable_if<0 != std::tuple_size<tuple_t>::value, tuple_t>::type
+  tuple_cat_get_tuple(query_t& q) {
+    typedef typename std::tuple_element<0, tuple_t>::type A;
+    A value;
+    q.get(I, value);
+    return std::tuple_cat(std::tuple<A>(value),
+                          tuple_cat_get_tuple<I+1, typename sqlite::tuple_tail_type<tuple_t>::type>(q));
+  }
+
+  // Decoding cost of a single 24-column row (8 integers, 8 doubles, 8 short strings)
+  void wide_row_decode() {
+    typedef std::tuple<int64_t, int64_t, int64_t, int64_t, int64_t, int64_t, int64_t, int64_t,
+                       double, double, double, double, double, double, double, double,
+                       std::string, std::string, std::string, std::string,
+                       std::string, std::string, std::string, std::string> row_type;
+    const int n_decodes = 200000;
+    sqlite::database::type_ptr db(new sqlite::database::type(":memory:"));
+    std::string columns;
+    for (int i = 0; i < 8; ++i) columns += std::string(columns.empty() ? "" : ", ") + std::to_string(i);
+    for (int i = 0; i < 8; ++i) columns += ", " + std::to_string(i) + ".5";
+    for (int i = 0; i < 8; ++i) columns += ", 'string value number " + std::to_string(i) + "'";
+    sqlite::query select(db, "SELECT " + columns);
+    select.step();
+
+    size_t checksum = 0;
+    bench_clock::time_point started = bench_clock::now();
+    for (int i = 0; i < n_decodes; ++i) {
+      row_type row = tuple_cat_get_tuple<0, row_type>(select);
+      checksum += std::get<23>(row).size();
+    }
+    report("wide_row_decode", "tuple_cat recursion", seconds_since(started), n_decodes, "rows");
+
+    started = bench_clock::now();
+    for (int i = 0; i < n_decodes; ++i) {
+      row_type row = select.get_tuple(static_cast<row_type*>(nullptr));
+      checksum += std::get<23>(row).size();
+    }
+    report("wide_row_decode", "index list", seconds_since(started), n_decodes, "rows");
+
+    started = bench_clock::now();
+    row_type row;
+    for (int i = 0; i < n_decodes; ++i) {
+      select.get_tuple(row);
+      checksum += std::get<23>(row).size();
+    }
+    report("wide_row_decode", "index list, reused tuple", seconds_since(started), n_decodes, "rows");
+    if (checksum == 0) std::printf("unexpected checksum\n");
+  }
+
+  // SUM, MIN/MAX and a filtered count computed by SQLite, against fetching the columns and
+  // running the kernels over them. Build with -mavx2 (or -march=native) for the AVX2 kernels.
+  void column_kernels() {
+    const int64_t n_rows = 2000000;
+    sqlite::database::type_ptr db(new sqlite::database::type(":memory:"));
+    execute(db, "CREATE TABLE `bench` (`i` INTEGER, `d` REAL)");
+    execute(db, "WITH RECURSIVE `r`(`n`) AS (SELECT 1 UNION ALL SELECT `n` + 1 FROM `r` WHERE `n` < " +
+            std::to_string(n_rows) + ") INSERT INTO `bench` SELECT `n` * 7919 % 100003, `n` / 3.0 FROM `r`");
+
+    bench_clock::time_point started = bench_clock::now();
+    sqlite::query aggregates(db, "SELECT SUM(`i`), MIN(`d`), MAX(`d`), SUM(`i` < 50000) FROM `bench`");
+    aggregates.step();
+    const int64_t sql_sum = aggregates.get<int64_t>(0);
+    report("column_kernels", "SELECT SUM(...)", seconds_since(started), double(n_rows), "rows");
+
+    sqlite::input_query<int64_t, double> select(db, "SELECT `i`, `d` FROM `bench`");
+    decltype(select)::column_batch_type batch;
+    double fetch_seconds = 0;
+    double kernel_seconds = 0;
+    int64_t sum = 0;
+    size_t below = 0;
+    double mn = 0;
+    started = bench_clock::now();
+    while (select.fetch_columns(batch, 65536) > 0) {
+      const bench_clock::time_point fetched = bench_clock::now();
+      fetch_seconds += std::chrono::duration<double>(fetched - started).count();
+      sum += sqlite::kernels::sum<0>(batch);
+      mn = std::min(mn, sqlite::kernels::min_max<1>(batch).min);
+      below += sqlite::kernels::count_where<0>(batch, sqlite::kernels::compare_op::less, int64_t(50000));
+      started = bench_clock::now();
+      kernel_seconds += std::chrono::duration<double>(started - fetched).count();
+    }
+    report("column_kernels", "fetch_columns", fetch_seconds, double(n_rows), "rows");
+#if defined(SQLITE_HPP_HAS_AVX2)
+    report("column_kernels", "kernels (AVX2)", kernel_seconds, double(n_rows), "rows");
+#else
+    report("column_kernels", "kernels (scalar)", kernel_seconds, double(n_rows), "rows");
+#endif
+    if ((sum != sql_sum) || (int64_t(below) != aggregates.get<int64_t>(3))) std::printf("unexpected results\n");
+  }
+
+  // Full scan with a consumer that spends about as long on each row as SQLite does,
+  // stepping synchronously and with a prefetching producer thread
+  void prefetch() {
+    const int64_t n_rows = 500000;
+    sqlite::database::type_ptr db(new sqlite::database::type("bench_prefetch.db"));
+    execute(db, "DROP TABLE IF EXISTS `bench`");
+    execute(db, "CREATE TABLE `bench` (`id` INTEGER PRIMARY KEY, `payload` TEXT)");
+    execute(db, "WITH RECURSIVE `r`(`n`) AS (SELECT 1 UNION ALL SELECT `n` + 1 FROM `r` WHERE `n` < " +
+            std::to_string(n_rows) + ") INSERT INTO `bench` SELECT `n`, printf('%0100d', `n`) FROM `r`");
+
+    auto consume = [] (const std::tuple<int64_t, std::string>& row) {
+      uint64_t h = uint64_t(std::get<0>(row));
+      for (int round = 0; round < 8; ++round) {
+        for (char c : std::get<1>(row)) h = (h ^ uint8_t(c)) * 1099511628211ull;
+      }
+      return h;
+    };
+
+    uint64_t checksum = 0;
+    bench_clock::time_point started = bench_clock::now();
+    sqlite::input_query<int64_t, std::string> select(db, "SELECT `id`, `payload` FROM `bench`");
+    for (const auto& row : select.row_buffer()) checksum += consume(row);
+    report("prefetch", "input_query", seconds_since(started), double(n_rows), "rows");
+
+    started = bench_clock::now();
+    sqlite::prefetch_query<int64_t, std::string> prefetched(db, "SELECT `id`, `payload` FROM `bench`");
+    for (const auto& row : prefetched) checksum -= consume(row);
+    report("prefetch", "prefetch_query", seconds_since(started), double(n_rows), "rows");
+    const sqlite::prefetch_stats stats = prefetched.stats();
+    std::printf("%-24s producer stalls %llu, consumer stalls %llu\n", "",
+                (unsigned long long)stats.producer_stalls, (unsigned long long)stats.consumer_stalls);
+    if (checksum != 0) std::printf("unexpected checksum\n");
+  }
+
+  // Sum over a file-backed table with one input_query and with parallel_scan
+  void parallel_scan() {
+    const int64_t n_rows = 2000000;
+    const std::string filename = "bench_parallel_scan.db";
+    {
+      sqlite::database::type_ptr db(new sqlite::database::type(filename));
+      execute(db, "DROP TABLE IF EXISTS `bench`");
+      execute(db, "CREATE TABLE `bench` (`id` INTEGER PRIMARY KEY, `v` INTEGER, `d` REAL)");
+      execute(db, "WITH RECURSIVE `r`(`n`) AS (SELECT 1 UNION ALL SELECT `n` + 1 FROM `r` WHERE `n` < " +
+              std::to_string(n_rows) + ") INSERT INTO `bench` SELECT `n`, `n` % 1000, `n` / 7.0 FROM `r`");
+    }
+
+    sqlite::database::type_ptr db(new sqlite::database::type(filename));
+    bench_clock::time_point started = bench_clock::now();
+    int64_t single = 0;
+    sqlite::input_query<int64_t, double> select(db, "SELECT `v`, `d` FROM `bench`");
+    for (const auto& row : select.row_buffer()) single += std::get<0>(row);
+    report("parallel_scan", "input_query", seconds_since(started), double(n_rows), "rows");
+
+    for (unsigned threads : {1u, 2u, 4u}) {
+      sqlite::parallel_scan_config cfg;
+      cfg.threads = threads;
+      sqlite::parallel_scan<int64_t, double> scan(filename, "bench", std::vector<std::string>{"v", "d"}, "", cfg);
+      started = bench_clock::now();
+      const int64_t sum = scan.reduce_batches(int64_t(0),
+                                              [] (int64_t& s, const decltype(scan)::column_batch_type& batch) {
+                                                s += sqlite::kernels::sum<0>(batch);
+                                              },
+                                              [] (int64_t& s, const int64_t partial) { s += partial; });
+      report("parallel_scan", std::to_string(threads) + " threads", seconds_since(started), double(n_rows), "rows");
+      if (sum != single) std::printf("unexpected sum\n");
+    }
+  }
+
+  // Point lookups by a secondary key: SQL through a b-tree index against hash_index::find()
+  void hash_index_lookups() {
+    const int64_t n_rows = 200000;
+    const int n_lookups = 1000000;
+    sqlite::database::type_ptr db(new sqlite::database::type(":memory:"));
+    execute(db, "CREATE TABLE `bench` (`id` INTEGER PRIMARY KEY, `email` TEXT)");
+    execute(db, "WITH RECURSIVE `r`(`n`) AS (SELECT 1 UNION ALL SELECT `n` + 1 FROM `r` WHERE `n` < " +
+            std::to_string(n_rows) + ") INSERT INTO `bench` SELECT `n`, 'user' || `n` || '@example.com' FROM `r`");
+    execute(db, "CREATE INDEX `bench_email` ON `bench` (`email`)");
+    std::vector<std::string> keys;
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int64_t> pick(1, n_rows);
+    for (int i = 0; i < n_lookups; ++i) keys.push_back("user" + std::to_string(pick(random)) + "@example.com");
+
+    int64_t found_sql = 0;
+    sqlite::query select(db, "SELECT `id` FROM `bench` WHERE `email` = ?");
+    bench_clock::time_point started = bench_clock::now();
+    for (const auto& k : keys) {
+      select.bind(1, k);
+      select.step();
+      if (select.result_code() == SQLITE_ROW) found_sql += select.get<int64_t>(0);
+      sqlite3_reset(select.statement().get());
+    }
+    report("hash_index", "indexed select", seconds_since(started), double(n_lookups), "lookups");
+
+    int64_t found_hash = 0;
+    sqlite::hash_index<std::string> index(db, "bench", "email");
+    started = bench_clock::now();
+    for (const auto& k : keys) {
+      int64_t rowid = 0;
+      if (index.find(k, rowid)) found_hash += rowid;
+    }
+    report("hash_index", "find", seconds_since(started), double(n_lookups), "lookups");
+    if (found_sql != found_hash) std::printf("unexpected lookups\n");
+  }
+
+  // Reading COUNT(*) and SUM() per group: the GROUP BY query against materialized_aggregate
+  void materialized_aggregate() {
+    const int64_t n_rows = 500000;
+    const int n_reads = 20;
+    sqlite::database::type_ptr db(new sqlite::database::type(":memory:"));
+    execute(db, "CREATE TABLE `bench` (`id` INTEGER PRIMARY KEY, `g` INTEGER, `x` INTEGER)");
+    execute(db, "WITH RECURSIVE `r`(`n`) AS (SELECT 1 UNION ALL SELECT `n` + 1 FROM `r` WHERE `n` < " +
+            std::to_string(n_rows) + ") INSERT INTO `bench` SELECT `n`, `n` % 100, `n` FROM `r`");
+
+    int64_t sum_query = 0;
+    bench_clock::time_point started = bench_clock::now();
+    for (int i = 0; i < n_reads; ++i) {
+      sqlite::query select(db, "SELECT `g`, COUNT(*), SUM(`x`) FROM `bench` GROUP BY `g`");
+      for (select.step(); select.result_code() == SQLITE_ROW; select.step()) sum_query += select.get<int64_t>(2);
+      execute(db, "INSERT INTO `bench` (`g`, `x`) VALUES (1, 1)");
+    }
+    report("materialized_aggregate", "GROUP BY", seconds_since(started), double(n_reads), "reads");
+
+    sqlite::materialized_aggregate<int64_t, int64_t> aggregate(db, "bench", "g", "x");
+    int64_t sum_aggregate = 0;
+    started = bench_clock::now();
+    for (int i = 0; i < n_reads; ++i) {
+      for (const auto& g : aggregate.groups()) sum_aggregate += g.second.sum;
+      execute(db, "INSERT INTO `bench` (`g`, `x`) VALUES (1, 1)");
+      aggregate.refresh();
+    }
+    report("materialized_aggregate", "groups()", seconds_since(started), double(n_reads), "reads");
+    // Both loops add a row with x = 1 after every read; the second one starts n_reads rows later
+    if (sum_aggregate - sum_query != int64_t(n_reads) * n_reads) std::printf("unexpected sums\n");
+  }
+
+  struct benchmark {
+    std::string name;
+    std::function<void()> fn;
+  };
+}
+
+int main(int argc, char** argv) {
+  const std::vector<benchmark> benchmarks{
+    {"page_cache", page_cache_multithreaded_reads},
+    {"wide_row_decode", wide_row_decode},
+    {"column_kernels", column_kernels},
+    {"prefetch", prefetch},
+    {"parallel_scan", parallel_scan},
+    {"hash_index", hash_index_lookups},
+    {"materialized_aggregate", materialized_aggregate}
+  };
+  for (const auto& b : benchmarks) {
+    bool selected = argc < 2;
+    for (int i = 1; i < argc; ++i) {
+      if (b.name == argv[i]) selected = true;
+    }
+    if (selected) b.fn();
+  }
+  return 0;
+}
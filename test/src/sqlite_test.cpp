@@ -6,12 +6,16 @@
 #include <sqlite_buffered>
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <future>
 #include <iostream>
 #include <sstream>
 #include <random>
 #include <limits>
 #include <map>
+#include <set>
+#include <thread>
 
 TEST(SqliteTest, OpenDb) {
   sqlite::database db("test.db");
@@ -244,3 +248,1577 @@ TEST(SqliteTest, BufferedInsertSelect) {
   }
   ASSERT_EQ(data_to_id.size(), 1000);
 }
+
+TEST(SqliteTest, BusyHandler) {
+  sqlite::database::type_ptr writer(new sqlite::database::type("test.db"));
+  sqlite::database::type_ptr contender(new sqlite::database::type("test.db"));
+  ASSERT_EQ(SQLITE_OK, writer->result_code());
+  ASSERT_EQ(SQLITE_OK, contender->result_code());
+  sqlite::busy_handler::config cfg;
+  cfg.initial_delay = std::chrono::microseconds(100);
+  cfg.max_delay = std::chrono::microseconds(5000);
+  cfg.deadline = std::chrono::microseconds(50000);
+  {
+    // The handler stays with the shared connection when the copy that installed it goes away
+    sqlite::database copy(*contender);
+    ASSERT_EQ(SQLITE_OK, copy.install_busy_handler(cfg));
+  }
+
+  sqlite::query drop_table(writer, "DROP TABLE IF EXISTS `test_table`");
+  drop_table.step();
+  sqlite::query create_table(writer, "CREATE TABLE `test_table` (`data` INTEGER)");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+
+  // Hold the write lock longer than the contender's deadline
+  sqlite::query begin(writer, "BEGIN IMMEDIATE");
+  begin.step();
+  ASSERT_EQ(SQLITE_DONE, begin.result_code());
+  sqlite::query insert(contender, "INSERT INTO `test_table` (`data`) VALUES (1)");
+  insert.step();
+  ASSERT_EQ(SQLITE_BUSY, insert.result_code());
+  auto stats = contender->busy_stats();
+  ASSERT_EQ(1, stats.busy_events);
+  ASSERT_EQ(1, stats.give_ups);
+  ASSERT_GT(stats.retries, 0);
+  ASSERT_GT(stats.wait_us, 0);
+
+  // Release the lock while the contender is backing off
+  cfg.deadline = std::chrono::microseconds(10000000);
+  ASSERT_EQ(SQLITE_OK, contender->install_busy_handler(cfg));
+  std::thread releaser([writer] () {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      sqlite::query commit(writer, "COMMIT");
+      commit.step();
+    });
+  sqlite::query retry(contender, "INSERT INTO `test_table` (`data`) VALUES (1)");
+  retry.step();
+  releaser.join();
+  ASSERT_EQ(SQLITE_DONE, retry.result_code());
+  stats = contender->busy_stats();
+  ASSERT_EQ(1, stats.busy_events);
+  ASSERT_EQ(0, stats.give_ups);
+
+  // Connections sharing a handler keep their own busy episodes: a later episode on another
+  // connection does not push back the deadline of the first
+  cfg.initial_delay = std::chrono::microseconds(0);
+  cfg.deadline = std::chrono::microseconds(20000);
+  sqlite::busy_handler::type_ptr shared = std::make_shared<sqlite::busy_handler>(cfg);
+  sqlite::busy_handler::binding first{shared, {}};
+  sqlite::busy_handler::binding second{shared, {}};
+  ASSERT_EQ(1, sqlite::busy_handler::callback(&first, 0));
+  std::this_thread::sleep_for(std::chrono::milliseconds(25));
+  ASSERT_EQ(1, sqlite::busy_handler::callback(&second, 0));
+  ASSERT_EQ(0, sqlite::busy_handler::callback(&first, 1));
+  ASSERT_EQ(1, sqlite::busy_handler::callback(&second, 1));
+}
+
+TEST(SqliteTest, Backup) {
+  sqlite::database::type_ptr source(new sqlite::database::type("test.db"));
+  ASSERT_EQ(SQLITE_OK, source->result_code());
+  sqlite::query drop_table(source, "DROP TABLE IF EXISTS `test_table`");
+  drop_table.step();
+  sqlite::query create_table(source, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `blob_field` BLOB)");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+  typedef sqlite::buffered::insert_query<int64_t, std::vector<uint8_t>> insert_type;
+  {
+    insert_type insert(source, "test_table", std::vector<std::string>{"id", "blob_field"});
+    for (int64_t i = 0; i < 2000; ++i) {
+      insert.push_back(std::make_tuple(i, std::vector<uint8_t>(512, uint8_t(i))));
+    }
+    insert.flush();
+    ASSERT_EQ(SQLITE_DONE, insert.result_code());
+  }
+
+  sqlite::database::type_ptr destination(new sqlite::database::type("test_backup.db"));
+  ASSERT_EQ(SQLITE_OK, destination->result_code());
+  int progress_calls = 0;
+  {
+    sqlite::backup b(destination, source);
+    ASSERT_EQ(SQLITE_OK, b.result_code());
+    sqlite::backup::config cfg;
+    cfg.pages_per_step = 16;
+    cfg.pages_per_second = 100000;
+    cfg.on_progress = [&progress_calls] (int, int) { ++progress_calls; };
+    b.start(cfg);
+    // The source stays writable while the backup is running. A backup step holds a read lock,
+    // so the writer may have to wait for it.
+    source->install_busy_handler();
+    sqlite::query insert(source, "INSERT INTO `test_table` (`id`, `blob_field`) VALUES (2000, x'00')");
+    insert.step();
+    ASSERT_EQ(SQLITE_DONE, insert.result_code());
+    ASSERT_EQ(SQLITE_DONE, b.wait());
+    ASSERT_TRUE(b.done());
+    ASSERT_EQ(0, b.remaining());
+    ASSERT_GT(b.page_count(), 16);
+    ASSERT_EQ(1.0, b.progress());
+    ASSERT_EQ(SQLITE_OK, b.finish());
+  }
+  ASSERT_GT(progress_calls, 1);
+  sqlite::query count(destination, "SELECT COUNT(*) FROM `test_table`");
+  count.step();
+  ASSERT_EQ(SQLITE_ROW, count.result_code());
+  ASSERT_EQ(2001, count.get<int64_t>(0));
+
+  // A source that stays locked ends the copy with the last busy code. Without a busy handler on
+  // the source each step returns SQLITE_BUSY at once, so only busy_timeout bounds the wait.
+  ASSERT_EQ(SQLITE_OK, source->remove_busy_handler());
+  sqlite::database::type_ptr locker(new sqlite::database::type("test.db"));
+  sqlite::query lock(locker, "BEGIN EXCLUSIVE");
+  lock.step();
+  ASSERT_EQ(SQLITE_DONE, lock.result_code());
+  {
+    sqlite::database::type_ptr memory(new sqlite::database::type(":memory:"));
+    sqlite::backup b(memory, source);
+    sqlite::backup::config cfg;
+    cfg.busy_backoff = std::chrono::milliseconds(1);
+    cfg.busy_timeout = std::chrono::milliseconds(20);
+    const auto started = std::chrono::steady_clock::now();
+    b.start(cfg);
+    ASSERT_EQ(SQLITE_BUSY, b.wait());
+    ASSERT_GT(std::chrono::milliseconds(1000), std::chrono::steady_clock::now() - started);
+    ASSERT_FALSE(b.done());
+  }
+  sqlite::query rollback(locker, "ROLLBACK");
+  rollback.step();
+}
+
+#if defined(SQLITE_HPP_HAS_SERIALIZE)
+TEST(SqliteTest, SerializeDeserialize) {
+  sqlite::database::type_ptr db(new sqlite::database::type("test.db"));
+  ASSERT_EQ(SQLITE_OK, db->result_code());
+  sqlite::query drop_table(db, "DROP TABLE IF EXISTS `test_table`");
+  drop_table.step();
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`data` INTEGER)");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+  sqlite::query insert(db, "INSERT INTO `test_table` (`data`) VALUES (1), (2), (3)");
+  insert.step();
+  ASSERT_EQ(SQLITE_DONE, insert.result_code());
+
+  std::vector<uint8_t> image;
+  ASSERT_EQ(SQLITE_OK, db->serialize(image));
+  ASSERT_GT(image.size(), 0);
+
+  // Zero-copy, read-only snapshot
+  sqlite::database::type_ptr snapshot(new sqlite::database::type(":memory:"));
+  ASSERT_EQ(SQLITE_OK, snapshot->deserialize(image.data(), image.size()));
+  sqlite::query sum(snapshot, "SELECT SUM(`data`) FROM `test_table`");
+  sum.step();
+  ASSERT_EQ(SQLITE_ROW, sum.result_code());
+  ASSERT_EQ(6, sum.get<int64_t>(0));
+  sqlite::query write(snapshot, "INSERT INTO `test_table` (`data`) VALUES (4)");
+  write.step();
+  ASSERT_NE(SQLITE_DONE, write.result_code());
+  ASSERT_EQ(SQLITE_READONLY, sqlite3_reset(write.statement().get()));
+
+  // Writable copy, whose image can be read back without copying
+  sqlite::database::type_ptr copy(new sqlite::database::type(":memory:"));
+  ASSERT_EQ(SQLITE_OK, copy->deserialize(image));
+  sqlite::query copy_write(copy, "INSERT INTO `test_table` (`data`) VALUES (4)");
+  copy_write.step();
+  ASSERT_EQ(SQLITE_DONE, copy_write.result_code());
+  size_t size = 0;
+  ASSERT_NE(nullptr, copy->serialize_nocopy(size));
+  ASSERT_EQ(image.size(), size);
+
+  // An empty image gives an empty, writable database
+  sqlite::database::type_ptr empty(new sqlite::database::type(":memory:"));
+  ASSERT_EQ(SQLITE_OK, empty->deserialize(std::vector<uint8_t>()));
+  sqlite::query empty_create(empty, "CREATE TABLE `test_table` (`data` INTEGER)");
+  empty_create.step();
+  ASSERT_EQ(SQLITE_DONE, empty_create.result_code());
+}
+#endif
+
+TEST(SqliteTest, PageCache) {
+  // The page cache can only be replaced while SQLite is not initialized
+  ASSERT_EQ(SQLITE_OK, sqlite3_shutdown());
+  sqlite::page_cache::config cfg;
+  cfg.slots_per_slab = 16;
+  ASSERT_EQ(SQLITE_OK, sqlite::page_cache::install(cfg));
+  ASSERT_TRUE(sqlite::page_cache::installed());
+  {
+    sqlite::database::type_ptr db(new sqlite::database::type("test.db"));
+    ASSERT_EQ(SQLITE_OK, db->result_code());
+    sqlite::query cache_size(db, "PRAGMA cache_size = 8");
+    cache_size.step();
+    sqlite::query drop_table(db, "DROP TABLE IF EXISTS `test_table`");
+    drop_table.step();
+    sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `blob_field` BLOB)");
+    create_table.step();
+    ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+    {
+      typedef sqlite::buffered::insert_query<int64_t, std::vector<uint8_t>> insert_type;
+      insert_type insert(db, "test_table", std::vector<std::string>{"id", "blob_field"});
+      for (int64_t i = 0; i < 1000; ++i) {
+        insert.push_back(std::make_tuple(i, std::vector<uint8_t>(256, uint8_t(i))));
+      }
+      insert.flush();
+      ASSERT_EQ(SQLITE_DONE, insert.result_code());
+    }
+    typedef sqlite::input_query<int64_t, std::vector<uint8_t>> select_type;
+    for (int pass = 0; pass < 2; ++pass) {
+      select_type select(db, "SELECT `id`, `blob_field` FROM `test_table` ORDER BY `id`");
+      int64_t expected_id = 0;
+      for (auto row : select) {
+        ASSERT_EQ(expected_id, std::get<0>(row));
+        ASSERT_EQ(std::vector<uint8_t>(256, uint8_t(expected_id)), std::get<1>(row));
+        ++expected_id;
+      }
+      ASSERT_EQ(1000, expected_id);
+    }
+    auto stats = sqlite::page_cache::stats();
+    ASSERT_GT(stats.hits, 0);
+    ASSERT_GT(stats.misses, 0);
+    ASSERT_GT(stats.evictions, 0);
+    ASSERT_GT(stats.pages, 0);
+    ASSERT_GT(stats.arena_bytes, 0);
+  }
+  ASSERT_EQ(0, sqlite::page_cache::stats().pages);
+  ASSERT_EQ(SQLITE_OK, sqlite3_shutdown());
+  ASSERT_EQ(SQLITE_OK, sqlite::page_cache::uninstall());
+  ASSERT_FALSE(sqlite::page_cache::installed());
+}
+
+TEST(SqliteTest, MemoryAccounting) {
+  // The allocator can only be replaced while SQLite is not initialized
+  ASSERT_EQ(SQLITE_OK, sqlite3_shutdown());
+  ASSERT_EQ(SQLITE_OK, sqlite::memory::install());
+  ASSERT_TRUE(sqlite::memory::installed());
+  const size_t statements = size_t(sqlite::memory_category::statements);
+  const size_t buffers = size_t(sqlite::memory_category::buffers);
+  const int64_t buffers_before = sqlite::memory::stats().bytes[buffers];
+  {
+    sqlite::database::type_ptr db(new sqlite::database::type("test.db"));
+    ASSERT_EQ(SQLITE_OK, db->result_code());
+    sqlite::query drop_table(db, "DROP TABLE IF EXISTS `test_table`");
+    drop_table.step();
+    sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `data` TEXT)");
+    create_table.step();
+    ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+    ASSERT_GT(sqlite::memory::stats().bytes[statements], 0);
+    {
+      typedef sqlite::buffered::insert_query<int64_t, std::string> insert_type;
+      insert_type insert(db, "test_table", std::vector<std::string>{"id", "data"});
+      for (int64_t i = 0; i < 100; ++i) {
+        insert.push_back(std::make_tuple(i, std::to_string(i)));
+      }
+      // Pending records are accounted for as library buffers
+      ASSERT_GE(sqlite::memory::stats().bytes[buffers] - buffers_before,
+                int64_t(100 * sizeof(std::tuple<int64_t, std::string>)));
+      insert.flush();
+      ASSERT_EQ(SQLITE_DONE, insert.result_code());
+    }
+    ASSERT_EQ(buffers_before, sqlite::memory::stats().bytes[buffers]);
+    auto stats = sqlite::memory::stats();
+    ASSERT_GT(stats.sqlite_allocations, 0);
+    ASSERT_GT(stats.pool_allocations, 0);
+    ASSERT_LT(stats.system_allocations, stats.sqlite_allocations);
+    ASSERT_GT(stats.peak_bytes[statements], 0);
+    ASSERT_GT(stats.total_bytes(), 0);
+  }
+  ASSERT_EQ(SQLITE_OK, sqlite3_shutdown());
+  ASSERT_EQ(0, sqlite::memory::stats().bytes[statements]);
+  ASSERT_EQ(SQLITE_OK, sqlite::memory::uninstall());
+  ASSERT_FALSE(sqlite::memory::installed());
+}
+
+TEST(SqliteTest, StaticBinding) {
+  sqlite::database::type_ptr db(new sqlite::database::type("test.db"));
+  ASSERT_EQ(SQLITE_OK, db->result_code());
+  sqlite::query drop_table(db, "DROP TABLE IF EXISTS `test_table`");
+  drop_table.step();
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`str_field` TEXT, `blob_field` BLOB)");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+
+  // The bound memory has to outlive the step when binding with bind_static()
+  const std::string text("text\0with nul", 13);
+  const std::vector<uint8_t> blob{1, 2, 3};
+  const char* chars = "chars and more";
+  sqlite::query insert(db, "INSERT INTO `test_table` (`str_field`, `blob_field`) VALUES (?, ?)");
+  insert.bind_static(1, text);
+  insert.bind_static(2, blob);
+  insert.step();
+  ASSERT_EQ(SQLITE_DONE, insert.result_code());
+  sqlite::query insert_views(db, "INSERT INTO `test_table` (`str_field`, `blob_field`) VALUES (?, ?)");
+  insert_views.bind_static(1, std::make_pair(chars, size_t(5)));
+  insert_views.bind_static(2, sqlite::blob_view(blob.data(), 2));
+  insert_views.step();
+  ASSERT_EQ(SQLITE_DONE, insert_views.result_code());
+  sqlite::query insert_copy(db, "INSERT INTO `test_table` (`str_field`, `blob_field`) VALUES (?, ?)");
+  insert_copy.bind(1, sqlite::text_view(text));
+  insert_copy.bind_static(2, int64_t(7));
+  insert_copy.step();
+  ASSERT_EQ(SQLITE_DONE, insert_copy.result_code());
+
+  typedef sqlite::input_query<std::string, std::vector<uint8_t>> select_type;
+  select_type select(db, "SELECT `str_field`, `blob_field` FROM `test_table` ORDER BY `rowid`");
+  std::vector<std::tuple<std::string, std::vector<uint8_t>>> rows(select.begin(), select.end());
+  ASSERT_EQ(3, rows.size());
+  ASSERT_EQ(text, std::get<0>(rows[0]));
+  ASSERT_EQ(blob, std::get<1>(rows[0]));
+  ASSERT_EQ("chars", std::get<0>(rows[1]));
+  ASSERT_EQ(std::vector<uint8_t>({1, 2}), std::get<1>(rows[1]));
+  ASSERT_EQ(text, std::get<0>(rows[2]));
+  ASSERT_EQ(std::vector<uint8_t>({'7'}), std::get<1>(rows[2]));
+}
+
+TEST(SqliteTest, ColumnViews) {
+  sqlite::database::type_ptr db(new sqlite::database::type("test.db"));
+  ASSERT_EQ(SQLITE_OK, db->result_code());
+  sqlite::query drop_table(db, "DROP TABLE IF EXISTS `test_table`");
+  drop_table.step();
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `str_field` TEXT, `blob_field` BLOB)");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+  {
+    typedef sqlite::buffered::insert_query<int64_t, std::string, std::vector<uint8_t>> insert_type;
+    insert_type insert(db, "test_table", std::vector<std::string>{"id", "str_field", "blob_field"});
+    for (int64_t i = 0; i < 100; ++i) {
+      insert.push_back(std::make_tuple(i, std::to_string(i), std::vector<uint8_t>(size_t(i), uint8_t(i))));
+    }
+  }
+  sqlite::query null_insert(db, "INSERT INTO `test_table` (`id`, `str_field`, `blob_field`) VALUES (100, NULL, NULL)");
+  null_insert.step();
+  ASSERT_EQ(SQLITE_DONE, null_insert.result_code());
+
+  typedef sqlite::input_query<int64_t, sqlite::text_view, sqlite::blob_view> select_type;
+  select_type select(db, "SELECT `id`, `str_field`, `blob_field` FROM `test_table` ORDER BY `id`");
+  int64_t n = 0;
+  for (auto row : select) {
+    const int64_t i = std::get<0>(row);
+    ASSERT_EQ(n, i);
+    if (i < 100) {
+      const std::string expected_text(std::to_string(i));
+      const std::vector<uint8_t> expected_blob(static_cast<size_t>(i), static_cast<uint8_t>(i));
+      ASSERT_EQ(sqlite::text_view(expected_text), std::get<1>(row));
+      ASSERT_EQ(sqlite::blob_view(expected_blob), std::get<2>(row));
+    } else {
+      ASSERT_TRUE(std::get<1>(row).empty());
+      ASSERT_TRUE(std::get<2>(row).empty());
+    }
+    ++n;
+  }
+  ASSERT_EQ(101, n);
+}
+
+TEST(SqliteTest, RowBufferIteration) {
+  sqlite::database::type_ptr db(new sqlite::database::type("test.db"));
+  ASSERT_EQ(SQLITE_OK, db->result_code());
+  sqlite::query drop_table(db, "DROP TABLE IF EXISTS `test_table`");
+  drop_table.step();
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `str_field` TEXT, `blob_field` BLOB)");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+  {
+    typedef sqlite::buffered::insert_query<int64_t, std::string, std::vector<uint8_t>> insert_type;
+    insert_type insert(db, "test_table", std::vector<std::string>{"id", "str_field", "blob_field"});
+    // Longest values first, so that later rows fit into the capacity of the first one
+    for (int64_t i = 0; i < 100; ++i) {
+      insert.push_back(std::make_tuple(i, std::string(size_t(200 - i), 'x'), std::vector<uint8_t>(size_t(200 - i), uint8_t(i))));
+    }
+  }
+
+  typedef sqlite::input_query<int64_t, std::string, std::vector<uint8_t>> select_type;
+  select_type select(db, "SELECT `id`, `str_field`, `blob_field` FROM `test_table` ORDER BY `id`");
+  const char* text_buffer = nullptr;
+  const uint8_t* blob_buffer = nullptr;
+  int64_t n = 0;
+  for (const auto& row : select.row_buffer()) {
+    ASSERT_EQ(n, std::get<0>(row));
+    ASSERT_EQ(std::string(size_t(200 - n), 'x'), std::get<1>(row));
+    ASSERT_EQ(std::vector<uint8_t>(size_t(200 - n), uint8_t(n)), std::get<2>(row));
+    if (n == 0) {
+      text_buffer = std::get<1>(row).data();
+      blob_buffer = std::get<2>(row).data();
+    } else {
+      // No reallocation after the first row
+      ASSERT_EQ(text_buffer, std::get<1>(row).data());
+      ASSERT_EQ(blob_buffer, std::get<2>(row).data());
+    }
+    ++n;
+  }
+  ASSERT_EQ(100, n);
+  ASSERT_EQ(SQLITE_DONE, select.result_code());
+
+  select_type empty(db, "SELECT `id`, `str_field`, `blob_field` FROM `test_table` WHERE `id` < 0");
+  auto rows = empty.row_buffer();
+  ASSERT_TRUE(rows.begin() == rows.end());
+}
+
+struct mapped_record {
+  int64_t id;
+  std::string name;
+  double score;
+  std::vector<uint8_t> data;
+};
+
+namespace sqlite {
+  template <>
+  struct record_mapping<mapped_record> :
+    record_fields<SQLITE_HPP_FIELD(mapped_record, id), SQLITE_HPP_FIELD(mapped_record, name),
+                  SQLITE_HPP_FIELD(mapped_record, score), SQLITE_HPP_FIELD(mapped_record, data)> {
+  };
+}
+
+TEST(SqliteTest, MappedStruct) {
+  sqlite::database::type_ptr db(new sqlite::database::type("test.db"));
+  ASSERT_EQ(SQLITE_OK, db->result_code());
+  sqlite::query drop_table(db, "DROP TABLE IF EXISTS `test_table`");
+  drop_table.step();
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `name` TEXT, `score` REAL, `data` BLOB)");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+
+  std::vector<mapped_record> records;
+  for (int64_t i = 0; i < 100; ++i) {
+    records.push_back(mapped_record{i, "name " + std::to_string(i), double(i) / 4, std::vector<uint8_t>(size_t(i % 7), uint8_t(i))});
+  }
+  {
+    sqlite::buffered::insert_query<mapped_record> insert(db, "test_table", std::vector<std::string>{"id", "name", "score", "data"});
+    for (const auto& r : records) insert.push_back(r);
+  }
+
+  typedef sqlite::input_query<mapped_record> select_type;
+  static_assert(std::is_same<mapped_record, select_type::iterator::record_tuple_type>::value, "Mapped struct should be the record type");
+  select_type select(db, "SELECT `id`, `name`, `score`, `data` FROM `test_table` ORDER BY `id`");
+  size_t n = 0;
+  for (const mapped_record& r : select) {
+    ASSERT_EQ(records[n].id, r.id);
+    ASSERT_EQ(records[n].name, r.name);
+    ASSERT_EQ(records[n].score, r.score);
+    ASSERT_EQ(records[n].data, r.data);
+    ++n;
+  }
+  ASSERT_EQ(records.size(), n);
+
+  select_type reused(db, "SELECT `id`, `name`, `score`, `data` FROM `test_table` ORDER BY `id`");
+  n = 0;
+  for (const mapped_record& r : reused.row_buffer()) {
+    ASSERT_EQ(records[n].name, r.name);
+    ASSERT_EQ(records[n].data, r.data);
+    ++n;
+  }
+  ASSERT_EQ(records.size(), n);
+
+  sqlite::query update(db, "UPDATE `test_table` SET `id` = ?, `name` = ?, `score` = ?, `data` = ? WHERE `id` = 0");
+  update.bind_record(1, mapped_record{1000, "updated", 0.5, {1, 2}});
+  update.step();
+  ASSERT_EQ(SQLITE_DONE, update.result_code());
+  sqlite::query check(db, "SELECT `id`, `name`, `score`, `data` FROM `test_table` WHERE `id` = 1000");
+  check.step();
+  ASSERT_EQ(SQLITE_ROW, check.result_code());
+  mapped_record updated;
+  check.get_record(updated);
+  ASSERT_EQ("updated", updated.name);
+  ASSERT_EQ(0.5, updated.score);
+  ASSERT_EQ(std::vector<uint8_t>({1, 2}), updated.data);
+}
+
+TEST(SqliteTest, ColumnarFetch) {
+  sqlite::database::type_ptr db(new sqlite::database::type("test.db"));
+  ASSERT_EQ(SQLITE_OK, db->result_code());
+  sqlite::query drop_table(db, "DROP TABLE IF EXISTS `test_table`");
+  drop_table.step();
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `value` REAL, `str_field` TEXT)");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+  {
+    sqlite::query begin(db, "BEGIN");
+    begin.step();
+    sqlite::query insert(db, "INSERT INTO `test_table` (`id`, `value`, `str_field`) VALUES (?, ?, ?)");
+    for (int64_t i = 0; i < 1000; ++i) {
+      insert.bind(1, i);
+      // Every tenth value is NULL
+      if (i % 10 == 0) {
+        sqlite3_bind_null(insert.statement().get(), 2);
+      } else {
+        insert.bind(2, double(i) / 2);
+      }
+      insert.bind(3, std::to_string(i));
+      insert.step();
+      ASSERT_EQ(SQLITE_DONE, insert.result_code());
+      sqlite3_reset(insert.statement().get());
+    }
+    sqlite::query commit(db, "COMMIT");
+    commit.step();
+  }
+
+  typedef sqlite::input_query<int64_t, double, std::string> select_type;
+  select_type select(db, "SELECT `id`, `value`, `str_field` FROM `test_table` ORDER BY `id`");
+  select_type::column_batch_type batch;
+  int64_t n = 0;
+  size_t n_batches = 0;
+  while (select.fetch_columns(batch, 300) > 0) {
+    ++n_batches;
+    const std::vector<int64_t>& ids = batch.get<0>();
+    const std::vector<double>& values = batch.get<1>();
+    const std::vector<std::string>& strings = batch.get<2>();
+    ASSERT_EQ(batch.size(), ids.size());
+    ASSERT_EQ(batch.size(), values.size());
+    ASSERT_EQ(batch.size(), strings.size());
+    ASSERT_EQ((batch.size() + 63) / 64, batch.validity(1).size());
+    ASSERT_EQ(0, batch.null_count(0));
+    size_t nulls = 0;
+    for (size_t r = 0; r < batch.size(); ++r, ++n) {
+      ASSERT_EQ(n, ids[r]);
+      ASSERT_EQ(std::to_string(n), strings[r]);
+      ASSERT_TRUE(batch.is_valid(0, r));
+      if (n % 10 == 0) {
+        ASSERT_FALSE(batch.is_valid(1, r));
+        ASSERT_EQ(0, values[r]);
+        ++nulls;
+      } else {
+        ASSERT_TRUE(batch.is_valid(1, r));
+        ASSERT_EQ(double(n) / 2, values[r]);
+      }
+    }
+    ASSERT_EQ(nulls, batch.null_count(1));
+  }
+  ASSERT_EQ(1000, n);
+  ASSERT_EQ(4, n_batches);
+  ASSERT_EQ(SQLITE_DONE, select.result_code());
+  // A finished query stays finished
+  ASSERT_TRUE(select.fetch_columns(300).empty());
+  // So does a failed one: the integer overflow fails the fourth row
+  select_type failing(db, "SELECT CASE WHEN `id` < 3 THEN `id` ELSE abs(-9223372036854775807 - 1) END, "
+                      "`value`, `str_field` FROM `test_table` ORDER BY `id`");
+  ASSERT_EQ(3, failing.fetch_columns(batch, 10));
+  ASSERT_EQ(SQLITE_ERROR, failing.result_code());
+  ASSERT_EQ(0, failing.fetch_columns(batch, 10));
+  ASSERT_EQ(SQLITE_ERROR, failing.result_code());
+
+  sqlite::input_query<mapped_record> mapped(db, "SELECT `id`, `str_field`, `value`, NULL FROM `test_table` WHERE `id` < 5");
+  auto mapped_batch = mapped.fetch_columns(10);
+  ASSERT_EQ(5, mapped_batch.size());
+  ASSERT_EQ("4", mapped_batch.get<1>()[4]);
+  ASSERT_EQ(1, mapped_batch.null_count(2));
+  ASSERT_EQ(5, mapped_batch.null_count(3));
+}
+
+TEST(SqliteTest, ColumnKernels) {
+  using sqlite::kernels::compare_op;
+  std::default_random_engine re(7);
+  std::uniform_int_distribution<int64_t> uniform(-1000, 1000);
+  // Lengths around the 4-lane and 64-row block boundaries
+  for (size_t n : {0, 1, 3, 4, 63, 64, 65, 200, 1027}) {
+    for (int null_pattern = 0; null_pattern < 3; ++null_pattern) {
+      std::vector<int64_t> ints(n);
+      std::vector<double> doubles(n);
+      std::vector<uint64_t> validity((n + 63) / 64, 0);
+      for (size_t i = 0; i < n; ++i) {
+        ints[i] = uniform(re);
+        // Quarters keep the double sums exact whatever the order of additions
+        doubles[i] = double(uniform(re)) / 4;
+        // All valid, every third row NULL, or only the second half valid
+        const bool valid = (null_pattern == 0) || ((null_pattern == 1) && (i % 3 != 0)) || ((null_pattern == 2) && (i >= n / 2));
+        if (valid) validity[i / 64] |= uint64_t(1) << (i % 64);
+      }
+      int64_t int_sum = 0;
+      double double_sum = 0;
+      int64_t int_min = std::numeric_limits<int64_t>::max();
+      int64_t int_max = std::numeric_limits<int64_t>::lowest();
+      double double_min = std::numeric_limits<double>::max();
+      double double_max = std::numeric_limits<double>::lowest();
+      size_t valid_count = 0;
+      size_t int_less = 0;
+      size_t int_equal = 0;
+      size_t double_greater_equal = 0;
+      std::vector<uint64_t> int_hist(10, 0);
+      std::vector<uint64_t> double_hist(8, 0);
+      for (size_t i = 0; i < n; ++i) {
+        if (!((validity[i / 64] >> (i % 64)) & 1)) continue;
+        ++valid_count;
+        int_sum += ints[i];
+        double_sum += doubles[i];
+        int_min = std::min(int_min, ints[i]);
+        int_max = std::max(int_max, ints[i]);
+        double_min = std::min(double_min, doubles[i]);
+        double_max = std::max(double_max, doubles[i]);
+        if (ints[i] < 17) ++int_less;
+        if (ints[i] == ints[0]) ++int_equal;
+        if (doubles[i] >= -10.25) ++double_greater_equal;
+        if ((ints[i] >= -500) && (ints[i] < 500)) ++int_hist[size_t(ints[i] + 500) / 100];
+        if ((doubles[i] >= -100) && (doubles[i] < 100)) ++double_hist[size_t((doubles[i] + 100) / 25)];
+      }
+      const uint64_t* v = validity.data();
+      ASSERT_EQ(int_sum, sqlite::kernels::sum(ints.data(), n, v));
+      ASSERT_EQ(double_sum, sqlite::kernels::sum(doubles.data(), n, v));
+      const auto int_min_max = sqlite::kernels::min_max(ints.data(), n, v);
+      const auto double_min_max = sqlite::kernels::min_max(doubles.data(), n, v);
+      ASSERT_EQ(valid_count, int_min_max.count);
+      ASSERT_EQ(valid_count, double_min_max.count);
+      if (valid_count > 0) {
+        ASSERT_EQ(int_min, int_min_max.min);
+        ASSERT_EQ(int_max, int_min_max.max);
+        ASSERT_EQ(double_min, double_min_max.min);
+        ASSERT_EQ(double_max, double_min_max.max);
+      }
+      ASSERT_EQ(int_less, sqlite::kernels::count_where(ints.data(), n, compare_op::less, int64_t(17), v));
+      if (n > 0) {
+        ASSERT_EQ(int_equal, sqlite::kernels::count_where(ints.data(), n, compare_op::equal, ints[0], v));
+      }
+      ASSERT_EQ(double_greater_equal, sqlite::kernels::count_where(doubles.data(), n, compare_op::greater_equal, -10.25, v));
+      std::vector<uint64_t> hist;
+      sqlite::kernels::histogram(ints.data(), n, int64_t(-500), int64_t(500), 10, hist, v);
+      ASSERT_EQ(int_hist, hist);
+      hist.clear();
+      sqlite::kernels::histogram(doubles.data(), n, -100.0, 100.0, 8, hist, v);
+      ASSERT_EQ(double_hist, hist);
+    }
+  }
+
+  // Over a batch fetched from a query, against SQLite's own aggregates
+  sqlite::database::type_ptr db(new sqlite::database::type(":memory:"));
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`int_field` INTEGER, `float_field` REAL)");
+  create_table.step();
+  sqlite::query fill(db, "WITH RECURSIVE `r`(`i`) AS (SELECT 1 UNION ALL SELECT `i` + 1 FROM `r` WHERE `i` < 1000) "
+                     "INSERT INTO `test_table` SELECT CASE WHEN `i` % 7 = 0 THEN NULL ELSE `i` END, `i` / 8.0 FROM `r`");
+  fill.step();
+  ASSERT_EQ(SQLITE_DONE, fill.result_code());
+  sqlite::query aggregates(db, "SELECT SUM(`int_field`), MIN(`int_field`), MAX(`int_field`), "
+                           "COUNT(`int_field`), SUM(`float_field` > 50) FROM `test_table`");
+  aggregates.step();
+  ASSERT_EQ(SQLITE_ROW, aggregates.result_code());
+  sqlite::input_query<int64_t, double> select(db, "SELECT `int_field`, `float_field` FROM `test_table`");
+  auto batch = select.fetch_columns(2000);
+  ASSERT_EQ(1000, batch.size());
+  ASSERT_EQ(aggregates.get<int64_t>(0), sqlite::kernels::sum<0>(batch));
+  const auto min_max = sqlite::kernels::min_max<0>(batch);
+  ASSERT_EQ(aggregates.get<int64_t>(1), min_max.min);
+  ASSERT_EQ(aggregates.get<int64_t>(2), min_max.max);
+  ASSERT_EQ(aggregates.get<int64_t>(3), int64_t(min_max.count));
+  ASSERT_EQ(aggregates.get<int64_t>(4), int64_t(sqlite::kernels::count_where<1>(batch, compare_op::greater, 50.0)));
+  std::vector<uint64_t> hist;
+  sqlite::kernels::histogram<1>(batch, 0.0, 125.0, 5, hist);
+  ASSERT_EQ(std::vector<uint64_t>({199, 200, 200, 200, 200}), hist);
+}
+
+TEST(SqliteTest, PrefetchQuery) {
+  sqlite::spsc_ring<int> ring(3);
+  ASSERT_EQ(4, ring.capacity());
+  for (int i = 0; i < 4; ++i) ASSERT_TRUE(ring.try_push(int(i)));
+  ASSERT_FALSE(ring.try_push(4));
+  int value = -1;
+  ASSERT_TRUE(ring.try_pop(value));
+  ASSERT_EQ(0, value);
+  ASSERT_TRUE(ring.try_push(4));
+  for (int i = 1; i < 5; ++i) {
+    ASSERT_TRUE(ring.try_pop(value));
+    ASSERT_EQ(i, value);
+  }
+  ASSERT_FALSE(ring.try_pop(value));
+
+  sqlite::database::type_ptr db(new sqlite::database::type("test.db"));
+  ASSERT_EQ(SQLITE_OK, db->result_code());
+  sqlite::query drop_table(db, "DROP TABLE IF EXISTS `test_table`");
+  drop_table.step();
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `str_field` TEXT)");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+  {
+    typedef sqlite::buffered::insert_query<int64_t, std::string> insert_type;
+    insert_type insert(db, "test_table", std::vector<std::string>{"id", "str_field"});
+    for (int64_t i = 0; i < 10000; ++i) {
+      insert.push_back(std::make_tuple(i, std::to_string(i)));
+    }
+  }
+
+  // A ring much smaller than the result set, so both sides have to wait for each other
+  typedef sqlite::prefetch_query<int64_t, std::string> select_type;
+  select_type select(db, "SELECT `id`, `str_field` FROM `test_table` WHERE `id` >= ? ORDER BY `id`", 16);
+  select.bind(1, int64_t(100));
+  int64_t n = 100;
+  for (const auto& row : select) {
+    ASSERT_EQ(n, std::get<0>(row));
+    ASSERT_EQ(std::to_string(n), std::get<1>(row));
+    ++n;
+  }
+  ASSERT_EQ(10000, n);
+  ASSERT_EQ(SQLITE_DONE, select.result_code());
+  ASSERT_EQ(9900, select.stats().rows);
+
+  // The producer's steps keep to the deadline of the query
+  {
+    sqlite::prefetch_query<int64_t> runaway(db, "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c) "
+                                            "SELECT COUNT(*) FROM c");
+    runaway.set_timeout(std::chrono::milliseconds(20));
+    ASSERT_TRUE(runaway.begin() == runaway.end());
+    ASSERT_EQ(SQLITE_INTERRUPT, runaway.result_code());
+  }
+
+  // Leaving the loop early stops the producer thread
+  {
+    select_type partial(db, "SELECT `id`, `str_field` FROM `test_table` WHERE `id` >= ?", 16);
+    partial.bind(1, int64_t(0));
+    int64_t seen = 0;
+    for (const auto& row : partial) {
+      ASSERT_EQ(seen, std::get<0>(row));
+      if (++seen == 10) break;
+    }
+    ASSERT_EQ(10, seen);
+  }
+
+  select_type empty(db, "SELECT `id`, `str_field` FROM `test_table` WHERE `id` < ?");
+  empty.bind(1, int64_t(0));
+  ASSERT_TRUE(empty.begin() == empty.end());
+  ASSERT_EQ(SQLITE_DONE, empty.result_code());
+
+  select_type invalid(db, "SELECT `no_such_field` FROM `test_table`");
+  ASSERT_NE(SQLITE_OK, invalid.result_code());
+  ASSERT_TRUE(invalid.begin() == invalid.end());
+}
+
+#if defined(SQLITE_HPP_HAS_COROUTINES)
+namespace {
+  // Started eagerly and never awaited
+  struct detached_task {
+    struct promise_type {
+      detached_task get_return_object() {
+        return {};
+      }
+      std::suspend_never initial_suspend() noexcept {
+        return {};
+      }
+      std::suspend_never final_suspend() noexcept {
+        return {};
+      }
+      void return_void() {
+      }
+      void unhandled_exception() {
+        std::terminate();
+      }
+    };
+  };
+
+  detached_task count_rows_async(sqlite::database::type_ptr db, sqlite::executor& ex,
+                                 std::promise<std::pair<int64_t, bool>>& result) {
+    int rc = co_await sqlite::async_execute(db, "DROP TABLE IF EXISTS `test_table`; "
+                                            "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY); "
+                                            "INSERT INTO `test_table` VALUES (1), (2), (3)", ex);
+    if (rc != SQLITE_OK) {
+      result.set_value(std::make_pair(int64_t(-1), false));
+      co_return;
+    }
+    const bool on_executor = std::this_thread::get_id() == ex.thread_id();
+    sqlite::query count(db, "SELECT COUNT(*) FROM `test_table`");
+    rc = co_await sqlite::async_step(count, ex);
+    int64_t n = -1;
+    if (rc == SQLITE_ROW) {
+      // Callables without a result can be awaited too
+      co_await sqlite::async_run(ex, [&count, &n] () { n = count.get<int64_t>(0); });
+    }
+    result.set_value(std::make_pair(n, on_executor));
+  }
+}
+
+TEST(SqliteTest, Coroutines) {
+  sqlite::database::type_ptr db(new sqlite::database::type("test.db"));
+  ASSERT_EQ(SQLITE_OK, db->result_code());
+  {
+    sqlite::executor ex;
+    std::promise<std::pair<int64_t, bool>> result;
+    std::future<std::pair<int64_t, bool>> counted = result.get_future();
+    count_rows_async(db, ex, result);
+    const std::pair<int64_t, bool> r = counted.get();
+    ASSERT_EQ(3, r.first);
+    ASSERT_TRUE(r.second);
+  }
+
+  sqlite::input_query<int64_t> select(db, "SELECT `id` FROM `test_table` ORDER BY `id`");
+  int64_t n = 0;
+  for (const auto& row : select.rows()) {
+    ASSERT_EQ(++n, std::get<0>(row));
+  }
+  ASSERT_EQ(3, n);
+  ASSERT_EQ(SQLITE_DONE, select.result_code());
+}
+#endif
+
+TEST(SqliteTest, ParallelScan) {
+  sqlite::database::type_ptr db(new sqlite::database::type("test.db"));
+  ASSERT_EQ(SQLITE_OK, db->result_code());
+  sqlite::query drop_table(db, "DROP TABLE IF EXISTS `test_table`");
+  drop_table.step();
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `value` INTEGER, `str_field` TEXT)");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+  int64_t expected_sum = 0;
+  size_t expected_even = 0;
+  {
+    typedef sqlite::buffered::insert_query<int64_t, int64_t, std::string> insert_type;
+    insert_type insert(db, "test_table", std::vector<std::string>{"id", "value", "str_field"});
+    // Rowids with a large gap in the middle
+    for (int64_t i = 0; i < 5000; ++i) {
+      const int64_t id = i < 2500 ? i : 1000000 + i;
+      insert.push_back(std::make_tuple(id, i, std::to_string(i)));
+      expected_sum += i;
+      if (i % 2 == 0) ++expected_even;
+    }
+  }
+
+  sqlite::parallel_scan_config cfg;
+  cfg.threads = 3;
+  cfg.batch_size = 100;
+  typedef sqlite::parallel_scan<int64_t, std::string> scan_type;
+  scan_type scan("test.db", "test_table", std::vector<std::string>{"value", "str_field"}, "", cfg);
+  typedef std::pair<int64_t, size_t> sum_count;
+  const sum_count by_row = scan.reduce(sum_count(0, 0),
+                                       [] (sum_count& s, const std::tuple<int64_t, std::string>& row) {
+                                         s.first += std::get<0>(row);
+                                         if (std::to_string(std::get<0>(row)) == std::get<1>(row)) ++s.second;
+                                       },
+                                       [] (sum_count& s, const sum_count& partial) {
+                                         s.first += partial.first;
+                                         s.second += partial.second;
+                                       });
+  ASSERT_EQ(SQLITE_DONE, scan.result_code());
+  ASSERT_EQ(expected_sum, by_row.first);
+  ASSERT_EQ(5000, by_row.second);
+
+  const int64_t by_batch = scan.reduce_batches(int64_t(0),
+                                               [] (int64_t& s, const scan_type::column_batch_type& batch) {
+                                                 s += sqlite::kernels::sum<0>(batch);
+                                               },
+                                               [] (int64_t& s, const int64_t partial) { s += partial; });
+  ASSERT_EQ(SQLITE_DONE, scan.result_code());
+  ASSERT_EQ(expected_sum, by_batch);
+
+  scan_type even("test.db", "test_table", std::vector<std::string>{"value", "str_field"}, "`value` % 2 = 0", cfg);
+  std::atomic<size_t> n_even(0);
+  even.for_each([&n_even] (const std::tuple<int64_t, std::string>&) { ++n_even; });
+  ASSERT_EQ(SQLITE_DONE, even.result_code());
+  ASSERT_EQ(expected_even, n_even.load());
+
+  scan_type missing("test.db", "no_such_table", std::vector<std::string>{"value", "str_field"}, "", cfg);
+  ASSERT_EQ(0, missing.reduce(int64_t(0), [] (int64_t& s, const std::tuple<int64_t, std::string>&) { ++s; },
+                              [] (int64_t& s, const int64_t partial) { s += partial; }));
+  ASSERT_NE(SQLITE_DONE, missing.result_code());
+  ASSERT_NE(SQLITE_OK, missing.result_code());
+}
+
+TEST(SqliteTest, KeysetCursor) {
+  const std::string filename = "test_keyset.db";
+  std::remove(filename.c_str());
+  sqlite::database::type_ptr db(new sqlite::database::type(filename));
+  ASSERT_EQ(SQLITE_OK, db->result_code());
+  {
+    sqlite::query wal(db, "PRAGMA journal_mode = WAL");
+    wal.step();
+    ASSERT_EQ("wal", wal.get<std::string>(0));
+  }
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`grp` INTEGER, `name` TEXT, `value` REAL, "
+                             "PRIMARY KEY (`grp`, `name`))");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+  {
+    typedef sqlite::buffered::insert_query<int64_t, std::string, double> insert_type;
+    insert_type insert(db, "test_table", std::vector<std::string>{"grp", "name", "value"});
+    for (int64_t i = 0; i < 1000; ++i) {
+      insert.push_back(std::make_tuple(i % 7, "name:" + std::to_string(i), double(i)));
+    }
+  }
+
+  typedef sqlite::keyset_cursor<std::tuple<int64_t, std::string>, int64_t, std::string, double> cursor_type;
+  cursor_type cursor(db, "test_table", std::vector<std::string>{"grp", "name"}, std::vector<std::string>{"value"},
+                     64, "`value` >= 0");
+  ASSERT_EQ(SQLITE_OK, cursor.result_code());
+  ASSERT_EQ("", cursor.position());
+  std::vector<std::tuple<int64_t, std::string, double>> page;
+  std::vector<std::tuple<int64_t, std::string>> keys;
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_EQ(64, cursor.next_page(page));
+    for (const auto& row : page) keys.push_back(std::make_tuple(std::get<0>(row), std::get<1>(row)));
+  }
+  ASSERT_EQ(keys.back(), cursor.last_key());
+
+  // A statement left in the middle of its result set keeps its snapshot and blocks the checkpoint
+  {
+    sqlite::query open_reader(db, "SELECT `name` FROM `test_table`");
+    open_reader.step();
+    ASSERT_EQ(SQLITE_ROW, open_reader.result_code());
+    sqlite::database::type_ptr writer(new sqlite::database::type(filename));
+    sqlite::query insert(writer, "INSERT INTO `test_table` VALUES (50, 'written during a long read', -1)");
+    insert.step();
+    ASSERT_EQ(SQLITE_DONE, insert.result_code());
+    sqlite::query checkpoint(writer, "PRAGMA wal_checkpoint(TRUNCATE)");
+    checkpoint.step();
+    ASSERT_EQ(SQLITE_ROW, checkpoint.result_code());
+    ASSERT_EQ(1, checkpoint.get<int>(0));
+  }
+
+  // No read transaction is left open between pages, so a writer can checkpoint and truncate the WAL
+  {
+    sqlite::database::type_ptr writer(new sqlite::database::type(filename));
+    sqlite::query insert(writer, "INSERT INTO `test_table` VALUES (-1, 'behind the cursor', 0), (100, 'ahead of the cursor', 0)");
+    insert.step();
+    ASSERT_EQ(SQLITE_DONE, insert.result_code());
+    sqlite::query checkpoint(writer, "PRAGMA wal_checkpoint(TRUNCATE)");
+    checkpoint.step();
+    ASSERT_EQ(SQLITE_ROW, checkpoint.result_code());
+    ASSERT_EQ(0, checkpoint.get<int>(0));
+  }
+
+  // Resuming from the stored position on a new cursor
+  const std::string position = cursor.position();
+  cursor_type resumed(db, "test_table", std::vector<std::string>{"grp", "name"}, std::vector<std::string>{"value"},
+                      64, "`value` >= 0");
+  ASSERT_FALSE(resumed.set_position("i1;s100:short"));
+  ASSERT_FALSE(resumed.set_position("x"));
+  ASSERT_TRUE(resumed.set_position(position));
+  while (resumed.next_page(page) > 0) {
+    for (const auto& row : page) keys.push_back(std::make_tuple(std::get<0>(row), std::get<1>(row)));
+  }
+  ASSERT_EQ(SQLITE_DONE, resumed.result_code());
+  ASSERT_TRUE(resumed.done());
+  ASSERT_EQ(0, resumed.next_page(page));
+  ASSERT_TRUE(page.empty());
+  // The row inserted ahead of the cursor is seen, the one behind it is not
+  ASSERT_EQ(1001, keys.size());
+  ASSERT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+  ASSERT_TRUE(std::adjacent_find(keys.begin(), keys.end()) == keys.end());
+  ASSERT_EQ(std::make_tuple(int64_t(100), std::string("ahead of the cursor")), keys.back());
+
+  std::string encoded;
+  sqlite::key_codec<double>::encode(encoded, 0.1);
+  sqlite::key_codec<std::string>::encode(encoded, std::string("a;b:c"));
+  size_t pos = 0;
+  double d = 0;
+  std::string s;
+  ASSERT_TRUE(sqlite::key_codec<double>::decode(encoded, pos, d));
+  ASSERT_TRUE(sqlite::key_codec<std::string>::decode(encoded, pos, s));
+  ASSERT_EQ(0.1, d);
+  ASSERT_EQ("a;b:c", s);
+  ASSERT_EQ(encoded.size(), pos);
+
+  db.reset();
+  std::remove(filename.c_str());
+}
+
+TEST(SqliteTest, QueryCache) {
+  const std::string filename = "test_query_cache.db";
+  std::remove(filename.c_str());
+  sqlite::database::type_ptr db(new sqlite::database::type(filename));
+  ASSERT_EQ(SQLITE_OK, db->result_code());
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`grp` INTEGER, `name` TEXT)");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+  sqlite::query create_other(db, "CREATE TABLE `other_table` (`k` INTEGER PRIMARY KEY, `v` TEXT) WITHOUT ROWID");
+  create_other.step();
+  ASSERT_EQ(SQLITE_DONE, create_other.result_code());
+  {
+    typedef sqlite::buffered::insert_query<int64_t, std::string> insert_type;
+    insert_type insert(db, "test_table", std::vector<std::string>{"grp", "name"});
+    for (int64_t i = 0; i < 100; ++i) insert.push_back(std::make_tuple(i % 4, "name:" + std::to_string(i)));
+  }
+
+  sqlite::query_cache::type_ptr cache(new sqlite::query_cache(db));
+  typedef sqlite::cached_query<std::string> select_type;
+  select_type select(cache, "SELECT `name` FROM `test_table` WHERE `grp` = ? ORDER BY rowid");
+  ASSERT_EQ(SQLITE_OK, select.result_code());
+  ASSERT_EQ(std::set<std::string>{"test_table"}, select.tables());
+  select_type count(cache, "SELECT COUNT(*) FROM `test_table` WHERE `grp` = ?");
+  select_type other(cache, "SELECT `v` FROM `other_table`");
+  ASSERT_EQ(std::set<std::string>{"other_table"}, other.tables());
+
+  select.bind(1, 1);
+  select_type::rows_ptr rows = select.rows();
+  ASSERT_EQ(SQLITE_DONE, select.result_code());
+  ASSERT_TRUE(rows != nullptr);
+  ASSERT_EQ(25, rows->size());
+  ASSERT_EQ("name:1", std::get<0>(rows->front()));
+  ASSERT_TRUE(rows == select.rows());
+  select.bind(1, 2);
+  ASSERT_EQ("name:2", std::get<0>(select.rows()->front()));
+  count.bind(1, 1);
+  ASSERT_EQ("25", std::get<0>(count.rows()->front()));
+  ASSERT_TRUE(other.rows()->empty());
+  sqlite::query_cache::stats s = cache->get_stats();
+  ASSERT_EQ(1, s.hits);
+  ASSERT_EQ(4, s.misses);
+  ASSERT_EQ(4, s.entries);
+  ASSERT_LT(0, s.bytes);
+
+  // Changes to test_table through this connection drop the results that read it, and only those
+  sqlite::query insert(db, "INSERT INTO `test_table` VALUES (1, 'inserted')");
+  insert.step();
+  ASSERT_EQ(SQLITE_DONE, insert.result_code());
+  s = cache->get_stats();
+  ASSERT_EQ(1, s.entries);
+  ASSERT_EQ(3, s.invalidations);
+  select.bind(1, 1);
+  ASSERT_EQ(26, select.rows()->size());
+  ASSERT_TRUE(other.rows()->empty());
+  ASSERT_EQ(2, cache->get_stats().hits);
+
+  // Not reported by the update hook, but seen by sqlite3_total_changes()
+  sqlite::query insert_other(db, "INSERT INTO `other_table` VALUES (1, 'without rowid')");
+  insert_other.step();
+  ASSERT_EQ(SQLITE_DONE, insert_other.result_code());
+  ASSERT_EQ(1, other.rows()->size());
+
+  // Commits of other connections change data_version
+  ASSERT_EQ(26, select.rows()->size());
+  {
+    sqlite::database::type_ptr writer(new sqlite::database::type(filename));
+    sqlite::query delete_rows(writer, "DELETE FROM `test_table` WHERE `name` = 'inserted'");
+    delete_rows.step();
+    ASSERT_EQ(SQLITE_DONE, delete_rows.result_code());
+  }
+  ASSERT_EQ(25, select.rows()->size());
+
+  // Transactions bypass the cache
+  s = cache->get_stats();
+  sqlite::query begin(db, "BEGIN");
+  begin.step();
+  sqlite::query insert_in_transaction(db, "INSERT INTO `test_table` VALUES (1, 'rolled back')");
+  insert_in_transaction.step();
+  ASSERT_EQ(26, select.rows()->size());
+  sqlite::query rollback(db, "ROLLBACK");
+  rollback.step();
+  ASSERT_EQ(SQLITE_DONE, rollback.result_code());
+  ASSERT_EQ(s.bypasses + 1, cache->get_stats().bypasses);
+  ASSERT_EQ(25, select.rows()->size());
+
+  // Least recently used results are evicted to stay below max_bytes
+  sqlite::query_cache::config cfg;
+  cfg.max_bytes = cache->get_stats().bytes;
+  sqlite::query_cache::type_ptr small(new sqlite::query_cache(db, cfg));
+  select_type small_select(small, "SELECT `name` FROM `test_table` WHERE `grp` = ? ORDER BY rowid");
+  for (int g = 0; g < 4; ++g) {
+    small_select.bind(1, g);
+    ASSERT_EQ(25, small_select.rows()->size());
+  }
+  s = small->get_stats();
+  ASSERT_LT(0, s.evictions);
+  ASSERT_LE(s.bytes, cfg.max_bytes);
+
+  small.reset();
+  cache.reset();
+  db.reset();
+  std::remove(filename.c_str());
+}
+
+TEST(SqliteTest, HashIndex) {
+  const std::string filename = "test_hash_index.db";
+  std::remove(filename.c_str());
+  sqlite::database::type_ptr db(new sqlite::database::type(filename));
+  ASSERT_EQ(SQLITE_OK, db->result_code());
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `email` TEXT)");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+  {
+    typedef sqlite::buffered::insert_query<int64_t, std::string> insert_type;
+    insert_type insert(db, "test_table", std::vector<std::string>{"id", "email"});
+    for (int64_t i = 1; i <= 1000; ++i) insert.push_back(std::make_tuple(i, "user" + std::to_string(i % 500) + "@example.com"));
+  }
+  sqlite::query insert_null(db, "INSERT INTO `test_table` VALUES (1001, NULL)");
+  insert_null.step();
+
+  sqlite::hash_index<std::string> index(db, "test_table", "email");
+  ASSERT_EQ(SQLITE_OK, index.result_code());
+  ASSERT_EQ(1000, index.size());
+  int64_t rowid = 0;
+  ASSERT_TRUE(index.find("user7@example.com", rowid));
+  ASSERT_TRUE((rowid == 7) || (rowid == 507));
+  std::vector<int64_t> rowids;
+  index.find_all("user7@example.com", rowids);
+  std::sort(rowids.begin(), rowids.end());
+  ASSERT_EQ((std::vector<int64_t>{7, 507}), rowids);
+  ASSERT_FALSE(index.find("nobody@example.com", rowid));
+
+  // Readers keep looking up while the connection's thread writes and refreshes. A failed ASSERT
+  // would return with the readers still joinable, so only EXPECT is used until they are joined.
+  std::atomic<bool> stop(false);
+  std::atomic<uint64_t> lookups(0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 2; ++t) {
+    readers.push_back(std::thread([&] () {
+          int64_t r = 0;
+          while (!stop.load()) {
+            // Rows that are never touched below stay visible in every snapshot
+            if (!index.find("user100@example.com", r) || (index.count("user100@example.com") != 2)) {
+              lookups.store(uint64_t(-1));
+              return;
+            }
+            lookups.fetch_add(1);
+          }
+        }));
+  }
+
+  sqlite::query insert(db, "INSERT INTO `test_table` VALUES (2000, 'new@example.com')");
+  insert.step();
+  sqlite::query update(db, "UPDATE `test_table` SET `email` = 'changed@example.com' WHERE `id` = 7");
+  update.step();
+  sqlite::query remove(db, "DELETE FROM `test_table` WHERE `id` = 8");
+  remove.step();
+  EXPECT_EQ(SQLITE_DONE, remove.result_code());
+  // Not visible before refresh()
+  EXPECT_FALSE(index.find("new@example.com", rowid));
+  EXPECT_EQ(SQLITE_OK, index.refresh());
+  EXPECT_TRUE(index.find("new@example.com", rowid));
+  EXPECT_EQ(2000, rowid);
+  EXPECT_TRUE(index.find("changed@example.com", rowid));
+  EXPECT_EQ(7, rowid);
+  EXPECT_EQ(1, index.count("user7@example.com"));
+  EXPECT_EQ(1, index.count("user8@example.com"));
+  EXPECT_EQ(1000, index.size());
+
+  // Rolled back changes are dropped; refresh() is refused inside transactions
+  sqlite::query begin(db, "BEGIN");
+  begin.step();
+  sqlite::query insert_in_transaction(db, "INSERT INTO `test_table` VALUES (3000, 'rolled.back@example.com')");
+  insert_in_transaction.step();
+  EXPECT_EQ(SQLITE_MISUSE, index.refresh());
+  sqlite::query rollback(db, "ROLLBACK");
+  rollback.step();
+  EXPECT_EQ(SQLITE_DONE, rollback.result_code());
+  EXPECT_EQ(SQLITE_OK, index.refresh());
+  EXPECT_FALSE(index.find("rolled.back@example.com", rowid));
+
+  // Commits of other connections make refresh() rebuild the index
+  {
+    sqlite::database::type_ptr writer(new sqlite::database::type(filename));
+    sqlite::query insert_other(writer, "INSERT INTO `test_table` VALUES (4000, 'other@example.com')");
+    insert_other.step();
+    EXPECT_EQ(SQLITE_DONE, insert_other.result_code());
+  }
+  EXPECT_EQ(SQLITE_OK, index.refresh());
+  EXPECT_TRUE(index.find("other@example.com", rowid));
+  EXPECT_EQ(4000, rowid);
+
+  stop.store(true);
+  for (auto& r : readers) r.join();
+  ASSERT_NE(uint64_t(-1), lookups.load());
+
+  db.reset();
+  std::remove(filename.c_str());
+}
+
+TEST(SqliteTest, MaterializedAggregate) {
+  const std::string filename = "test_aggregate.db";
+  std::remove(filename.c_str());
+  sqlite::database::type_ptr db(new sqlite::database::type(filename));
+  ASSERT_EQ(SQLITE_OK, db->result_code());
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `grp` TEXT, `amount` INTEGER)");
+  create_table.step();
+  ASSERT_EQ(SQLITE_DONE, create_table.result_code());
+  {
+    typedef sqlite::buffered::insert_query<int64_t, std::string, int64_t> insert_type;
+    insert_type insert(db, "test_table", std::vector<std::string>{"id", "grp", "amount"});
+    for (int64_t i = 1; i <= 100; ++i) insert.push_back(std::make_tuple(i, "g" + std::to_string(i % 3), i));
+  }
+  sqlite::query insert_nulls(db, "INSERT INTO `test_table` VALUES (101, NULL, 1000), (102, 'g0', NULL)");
+  insert_nulls.step();
+  ASSERT_EQ(SQLITE_DONE, insert_nulls.result_code());
+
+  typedef sqlite::materialized_aggregate<std::string, int64_t> aggregate_type;
+  aggregate_type aggregate(db, "test_table", "grp", "amount");
+  ASSERT_EQ(SQLITE_OK, aggregate.result_code());
+  // Compares with the result of the query it replaces
+  auto matches_query = [&] () {
+    sqlite::query select(db, "SELECT `grp`, COUNT(*), COALESCE(SUM(`amount`), 0) FROM `test_table` "
+                         "WHERE `grp` IS NOT NULL GROUP BY `grp`");
+    aggregate_type::groups_type expected;
+    for (select.step(); select.result_code() == SQLITE_ROW; select.step()) {
+      expected[select.get<std::string>(0)] = aggregate_type::state_type{select.get<int64_t>(1), select.get<int64_t>(2)};
+    }
+    const aggregate_type::groups_type groups = aggregate.groups();
+    if (groups.size() != expected.size()) return false;
+    for (const auto& g : expected) {
+      aggregate_type::state_type s;
+      if (!aggregate.get(g.first, s) || (s.count != g.second.count) || (s.sum != g.second.sum)) return false;
+    }
+    return true;
+  };
+  ASSERT_TRUE(matches_query());
+  aggregate_type::state_type s;
+  ASSERT_TRUE(aggregate.get("g0", s));
+  ASSERT_EQ(34, s.count);
+  ASSERT_EQ(1683, s.sum);
+  ASSERT_EQ(101, aggregate.total().count);
+
+  sqlite::query insert(db, "INSERT INTO `test_table` VALUES (200, 'g1', 5), (201, 'new', 7)");
+  insert.step();
+  sqlite::query update(db, "UPDATE `test_table` SET `grp` = 'g2', `amount` = `amount` + 1 WHERE `id` <= 10");
+  update.step();
+  sqlite::query remove(db, "DELETE FROM `test_table` WHERE `grp` = 'g0' AND `id` > 50");
+  remove.step();
+  ASSERT_EQ(SQLITE_DONE, remove.result_code());
+  ASSERT_EQ(SQLITE_OK, aggregate.refresh());
+  ASSERT_TRUE(matches_query());
+  ASSERT_TRUE(aggregate.get("new", s));
+  ASSERT_EQ(1, s.count);
+
+  // Deltas of a rolled back transaction are dropped
+  sqlite::query begin(db, "BEGIN");
+  begin.step();
+  sqlite::query insert_in_transaction(db, "INSERT INTO `test_table` VALUES (300, 'rolled back', 1)");
+  insert_in_transaction.step();
+  sqlite::query delete_in_transaction(db, "DELETE FROM `test_table` WHERE `grp` = 'new'");
+  delete_in_transaction.step();
+  ASSERT_EQ(SQLITE_MISUSE, aggregate.refresh());
+  sqlite::query rollback(db, "ROLLBACK");
+  rollback.step();
+  ASSERT_EQ(SQLITE_DONE, rollback.result_code());
+  ASSERT_EQ(SQLITE_OK, aggregate.refresh());
+  ASSERT_FALSE(aggregate.get("rolled back", s));
+  ASSERT_TRUE(aggregate.get("new", s));
+  ASSERT_TRUE(matches_query());
+
+  // Groups left without rows disappear; commits of other connections make refresh() recompute
+  {
+    sqlite::database::type_ptr writer(new sqlite::database::type(filename));
+    sqlite::query delete_other(writer, "DELETE FROM `test_table` WHERE `grp` = 'g1'");
+    delete_other.step();
+    ASSERT_EQ(SQLITE_DONE, delete_other.result_code());
+  }
+  ASSERT_TRUE(aggregate.get("g1", s));
+  ASSERT_EQ(SQLITE_OK, aggregate.refresh());
+  ASSERT_FALSE(aggregate.get("g1", s));
+  ASSERT_TRUE(matches_query());
+
+  sqlite::materialized_aggregate<std::string, int64_t> missing(db, "test_table", "grp", "no_such_column");
+  ASSERT_EQ(SQLITE_ERROR, missing.result_code());
+
+  db.reset();
+  std::remove(filename.c_str());
+}
+
+TEST(SqliteTest, Fingerprint) {
+  ASSERT_EQ("SELECT `a`, B FROM `t` WHERE `id` = ? AND NAME = ?",
+            sqlite::fingerprint("select `a`,  b\n FROM `t` -- comment\n WHERE `id` = 42 AND name = 'it''s'"));
+  ASSERT_EQ(sqlite::fingerprint("SELECT * FROM t WHERE x IN (1, 2, 3) /* three */"),
+            sqlite::fingerprint("SELECT * FROM t WHERE x IN (:a)"));
+  ASSERT_EQ("SELECT * FROM T WHERE X = ? AND Y > ?", sqlite::fingerprint("SELECT * FROM t WHERE x = ?1 AND y > 1.5e-3"));
+  ASSERT_EQ("SELECT ? FROM T1", sqlite::fingerprint("SELECT x'00ff' FROM t1"));
+  ASSERT_EQ("SELECT `a`, `b` FROM `t`", sqlite::fingerprint("SELECT `a`, `b` FROM `t`"));
+  // Batches of the buffered queries differ only in the number of repetitions
+  ASSERT_EQ("INSERT INTO `t` (`a`, `b`) SELECT ?",
+            sqlite::fingerprint("INSERT INTO `t` (`a`, `b`) SELECT ?, ?\nUNION ALL SELECT ?, ?\nUNION ALL SELECT ?, ?"));
+  ASSERT_EQ(sqlite::fingerprint("INSERT INTO `t` (`a`, `b`) SELECT ?, ?"),
+            sqlite::fingerprint("INSERT INTO `t` (`a`, `b`) SELECT ?, ?\nUNION ALL SELECT ?, ?"));
+  ASSERT_EQ("SELECT `v` FROM `t` WHERE (`k` = ? AND `j` = ?)",
+            sqlite::fingerprint("SELECT `v` FROM `t` WHERE (`k` = ? AND `j` = ?) OR (`k` = ? AND `j` = ?) OR (`k` = ? AND `j` = ?)"));
+}
+
+#if defined(SQLITE_HPP_HAS_TRACE_V2)
+TEST(SqliteTest, Profiler) {
+  sqlite::database::type_ptr db(new sqlite::database::type(":memory:"));
+  ASSERT_EQ(SQLITE_OK, db->install_profiler());
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `v` TEXT)");
+  create_table.step();
+  {
+    typedef sqlite::buffered::insert_query<int64_t, std::string> insert_type;
+    insert_type insert(db, "test_table", std::vector<std::string>{"id", "v"});
+    for (int64_t i = 0; i < 1000; ++i) insert.push_back(std::make_tuple(i, std::to_string(i)));
+  }
+  for (int i = 0; i < 50; ++i) {
+    sqlite::query select(db, "SELECT `v` FROM `test_table` WHERE `id` = " + std::to_string(i));
+    select.step();
+    ASSERT_EQ(SQLITE_ROW, select.result_code());
+  }
+  sqlite::query scan(db, "SELECT COUNT(*) FROM `test_table` a, `test_table` b WHERE a.`v` < b.`v`");
+  scan.step();
+  scan.step();
+
+  const sqlite::profiler::type_ptr& p = db->get_profiler();
+  ASSERT_TRUE(p != nullptr);
+  const std::vector<sqlite::statement_profile> by_total = p->top_by_total(10);
+  ASSERT_EQ(SQLITE_DONE, scan.result_code());
+  ASSERT_EQ("SELECT COUNT (*) FROM `test_table` A, `test_table` B WHERE A.`v` < B.`v`", by_total.front().fingerprint);
+  bool found_lookups = false;
+  bool found_batches = false;
+  for (const auto& s : by_total) {
+    if (s.fingerprint == "SELECT `v` FROM `test_table` WHERE `id` = ?") {
+      found_lookups = true;
+      ASSERT_EQ(50, s.calls);
+      ASSERT_LE(s.p50_ns, s.p99_ns);
+      ASSERT_LE(s.p99_ns, s.max_ns * 2);
+    }
+    if (s.fingerprint == "INSERT INTO `test_table` (`id`, `v`) SELECT ?") {
+      found_batches = true;
+      ASSERT_LE(2, s.calls);
+    }
+  }
+  ASSERT_TRUE(found_lookups);
+  ASSERT_TRUE(found_batches);
+  ASSERT_EQ(1, p->top_by_p99(1).size());
+  ASSERT_NE(std::string::npos, p->report(3).find("Top statements by p99 latency"));
+  p->reset();
+  ASSERT_TRUE(p->top_by_total(10).empty());
+  ASSERT_EQ(SQLITE_OK, db->remove_profiler());
+}
+#endif
+
+TEST(SqliteTest, StatementStats) {
+  sqlite::database::type_ptr db(new sqlite::database::type(":memory:"));
+#if defined(SQLITE_HPP_HAS_TRACE_V2)
+  std::vector<sqlite::fullscan_alert> alerts;
+  sqlite::profiler_config cfg;
+  cfg.fullscan_alert_steps = 500;
+  cfg.on_fullscan = [&alerts] (const sqlite::fullscan_alert& a) { alerts.push_back(a); };
+  ASSERT_EQ(SQLITE_OK, db->install_profiler(cfg));
+#endif
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `v` INTEGER)");
+  create_table.step();
+  {
+    typedef sqlite::buffered::insert_query<int64_t, int64_t> insert_type;
+    insert_type insert(db, "test_table", std::vector<std::string>{"id", "v"});
+    for (int64_t i = 0; i < 1000; ++i) insert.push_back(std::make_tuple(i, i % 10));
+  }
+
+  sqlite::query by_id(db, "SELECT `v` FROM `test_table` WHERE `id` = ?");
+  by_id.bind(1, int64_t(5));
+  by_id.step();
+  ASSERT_EQ(SQLITE_ROW, by_id.result_code());
+  by_id.step();
+  ASSERT_EQ(0, by_id.stats().fullscan_steps);
+  ASSERT_LT(0, by_id.stats().vm_steps);
+
+  sqlite::query by_v(db, "SELECT `id` FROM `test_table` WHERE `v` = 3 ORDER BY abs(`id`)");
+  for (by_v.step(); by_v.result_code() == SQLITE_ROW; by_v.step());
+  ASSERT_EQ(SQLITE_DONE, by_v.result_code());
+  sqlite::statement_stats s = by_v.stats(true);
+  ASSERT_LE(999, s.fullscan_steps);
+  ASSERT_EQ(1, s.sorts);
+  ASSERT_EQ(0, by_v.stats().fullscan_steps);
+
+  // The 32-bit counters wrap around, and deltas across the wrap still add up
+  const sqlite::statement_stats before{0xfffffff0u, 0, 0, 0xffffff00u, 0, 0};
+  const sqlite::statement_stats after{0x10, 0, 0, 0x100, 0, 0};
+  ASSERT_EQ(0x20, after.since(before).fullscan_steps);
+  ASSERT_EQ(0x200, after.since(before).vm_steps);
+  // A reset is not taken for a wrap-around
+  const sqlite::statement_stats reset{5, 0, 0, 5, 0, 0};
+  ASSERT_EQ(5, reset.since(sqlite::statement_stats{1000, 0, 0, 1000, 0, 0}).fullscan_steps);
+
+#if defined(SQLITE_HPP_HAS_TRACE_V2)
+  ASSERT_EQ(1, alerts.size());
+  ASSERT_EQ("SELECT `id` FROM `test_table` WHERE `v` = ? ORDER BY ABS (`id`)", alerts[0].fingerprint);
+  ASSERT_EQ(by_v.statement() ? std::string(sqlite3_sql(by_v.statement().get())) : std::string(), alerts[0].sql);
+  ASSERT_LE(999, alerts[0].fullscan_steps);
+
+  // Counters add up per fingerprint across statements and runs, without resetting the statements
+  for (int i = 0; i < 2; ++i) {
+    sqlite::query again(db, "SELECT `id` FROM `test_table` WHERE `v` = " + std::to_string(i) +
+                        " ORDER BY abs(`id`)");
+    for (again.step(); again.result_code() == SQLITE_ROW; again.step());
+    ASSERT_LE(999, again.stats().fullscan_steps);
+  }
+  ASSERT_EQ(3, alerts.size());
+  const std::vector<sqlite::statement_profile> scans = db->get_profiler()->top_by_fullscan(1);
+  ASSERT_EQ(1, scans.size());
+  ASSERT_EQ(alerts[0].fingerprint, scans[0].fingerprint);
+  ASSERT_EQ(3, scans[0].calls);
+  ASSERT_EQ(3, scans[0].stats.sorts);
+  ASSERT_LE(3 * 999, scans[0].stats.fullscan_steps);
+#endif
+}
+
+#if defined(SQLITE_HPP_HAS_TRACE_V2)
+TEST(SqliteTest, SlowQueryLog) {
+  sqlite::database::type_ptr db(new sqlite::database::type(":memory:"));
+  std::mutex mutex;
+  std::vector<sqlite::slow_query> entries;
+  sqlite::slow_query_log_config cfg;
+  cfg.threshold = std::chrono::milliseconds(1);
+  cfg.max_literal_length = 8;
+  cfg.sink = [&mutex, &entries] (const sqlite::slow_query& q) {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.push_back(q);
+  };
+  ASSERT_EQ(SQLITE_OK, db->install_slow_query_log(cfg));
+  // The profiler shares the trace callback
+  ASSERT_EQ(SQLITE_OK, db->install_profiler());
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `v` BLOB)");
+  create_table.step();
+  sqlite::query insert(db, "INSERT INTO `test_table` (`id`, `v`) VALUES (?, ?)");
+  insert.bind(1, int64_t(1));
+  insert.bind(2, std::vector<uint8_t>(1000, 0xab));
+  insert.step();
+  ASSERT_EQ(SQLITE_DONE, insert.result_code());
+
+  const std::string slow_sql = "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < ?1) "
+    "SELECT COUNT(*) FROM c, `test_table` WHERE `v` <> ?2 AND length(:name) > 0 AND `id` > ?";
+  for (int i = 0; i < 2; ++i) {
+    sqlite::query slow(db, slow_sql);
+    slow.bind(1, int64_t(200000));
+    slow.bind(2, std::vector<uint8_t>(100, 0x01));
+    slow.bind(3, std::string("it's a long name"));
+    slow.bind(4, -1.5);
+    slow.step();
+    ASSERT_EQ(SQLITE_ROW, slow.result_code());
+    ASSERT_EQ(200000, slow.get<int64_t>(0));
+    slow.step();
+    ASSERT_EQ(SQLITE_DONE, slow.result_code());
+  }
+  const sqlite::slow_query_log::type_ptr& log = db->get_slow_query_log();
+  log->flush();
+  ASSERT_EQ(0, log->dropped());
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<sqlite::slow_query> slow_entries;
+  for (const auto& e : entries) {
+    if (e.fingerprint == sqlite::fingerprint(slow_sql)) slow_entries.push_back(e);
+  }
+  ASSERT_EQ(2, slow_entries.size());
+  const sqlite::slow_query& first = slow_entries[0];
+  ASSERT_LE(1000000, first.ns);
+  ASSERT_EQ(4, first.bindings.size());
+  ASSERT_EQ("200000", first.bindings[0]);
+  ASSERT_EQ("x'0101010101010101...' /* 100 bytes */", first.bindings[1]);
+  ASSERT_EQ("'it''s a l...' /* 16 characters */", first.bindings[2]);
+  ASSERT_EQ("-1.5", first.bindings[3]);
+  ASSERT_NE(std::string::npos, first.sql.find("x < 200000)"));
+  ASSERT_NE(std::string::npos, first.sql.find("`v` <> x'0101010101010101...' /* 100 bytes */ AND"));
+  ASSERT_FALSE(first.plan.empty());
+  ASSERT_TRUE(slow_entries[1].plan.empty());
+  ASSERT_LT(0, first.stats.vm_steps);
+  ASSERT_EQ(2, db->get_profiler()->top_by_total(1)[0].calls);
+  ASSERT_EQ(SQLITE_OK, db->remove_slow_query_log());
+  ASSERT_TRUE(db->get_slow_query_log() == nullptr);
+
+  // Literals are cut on character boundaries, never inside an escaped quote or a UTF-8 sequence
+  ASSERT_EQ("'abcdefg''...' /* 10 characters */", sqlite::detail::truncate_literals("'abcdefg''hi'", 8));
+  ASSERT_EQ("'\xc3\xa9\xc3\xa9...' /* 3 characters */",
+            sqlite::detail::truncate_literals("'\xc3\xa9\xc3\xa9\xc3\xa9'", 2));
+  ASSERT_EQ("'\xc3\xa9\xc3\xa9'", sqlite::detail::truncate_literals("'\xc3\xa9\xc3\xa9'", 2));
+}
+#endif
+
+TEST(SqliteTest, QueryDeadline) {
+  sqlite::database::type_ptr db(new sqlite::database::type(":memory:"));
+  const std::string runaway = "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c) SELECT COUNT(*) FROM c";
+  const auto started = std::chrono::steady_clock::now();
+  sqlite::query q(db, runaway);
+  q.set_timeout(std::chrono::milliseconds(20));
+  q.step();
+  ASSERT_EQ(SQLITE_INTERRUPT, q.result_code());
+  ASSERT_GT(std::chrono::seconds(5), std::chrono::steady_clock::now() - started);
+  // Once the deadline has passed, steps fail without running
+  q.step();
+  ASSERT_EQ(SQLITE_INTERRUPT, q.result_code());
+
+  // Other statements on the connection are unaffected
+  sqlite::query ok(db, "SELECT 1");
+  ok.step();
+  ASSERT_EQ(SQLITE_ROW, ok.result_code());
+  sqlite::query in_time(db, "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 1000) "
+                        "SELECT COUNT(*) FROM c");
+  in_time.set_timeout(std::chrono::seconds(60));
+  in_time.step();
+  ASSERT_EQ(SQLITE_ROW, in_time.result_code());
+  ASSERT_EQ(1000, in_time.get<int64_t>(0));
+
+  // Iteration stops with the deadline
+  sqlite::input_query<int64_t> rows(db, "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c) SELECT x FROM c");
+  rows.set_timeout(std::chrono::milliseconds(20));
+  size_t count = 0;
+  for (auto it = rows.begin(); it != rows.end(); ++it) ++count;
+  ASSERT_LT(0, count);
+  ASSERT_EQ(SQLITE_INTERRUPT, rows.result_code());
+}
+
+TEST(SqliteTest, QueryCancellation) {
+  sqlite::database::type_ptr db(new sqlite::database::type(":memory:"));
+  const std::string runaway = "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c) SELECT COUNT(*) FROM c";
+  auto token = std::make_shared<sqlite::cancellation_token>();
+  sqlite::query q(db, runaway);
+  q.set_cancellation(token);
+  std::thread canceller([token] () {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      token->cancel();
+    });
+  q.step();
+  canceller.join();
+  ASSERT_EQ(SQLITE_INTERRUPT, q.result_code());
+  ASSERT_TRUE(token->cancelled());
+
+  // A cancelled token stops the queries it is attached to before they run
+  sqlite::query cancelled(db, "SELECT 1");
+  cancelled.set_cancellation(token);
+  cancelled.step();
+  ASSERT_EQ(SQLITE_INTERRUPT, cancelled.result_code());
+  sqlite::query ok(db, "SELECT 1");
+  ok.step();
+  ASSERT_EQ(SQLITE_ROW, ok.result_code());
+}
+
+TEST(SqliteTest, BlobStream) {
+  sqlite::database::type_ptr db(new sqlite::database::type(":memory:"));
+  sqlite::query create_table(db, "CREATE TABLE `test_table` (`id` INTEGER PRIMARY KEY, `data` BLOB)");
+  create_table.step();
+  const size_t blob_size = 3 * 1024 * 1024 + 17;
+  sqlite::query insert(db, "INSERT INTO `test_table` (`id`, `data`) VALUES (?, ?)");
+  for (int64_t id = 1; id <= 3; ++id) {
+    insert.bind(1, id);
+    insert.bind(2, sqlite::zeroblob(blob_size));
+    insert.step();
+    ASSERT_EQ(SQLITE_DONE, insert.result_code());
+    sqlite3_reset(insert.statement().get());
+  }
+
+  auto byte_at = [] (const int64_t id, const size_t i) { return char((i * 31 + size_t(id)) & 0xff); };
+  {
+    sqlite::blob_ostream out(db, "test_table", "data", 1, 4096);
+    ASSERT_TRUE(out.good());
+    for (int64_t id = 1; id <= 3; ++id) {
+      if (id > 1) {
+        ASSERT_EQ(SQLITE_OK, out.reopen(id));
+      }
+      std::vector<char> piece;
+      // Pieces smaller and larger than the chunk
+      for (size_t i = 0, len = 1; i < blob_size; i += len, len = len * 3 % 10007 + 1) {
+        piece.clear();
+        for (size_t k = i; k < std::min(blob_size, i + len); ++k) piece.push_back(byte_at(id, k));
+        out.write(piece.data(), std::streamsize(piece.size()));
+        ASSERT_TRUE(out.good());
+      }
+    }
+    // The blob does not grow
+    out.put('x');
+    out.flush();
+    ASSERT_FALSE(out.good());
+  }
+
+  sqlite::blob_istream in(db, "test_table", "data", 1, 1000);
+  for (int64_t id = 1; id <= 3; ++id) {
+    if (id > 1) {
+      ASSERT_EQ(SQLITE_OK, in.reopen(id));
+    }
+    ASSERT_EQ(blob_size, in.blob().size());
+    std::vector<char> read(blob_size);
+    size_t pos = 0;
+    for (size_t len = 7; pos < blob_size; len = len * 5 % 20011 + 1) {
+      in.read(read.data() + pos, std::streamsize(std::min(len, blob_size - pos)));
+      pos += size_t(in.gcount());
+      ASSERT_TRUE(in.good());
+    }
+    ASSERT_EQ(std::istream::traits_type::eof(), in.get());
+    bool same = true;
+    for (size_t i = 0; same && (i < blob_size); ++i) same = read[i] == byte_at(id, i);
+    ASSERT_TRUE(same);
+  }
+  in.clear();
+  in.seekg(12345);
+  ASSERT_EQ(byte_at(3, 12345), char(in.get()));
+  ASSERT_EQ(std::streamoff(12346), std::streamoff(in.tellg()));
+  in.seekg(-1, std::ios_base::end);
+  ASSERT_EQ(byte_at(3, blob_size - 1), char(in.get()));
+
+  // The whole value agrees with the streamed one
+  sqlite::query select(db, "SELECT `data` FROM `test_table` WHERE `id` = 2");
+  select.step();
+  const std::vector<uint8_t> whole = select.get<std::vector<uint8_t>>(0);
+  ASSERT_EQ(blob_size, whole.size());
+  ASSERT_EQ(uint8_t(byte_at(2, 4097)), whole[4097]);
+
+  ASSERT_NE(SQLITE_OK, in.reopen(100));
+  ASSERT_TRUE(in.fail());
+  sqlite::blob_istream missing(db, "test_table", "data", 100);
+  ASSERT_FALSE(missing.blob().is_open());
+  ASSERT_TRUE(missing.fail());
+}